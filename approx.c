@@ -0,0 +1,425 @@
+#include "u.h"
+
+#include <windows.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "buffer.h"
+#include "approx.h"
+
+#define WINDOW (2 * APPROX_MAX) // bytes kept for finding where matches start
+#define LANES 4 // stripes of text scored side by side, two to a register
+#define PIECE 0x4000 // bytes scored at a time
+
+/* Both distances are computed bit-parallel, with bit i of a state word
+   for the pattern prefix ending at pat[i]; a pattern fits in one word.
+
+   Hamming distance is Shift-And extended to k mismatches (Wu and
+   Manber): r[j] has bit i set if pat[0:i+1] ends here with at most j
+   mismatches.
+
+   Edit distance is Myers' bit-vector algorithm, which keeps the column
+   of the dynamic programming matrix as vertical deltas pv (+1) and mv
+   (-1), and score, the distance of the whole pattern to the best
+   substring ending here. Runs of ends within k give one match, at the
+   lowest score; its start is found by a small reversed DP over the bytes
+   before its end. */
+struct approx {
+    size_t len;
+    int k;
+    int edit;
+    const uchar *pat;
+    uint64 peq[256]; // positions of each byte in pat
+    uint64 hi; // bit len-1
+    uint64 r[APPROX_MAX];
+    uint64 pv, mv;
+    int score;
+    uint64 pos; // address of the next byte
+    uint64 start;
+    uchar ring[WINDOW]; // the bytes before pos
+    int open; // in a run of ends within k
+    int best;
+    uint64 best_end;
+    uchar win[WINDOW]; // the bytes before best_end, last first
+    size_t nwin;
+    uchar dist[PIECE]; // of the ends in the piece being fed, k+1 if over k
+    ApproxMatchProc proc;
+    void *arg;
+};
+
+static const uchar zeros[4096];
+
+/* reports the best match of the run that has just ended */
+static int
+report_run(struct approx *a)
+{
+    size_t m = a->len, n = a->nwin;
+    int d[WINDOW+1];
+    int best;
+    size_t bestj = 0;
+
+    a->open = 0;
+    /* pattern and text both reversed, so the alignment is anchored at
+       the end; d[j] is the distance of the pattern's last i bytes to the
+       last j bytes of text */
+    for (size_t j=0; j<=n; j++) d[j] = (int) j;
+    for (size_t i=1; i<=m; i++) {
+        int diag = d[0];
+        uchar c = a->pat[m-i];
+        d[0] = (int) i;
+        for (size_t j=1; j<=n; j++) {
+            int t = d[j];
+            int v = diag + (a->win[j-1] != c);
+            if (d[j] + 1 < v) v = d[j] + 1;
+            if (d[j-1] + 1 < v) v = d[j-1] + 1;
+            d[j] = v;
+            diag = t;
+        }
+    }
+    best = d[0];
+    for (size_t j=1; j<=n; j++) {
+        if (d[j] < best) {
+            best = d[j];
+            bestj = j;
+        }
+    }
+    return a->proc(a->arg, a->best_end - bestj, bestj, best);
+}
+
+/* Steps a over p[0:n], setting dist[i] to the distance of the match
+   ending at p[i] if it is within k. Returns how many are. */
+static size_t
+score_scalar(struct approx *a, const uchar *p, size_t n, uchar *dist)
+{
+    uint64 *r = a->r, pv = a->pv, mv = a->mv;
+    int k = a->k, score = a->score;
+    size_t nhit = 0;
+
+    for (size_t i=0; i<n; i++) {
+        uint64 eq = a->peq[p[i]];
+        if (a->edit) {
+            uint64 xv = eq | mv;
+            uint64 xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64 ph = mv | ~(xh | pv);
+            uint64 mh = pv & xh;
+            if (ph & a->hi) score++;
+            else if (mh & a->hi) score--;
+            /* the top row stays 0: a match may start anywhere */
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            if (score > k) continue;
+            dist[i] = (uchar) score;
+        } else {
+            uint64 prev = r[0];
+            int d = 0;
+            r[0] = (r[0] << 1 | 1) & eq;
+            for (int j=1; j<=k; j++) {
+                uint64 t = r[j];
+                r[j] = (t << 1 | 1) & eq | (prev << 1 | 1);
+                prev = t;
+            }
+            if (!(r[k] & a->hi)) continue;
+            while (!(r[d] & a->hi)) d++;
+            dist[i] = (uchar) d;
+        }
+        nhit++;
+    }
+    a->pv = pv;
+    a->mv = mv;
+    a->score = score;
+    return nhit;
+}
+
+#ifdef __SSE2__
+/* The striped steps below run LANES stripes of c bytes, stride apart,
+   lane l in half l%2 of register l/2. Lane 0 carries on from a, and
+   lane 3 leaves its state there. The other lanes start afresh and only
+   their ends from the warm-th on are kept. */
+
+static uint64
+high_half(__m128i x)
+{
+    uint64 q[2];
+
+    _mm_storeu_si128((__m128i *) q, x);
+    return q[1];
+}
+
+/* bit h set for each half h of x with bit len-1 set, given 64-len */
+static int
+top_bits(__m128i x, __m128i shift)
+{
+    return _mm_movemask_pd(_mm_castsi128_pd(_mm_sll_epi64(x, shift)));
+}
+
+static __m128i
+lane_peq(const struct approx *a, const uchar *q, size_t stride)
+{
+    return _mm_set_epi64x((long long) a->peq[q[stride]],
+                          (long long) a->peq[q[0]]);
+}
+
+static size_t
+lanes_edit(struct approx *a, const uchar *p, size_t c, size_t stride,
+           size_t warm)
+{
+    __m128i ones = _mm_set1_epi32(-1), one = _mm_set_epi32(0, 1, 0, 1);
+    __m128i down = _mm_cvtsi32_si128((int) a->len - 1);
+    __m128i limit = _mm_set1_epi32(a->k + 1);
+    __m128i pv[2], mv[2], sc[2];
+    size_t nhit = 0;
+
+    pv[0] = _mm_set_epi64x(-1, (long long) a->pv);
+    mv[0] = _mm_set_epi64x(0, (long long) a->mv);
+    sc[0] = _mm_set_epi32(0, (int) a->len, 0, a->score);
+    pv[1] = ones;
+    mv[1] = _mm_setzero_si128();
+    sc[1] = _mm_set_epi32(0, (int) a->len, 0, (int) a->len);
+    for (size_t t=0; t<c; t++) {
+        for (int v=0; v<2; v++) {
+            __m128i eq = lane_peq(a, p + 2*v*stride + t, stride);
+            __m128i xv = _mm_or_si128(eq, mv[v]);
+            __m128i xh = _mm_or_si128(_mm_xor_si128(_mm_add_epi64(
+                             _mm_and_si128(eq, pv[v]), pv[v]), pv[v]), eq);
+            __m128i ph = _mm_or_si128(mv[v], _mm_xor_si128(
+                             _mm_or_si128(xh, pv[v]), ones));
+            __m128i mh = _mm_and_si128(pv[v], xh);
+            int m;
+            sc[v] = _mm_add_epi64(sc[v],
+                        _mm_and_si128(_mm_srl_epi64(ph, down), one));
+            sc[v] = _mm_sub_epi64(sc[v],
+                        _mm_and_si128(_mm_srl_epi64(mh, down), one));
+            ph = _mm_slli_epi64(ph, 1);
+            mh = _mm_slli_epi64(mh, 1);
+            pv[v] = _mm_or_si128(mh, _mm_xor_si128(_mm_or_si128(xv, ph),
+                                                   ones));
+            mv[v] = _mm_and_si128(ph, xv);
+            /* the high words of the scores are 0 */
+            m = _mm_movemask_ps(_mm_castsi128_ps(
+                    _mm_cmplt_epi32(sc[v], limit))) & 5;
+            if (!m) continue;
+            for (int h=0; h<2; h++) {
+                int l = 2*v + h;
+                if (!(m >> 2*h & 1) || l && t < warm) continue;
+                a->dist[l*stride + t] = (uchar) (h ? high_half(sc[v])
+                                                 : _mm_cvtsi128_si32(sc[v]));
+                nhit++;
+            }
+        }
+    }
+    a->pv = high_half(pv[1]);
+    a->mv = high_half(mv[1]);
+    a->score = (int) high_half(sc[1]);
+    return nhit;
+}
+
+static size_t
+lanes_hamming(struct approx *a, const uchar *p, size_t c, size_t stride,
+              size_t warm)
+{
+    __m128i one = _mm_set_epi32(0, 1, 0, 1);
+    __m128i up = _mm_cvtsi32_si128(64 - (int) a->len);
+    __m128i r[APPROX_MAX][2];
+    int k = a->k;
+    size_t nhit = 0;
+
+    for (int j=0; j<=k; j++) {
+        r[j][0] = _mm_set_epi64x(0, (long long) a->r[j]);
+        r[j][1] = _mm_setzero_si128();
+    }
+    for (size_t t=0; t<c; t++) {
+        for (int v=0; v<2; v++) {
+            __m128i eq = lane_peq(a, p + 2*v*stride + t, stride);
+            __m128i prev = r[0][v];
+            int m;
+            r[0][v] = _mm_and_si128(_mm_or_si128(_mm_slli_epi64(prev, 1),
+                                                 one), eq);
+            for (int j=1; j<=k; j++) {
+                __m128i x = r[j][v];
+                r[j][v] = _mm_or_si128(
+                    _mm_and_si128(_mm_or_si128(_mm_slli_epi64(x, 1), one),
+                                  eq),
+                    _mm_or_si128(_mm_slli_epi64(prev, 1), one));
+                prev = x;
+            }
+            m = top_bits(r[k][v], up);
+            if (!m) continue;
+            for (int h=0; h<2; h++) {
+                int l = 2*v + h, d = 0;
+                if (!(m >> h & 1) || l && t < warm) continue;
+                while (!(top_bits(r[d][v], up) >> h & 1)) d++;
+                a->dist[l*stride + t] = (uchar) d;
+                nhit++;
+            }
+        }
+    }
+    for (int j=0; j<=k; j++) a->r[j] = high_half(r[j][1]);
+    return nhit;
+}
+#endif
+
+/* Sets a->dist for p[0:n] as score_scalar does, n at most PIECE.
+
+   Each byte's step depends on the one before, so with SSE2 a long piece
+   is cut into LANES stripes stepped together in 64-bit lanes, which
+   also spares a 32-bit build the pairs of registers 64-bit words take.
+   The first stripe carries on from a; the others start afresh warm
+   bytes early, which is enough for both distances to forget where they
+   started, since a match within len differences spans fewer than 2*len
+   bytes. The last stripe's state is then a's exactly, and the rest of
+   the piece is stepped one byte at a time. */
+static size_t
+score(struct approx *a, const uchar *p, size_t n)
+{
+    size_t nhit = 0, i = 0;
+
+    memset(a->dist, a->k + 1, n);
+#ifdef __SSE2__
+    size_t warm = 2 * a->len;
+    size_t c = (n + (LANES-1) * warm) / LANES; // steps per stripe
+    if (c >= 4 * warm) {
+        size_t stride = c - warm;
+        nhit = a->edit ? lanes_edit(a, p, c, stride, warm)
+                       : lanes_hamming(a, p, c, stride, warm);
+        i = (LANES-1) * stride + c;
+    }
+#endif
+    return nhit + score_scalar(a, p+i, n-i, a->dist+i);
+}
+
+/* Reports the matches of p[0:n] from the nhit ends within k in a->dist.
+   The state is kept in a only at calls to proc, not stored per byte. */
+static int
+report(struct approx *a, const uchar *p, size_t n, size_t nhit)
+{
+    uint64 pos = a->pos; // of p
+    int k = a->k;
+    int ret;
+
+    for (size_t i=0; i<n && (nhit || a->open); i++) {
+        int d = a->dist[i];
+        if (d > k && !a->open) continue;
+        if (d <= k) nhit--;
+        if (!a->edit) {
+            a->pos = pos + i+1;
+            ret = a->proc(a->arg, a->pos - a->len, a->len, d);
+        } else if (d > k) {
+            ret = report_run(a);
+        } else {
+            if (!a->open || d < a->best) {
+                size_t w = (size_t) min(pos + i+1 - a->start, a->len + k);
+                /* from p, then from the ring of the bytes before it */
+                for (size_t j=0; j<w; j++) {
+                    a->win[j] = j <= i ? p[i-j]
+                                : a->ring[(pos - (j-i)) % WINDOW];
+                }
+                a->nwin = w;
+                a->best = d;
+                a->best_end = pos + i+1;
+                a->open = 1;
+            }
+            ret = 0;
+        }
+        if (ret) return ret;
+    }
+    a->pos = pos + n;
+    for (size_t i=n-min(n, WINDOW); i<n; i++) {
+        a->ring[(pos+i) % WINDOW] = p[i];
+    }
+    return 0;
+}
+
+static int
+feed(struct approx *a, const uchar *p, size_t n)
+{
+    while (n) {
+        size_t k = min(n, PIECE);
+        int ret = report(a, p, k, score(a, p, k));
+        if (ret) return ret;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/* Feeds n zero bytes. Once a block of zeros leaves the state as it was
+   without reporting anything, so would the rest. */
+static int
+feed_zeros(struct approx *a, uint64 n)
+{
+    while (n) {
+        size_t k = (size_t) min(n, sizeof zeros);
+        uint64 r[APPROX_MAX], pv = a->pv, mv = a->mv;
+        int score = a->score, open = a->open;
+        int ret;
+        memcpy(r, a->r, sizeof r);
+        ret = feed(a, zeros, k);
+        if (ret) return ret;
+        n -= k;
+        if (k == sizeof zeros && !open && !a->open &&
+            (a->edit ? pv == a->pv && mv == a->mv && score == a->score
+                     : !memcmp(r, a->r, sizeof r)))
+        {
+            a->pos += n;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int
+approx_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct approx *a = arg;
+    int ret;
+
+    /* unreadable gaps read as zeros */
+    if (addr > a->pos) {
+        ret = feed_zeros(a, addr - a->pos);
+        if (ret) return ret;
+    }
+    return feed(a, data, len);
+}
+
+/* Reports to proc the matches of pat[0:len] in [start, end) at most k
+   bytes away, in order. With Hamming distance (edit = 0) every window of
+   len bytes within k substitutions is reported. With edit distance,
+   which also allows inserted and deleted bytes, the ends of matches
+   within k come in runs, and each run gives a single match where the
+   distance is lowest. len is at most APPROX_MAX and k less than len.
+   proc returns nonzero to stop the search, which should be positive.
+   Returns the value proc stopped with, -1 on read errors, or 0. */
+int
+buf_search_approx(Buffer *b, const uchar *pat, size_t len, int k, int edit,
+                  uint64 start, uint64 end, ApproxMatchProc proc, void *arg)
+{
+    struct approx *a;
+    uint64 size = buf_size(b);
+    int ret;
+
+    if (!len || len > APPROX_MAX || k < 0 || (size_t) k >= len) return 0;
+    if (end > size) end = size;
+    if (start > end) start = end;
+    a = xmalloc0(sizeof *a);
+    a->len = len;
+    a->k = k;
+    a->edit = edit;
+    a->pat = pat;
+    for (size_t i=0; i<len; i++) a->peq[pat[i]] |= (uint64) 1 << i;
+    a->hi = (uint64) 1 << (len-1);
+    a->pv = ~(uint64) 0;
+    a->score = (int) len;
+    a->pos = start;
+    a->start = start;
+    a->proc = proc;
+    a->arg = arg;
+    ret = buf_scan(b, start, end - start, approx_span, a);
+    if (!ret && a->pos < end) ret = feed_zeros(a, end - a->pos);
+    if (!ret && a->open) ret = report_run(a);
+    free(a);
+    return ret;
+}
@@ -0,0 +1,11 @@
+/* approximate search, allowing a few differing bytes */
+
+#define APPROX_MAX 64 // longest pattern
+
+/* The match is [addr, addr+len), dist bytes away from the pattern. */
+typedef int (*ApproxMatchProc)(void *arg, uint64 addr, uint64 len,
+                               int dist);
+
+int buf_search_approx(Buffer *, const uchar *pat, size_t len, int k,
+                      int edit, uint64 start, uint64 end, ApproxMatchProc,
+                      void *arg);
@@ -0,0 +1,117 @@
+/* times scans and random reads of a file at each cache block size */
+
+#include "u.h"
+
+#include <windows.h>
+
+#include "buffer.h"
+
+#define N_READ 100000 // random reads per block size
+#define READ_LEN 16 // bytes per random read
+
+static double
+seconds(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double) t.QuadPart / freq.QuadPart;
+}
+
+static uint64
+next_random(uint64 *state)
+{
+    uint64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* sums every 64th byte, so that the data is at least looked at */
+static int
+sum_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    uint64 *sum = arg;
+    for (size_t i=0; i<len; i+=64) *sum += data[i];
+    return 0;
+}
+
+static int
+open_buffer(Buffer *b, const char *path)
+{
+    /* \\.\PhysicalDrive0, \\.\C: and the like */
+    int device = !strncmp(path, "\\\\.\\", 4);
+    HANDLE file = CreateFileA(path, GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+                              OPEN_EXISTING,
+                              device ? FILE_FLAG_NO_BUFFERING : 0, 0);
+    uchar c;
+
+    if (file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return -1;
+    }
+    if (device) return buf_load_device(b, file);
+    if (buf_load_file(b, file, 0)) return -1;
+    if (!buf_size(b)) {
+        fprintf(stderr, "%s: empty\n", path);
+        return -1;
+    }
+    /* Reads of an unedited file come straight from its mapping and never
+       touch the cache, so rewrite a byte with itself. */
+    c = buf_getbyte(b, 0);
+    buf_replace(b, 0, &c, 1);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    Buffer *b;
+    uint64 size;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: blockbench <file or device>\n");
+        return 2;
+    }
+    b = xmalloc(sizeof_Buffer);
+    if (buf_init(b) || open_buffer(b, argv[1])) return 1;
+    size = buf_size(b);
+    if (size < READ_LEN) {
+        fprintf(stderr, "%s: too small\n", argv[1]);
+        return 1;
+    }
+    /* so that every size reads a file from the system cache */
+    {
+        uint64 sum = 0;
+        buf_scan(b, 0, size, sum_span, &sum);
+    }
+    printf("%10s %12s %14s\n", "block", "scan MB/s", "reads/s");
+    for (int log2 = 12; log2 <= 24; log2 += 2) {
+        uint64 sum = 0, state = 88172645463325252ULL;
+        uchar data[READ_LEN];
+        double t, scan, reads;
+
+        if (buf_set_block_size(b, (size_t) 1 << log2)) continue;
+        t = seconds();
+        buf_scan(b, 0, size, sum_span, &sum);
+        scan = seconds() - t;
+        t = seconds();
+        for (int i=0; i<N_READ; i++) {
+            uint64 addr = next_random(&state) % (size - READ_LEN + 1);
+            buf_read(b, data, addr, READ_LEN);
+            sum += data[0];
+        }
+        reads = seconds() - t;
+        printf("%10lu %12.1f %14.0f\n", 1UL << log2,
+               size / scan / 1e6, N_READ / reads);
+        /* keeps the work from being optimized away */
+        if (sum == 1) putchar(' ');
+    }
+    buf_finalize(b);
+    free(b);
+    return 0;
+}
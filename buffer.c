@@ -2,71 +2,195 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <winioctl.h>
 #include <tchar.h>
 
 #include "buffer.h"
+#include "entropy.h"
 #include "winutil.h"
 
 #define N_CACHE_BLOCK 16
-#define LOG2_CACHE_BLOCK_SIZE 16
+#define LOG2_CACHE_BLOCK_SIZE 16 // default
 #define CACHE_BLOCK_SIZE (1 << LOG2_CACHE_BLOCK_SIZE)
+#define MIN_LOG2_BLOCK_SIZE 12
+#define MAX_LOG2_BLOCK_SIZE 24
+#define BLOCK_SIZE(b) ((size_t) 1 << (b)->log2_block)
 #define VALID 1
+#define DEFAULT_IO_DEPTH 4
+#define MAX_IO_DEPTH 32
+#define PAGE_SIZE 4096
+#define VIEW_SPAN ((uint64) 1 << 20) // bytes per buf_scan span of a mapped file
+#define MIN_VIEW_READ 4096 // smaller reads go through the block cache
+#ifdef _WIN64
+#define MAX_VIEW ((uint64) -1)
+#else
+#define MAX_VIEW ((uint64) 256 << 20) // leaves room in a 2 GiB address space
+#endif
+#define DEFAULT_UNDO_LIMIT ((uint64) 64 << 20)
+#define SPILL_CHUNK ((size_t) 1 << 20) // undo file data spilled at a time
+#define N_SUMMARY_LEVEL 3
+#define SUM_VALID 0x80
+
+/* not declared for _WIN32_WINNT < 0x0501 */
+#ifndef IOCTL_DISK_GET_LENGTH_INFO
+#define IOCTL_DISK_GET_LENGTH_INFO \
+    CTL_CODE(IOCTL_DISK_BASE, 0x0017, METHOD_BUFFERED, FILE_READ_ACCESS)
+#endif
 
 enum {
-    SENTINEL, // must be 0
-    BRANCH,
+    BRANCH = 1, // 0 is no kind
     SEG_ZERO,
     SEG_FILE,
     SEG_MEM,
+    SEG_HOLE, // unreadable part of the file, reads as zeros
+    SEG_SPILL, // SEG_MEM data moved to the undo spill file
+};
+
+/* where file offsets point */
+enum {
+    SRC_FILE,
+    SRC_PROCESS, // file is a process handle, offsets are addresses
 };
 
+/* Segments and branches start alike, so that either can be a rope node.
+   Nodes are shared between clones of a buffer, so each counts the
+   references to it, and a shared one is copied before it is changed. */
 typedef struct segment {
-    struct segment *next, *prev;
     uchar kind;
+    int refs;
     uint64 len;
     union {
-        /* SEG_FILE */
+        /* SEG_FILE, SEG_HOLE */
         struct {
             uint64 offset;
             uchar *data;
+            uint64 hash; // of the contents, if hashed
+            uchar hashed;
         } file;
         /* SEG_MEM */
         struct {
+            /* bytes [dirty_start, dirty_end) of the segment may differ
+               from the file at orig; a segment created from new data is
+               dirty throughout */
+            uint64 orig;
+            size_t dirty_start;
+            size_t dirty_end;
             size_t offset;
             size_t cap;
             uchar data[];
         } mem;
+        /* SEG_SPILL, only in undo history */
+        struct {
+            uint64 offset;
+            uint64 orig;
+            size_t dirty_start;
+            size_t dirty_end;
+        } spill;
     };
 } Segment;
 
 typedef struct rope {
-    struct rope *left, *right; // both non-null
     uchar kind; // = BRANCH
+    int refs;
     uint64 len;
+    struct rope *left, *right; // both non-null
+    /* whole subtree is unmodified file data starting at fileoff */
+    uchar clean;
+    uint64 fileoff;
+    uchar hashed; // hash is that of the subtree's contents
+    uint64 hash;
+    uint64 nleaf; // segments in the subtree
+    uint64 data; // SEG_MEM bytes allocated in the subtree
 } Rope;
 
 #define ROPE(x) ((Rope*)(x))
 #define SEGMENT(x) ((Segment*)(x))
 
+#define NO_ORIG ((uint64)-1)
+
 struct cache_entry {
     uint64 addr;
     uchar *data;
     uchar flags;
 };
 
+/* min, max and entropy of a run of file bytes; hist[i] is the share of
+   bytes 16*i to 16*i+15, scaled to 255 */
+struct block_summary {
+    uchar min, max;
+    uchar flags; // SUM_*, zero if not computed
+    float entropy;
+    uchar hist[16];
+};
+
+struct listener {
+    struct listener *next;
+    BufChangeProc proc;
+    void *arg;
+};
+
+/* a queued edit; addr is relative to the buffer at buf_begin_batch */
+struct edit {
+    uint64 addr;
+    uint64 removed;
+    struct segment *seg; // inserted bytes, 0 if none
+    int seq;
+};
+
+/* puts segs back in place of [addr, addr+removed) */
+struct hunk {
+    uint64 addr;
+    uint64 removed;
+    Segment **segs;
+    int nseg;
+};
+
+/* Applying a step swaps its hunks with the data they cover, which
+   turns it into the step that reverts it. */
+struct undo {
+    struct undo *older, *newer;
+    struct hunk *hunks; // by address
+    int nhunk;
+    uint64 mem; // SEG_MEM bytes held
+};
+
 struct buffer {
     HANDLE file;
+    HANDLE async_file; // file reopened for overlapped reads, if possible
+    int io_depth;
+    /* file reads and writes must be aligned to this; > 1 only for block
+       devices */
+    uint sector_size;
+    uchar source;
+    uchar fixed_size; // devices and processes
     uint64 file_size;
     uint64 buffer_size;
     Rope *rope; // non-null unless buffer is empty
     struct cache_entry *cache;
     uchar *cache_data;
+    uchar log2_block; // of cache blocks and buf_scan reads
+    uchar large_pages; // cache_data is on large pages
     Region tmp;
-    struct {
-        struct segment *first, *last; // both non-null
-        uchar kind; // = SENTINEL
-    } sentinel;
     int next_cache;
+    struct listener *listeners;
+    struct edit *batch;
+    int nbatch, batch_cap;
+    uchar batching;
+    struct block_summary *summary[N_SUMMARY_LEVEL]; // 0 until summarized
+    uint64 summary_next; // first level-0 block buf_summarize may not have done
+    uchar *summary_buf;
+    struct undo *undo_oldest, *undo_newest;
+    struct undo *undo_pos; // newest step not undone, 0 if none
+    uint64 undo_mem; // SEG_MEM bytes held by undo steps
+    uint64 undo_limit;
+    HANDLE spill_file;
+    uint64 spill_size;
+    const uchar *view; // whole file mapped read-only, or 0
+    volatile LONG view_failed; // reading the view hit a disk error
+    uint64 batch_mem; // SEG_MEM bytes queued in the batch
+    uint64 mem_soft, mem_hard; // 0 for no limit
+    uint64 compacted; // memory in use after the last compaction
+    int *file_refs; // buffers sharing the file, if cloned
 };
 
 const int sizeof_Buffer = sizeof(Buffer);
@@ -83,12 +207,62 @@ seek(HANDLE file, uint64 offset)
     return 0;
 }
 
+/* Reads len bytes of the file at offset off. Process memory is read a
+   page at a time only if the whole range can't be read at once, and
+   unreadable pages read as zeros. */
+static int
+read_source(Buffer *b, uint64 off, uchar *dst, DWORD len, DWORD *nread)
+{
+    OVERLAPPED ov;
+
+    if (b->source == SRC_PROCESS) {
+        SIZE_T n;
+        if (!ReadProcessMemory(b->file, (LPCVOID)(uintptr_t) off, dst, len,
+                               &n) || n != len)
+        {
+            DWORD i = 0;
+            while (i < len) {
+                DWORD n1 = PAGE_SIZE - ((DWORD)(off+i) & (PAGE_SIZE-1));
+                if (n1 > len-i) n1 = len-i;
+                if (!ReadProcessMemory(b->file, (LPCVOID)(uintptr_t)(off+i),
+                                       dst+i, n1, &n) || n != n1)
+                {
+                    memset(dst+i, 0, n1);
+                }
+                i += n1;
+            }
+        }
+        *nread = len;
+        return 0;
+    }
+    /* at an offset rather than after a seek, so that scans on several
+       threads don't move the file pointer under each other */
+    memset(&ov, 0, sizeof ov);
+    ov.Offset = (DWORD) off;
+    ov.OffsetHigh = (DWORD)(off >> 32);
+    return ReadFile(b->file, dst, len, nread, &ov) ? 0 : -1;
+}
+
+static int
+write_source(Buffer *b, uint64 off, const uchar *src, DWORD len)
+{
+    DWORD nwritten;
+    if (b->source == SRC_PROCESS) {
+        SIZE_T n;
+        return WriteProcessMemory(b->file, (LPVOID)(uintptr_t) off, src, len,
+                                  &n) && n == len ? 0 : -1;
+    }
+    if (seek(b->file, off)) return -1;
+    return WriteFile(b->file, src, len, &nwritten, 0) && nwritten == len ?
+        0 : -1;
+}
+
 static int
 find_cache_opt(Buffer *b, uint64 addr)
 {
     assert(addr >= 0 && addr < b->file_size);
 
-    uint64 base = addr & -CACHE_BLOCK_SIZE;
+    uint64 base = addr & -(uint64) BLOCK_SIZE(b);
     for (int i=0; i<N_CACHE_BLOCK; i++) {
         struct cache_entry *c = &b->cache[i];
         if ((c->flags & VALID) && base == c->addr) return i;
@@ -97,18 +271,28 @@ find_cache_opt(Buffer *b, uint64 addr)
     return -1;
 }
 
+/* Returns the cache block holding addr, reading it in if need be, or -1
+   if it could not be read. */
 static int
 find_cache(Buffer *b, uint64 addr)
 {
     int ret = find_cache_opt(b, addr);
     if (ret >= 0) return ret;
 
-    uint64 base = addr & -CACHE_BLOCK_SIZE;
+    uint64 base = addr & -(uint64) BLOCK_SIZE(b);
+    /* devices are read in whole sectors, and need not end on a block */
+    DWORD len = (DWORD) min(b->file_size - base, BLOCK_SIZE(b));
+    DWORD rlen = len + (b->sector_size-1) & ~(b->sector_size-1);
     DWORD nread;
 
-    seek(b->file, base);
     ret = b->next_cache;
-    ReadFile(b->file, b->cache[ret].data, CACHE_BLOCK_SIZE, &nread, 0);
+    b->cache[ret].flags = 0;
+    if (read_source(b, base, b->cache[ret].data, rlen, &nread) ||
+        nread < len)
+    {
+        eprintf("read at %llx failed\n", base);
+        return -1;
+    }
     b->cache[ret].addr = base;
     b->cache[ret].flags = VALID;
     b->next_cache = (ret+1)&(N_CACHE_BLOCK-1);
@@ -116,17 +300,129 @@ find_cache(Buffer *b, uint64 addr)
     return ret;
 }
 
+/* 0 if the block could not be read */
 static uchar *
 get_file_data(Buffer *b, uint64 addr)
 {
     int block = find_cache(b, addr);
-    return &b->cache[block].data[addr & (CACHE_BLOCK_SIZE-1)];
+    if (block < 0) return 0;
+    return &b->cache[block].data[addr & (BLOCK_SIZE(b)-1)];
 }
 
+/* unreadable bytes read as 0 */
 static uchar
 get_file_byte(Buffer *b, uint64 addr)
 {
-    return *get_file_data(b, addr);
+    uchar *p = get_file_data(b, addr);
+    return p ? *p : 0;
+}
+
+/* A disk error while paging in the view raises EXCEPTION_IN_PAGE_ERROR
+   in whatever code touched it, so the view is only read by copy_bytes.
+   Its rep movsb keeps all of its progress in registers, which lets
+   view_fault zero the rest of the faulting page in dst, move the copy
+   past it, count the fault in eax, and resume the instruction. Nothing
+   unwinds through the exception dispatcher. */
+extern const char view_copy_insn[] __asm__("view_copy_insn");
+
+static int view_handler;
+
+static __attribute__((noinline, noclone)) int
+copy_bytes(uchar *dst, const uchar *src, size_t n)
+{
+    int faults = 0;
+
+    __asm__ volatile ("view_copy_insn: rep movsb"
+                      : "+D" (dst), "+S" (src), "+c" (n), "+a" (faults)
+                      : : "memory");
+    return faults;
+}
+
+#ifdef _WIN64
+#define REG(r) R##r // of CONTEXT
+#else
+#define REG(r) E##r
+#endif
+
+static LONG CALLBACK
+view_fault(EXCEPTION_POINTERS *e)
+{
+    EXCEPTION_RECORD *er = e->ExceptionRecord;
+    CONTEXT *c = e->ContextRecord;
+    uintptr_t at, end, k;
+
+    if (er->ExceptionCode != EXCEPTION_IN_PAGE_ERROR ||
+        c->REG(ip) != (uintptr_t) view_copy_insn)
+    {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+    /* to the end of the faulting page, which the copy has reached */
+    at = (uintptr_t) max(er->ExceptionInformation[1], c->REG(si));
+    end = (at | (PAGE_SIZE-1)) + 1;
+    k = (uintptr_t) min(end - c->REG(si), c->REG(cx));
+    memset((void *)(uintptr_t) c->REG(di), 0, k);
+    c->REG(si) += k;
+    c->REG(di) += k;
+    c->REG(cx) -= k;
+    c->REG(ax)++;
+    return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+/* Copies view[addr:addr+n] to dst. Returns -1 if it could not all be
+   read, after which the view is no longer used and reads go through
+   the rope. */
+static int
+copy_view(Buffer *b, uchar *dst, const uchar *view, uint64 addr, size_t n)
+{
+    if (copy_bytes(dst, view + addr, n)) {
+        b->view_failed = 1;
+        eprintf("copy_view: read error near %llu\n", addr);
+        return -1;
+    }
+    return 0;
+}
+
+/* Maps the whole file, so that reads of an unedited buffer go straight
+   to memory instead of through the rope and the block cache. Files too
+   large for the address space, or for MAX_VIEW, are left unmapped. */
+static void
+map_view(Buffer *b)
+{
+    HANDLE mapping;
+
+    if (!b->file_size || b->file_size > MAX_VIEW ||
+        b->file_size != (SIZE_T) b->file_size)
+    {
+        return;
+    }
+    if (!view_handler) {
+        if (!AddVectoredExceptionHandler(1, view_fault)) return;
+        view_handler = 1;
+    }
+    mapping = CreateFileMapping(b->file, 0, PAGE_READONLY, 0, 0, 0);
+    if (!mapping) return;
+    b->view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    /* the view keeps the mapping alive */
+    CloseHandle(mapping);
+}
+
+static void
+unmap_view(Buffer *b)
+{
+    if (b->view) UnmapViewOfFile(b->view);
+    b->view = 0;
+    b->view_failed = 0;
+}
+
+/* the contents of the buffer, if it is a single piece of the mapped
+   file */
+static const uchar *
+unedited_view(Buffer *b)
+{
+    if (!b->view || b->view_failed || !b->rope || b->rope->kind != SEG_FILE) {
+        return 0;
+    }
+    return b->view + SEGMENT(b->rope)->file.offset;
 }
 
 static Segment *
@@ -158,6 +454,15 @@ start:
     return s;
 }
 
+/* the segment starting at addr, or 0 at the end of r */
+static Segment *
+segment_at(Rope *r, uint64 addr)
+{
+    uint64 segoff;
+    if (!r || addr >= r->len) return 0;
+    return find_segment(r, addr, &segoff);
+}
+
 uchar
 buf_getbyte(Buffer *b, uint64 addr)
 {
@@ -171,6 +476,7 @@ buf_getbyte(Buffer *b, uint64 addr)
     Segment *s = find_segment(b->rope, addr, &segoff);
     switch (s->kind) {
     case SEG_ZERO:
+    case SEG_HOLE:
         return 0;
     case SEG_FILE:
         return get_file_byte(b, s->file.offset + segoff);
@@ -181,80 +487,163 @@ buf_getbyte(Buffer *b, uint64 addr)
     return 0;
 }
 
-static void
-kmp_table(int *T, const uchar *pat, int len)
-{
-    int pos = 2;
-    int cnd = 0;
-    // forall i:nat, 0 < i < len ->
-    // T[i] < i /\ ...
-    // pat[i-T[i]:i] = pat[0:T[i]] /\ ...
-    // forall j:nat, T[i] < j < len -> pat[i-j:i] <> pat[0:j]
-    T[1] = 0; // T[0] is undefined
-    while (pos < len) {
-        if (pat[pos-1] == pat[cnd]) {
-            T[pos++] = cnd+1;
-            cnd++;
-        } else {
-            // pat[pos-1] != pat[cnd]
-            if (cnd > 0) {
-                cnd = T[cnd];
-            } else {
-                T[pos++] = 0;
-            }
+static Segment *new_file_seg(uint64 len, uint64 offset);
+static Segment *new_hole_seg(uint64 len, uint64 offset);
+static Segment *new_mem_seg(uint64 len);
+
+typedef HANDLE (WINAPI *ReOpenFileProc)(HANDLE, DWORD, DWORD, DWORD);
+
+/* ReOpenFile is not available before Vista, in which case reads stay
+   synchronous */
+static HANDLE
+reopen_overlapped(HANDLE file, DWORD flags)
+{
+    static ReOpenFileProc reopen;
+    static uchar looked_up;
+
+    if (!looked_up) {
+        HMODULE kernel32 = GetModuleHandle(TEXT("kernel32.dll"));
+        if (kernel32) {
+            reopen = (ReOpenFileProc) GetProcAddress(kernel32, "ReOpenFile");
         }
+        looked_up = 1;
     }
+    if (!reopen) return INVALID_HANDLE_VALUE;
+    return reopen(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                  FILE_FLAG_OVERLAPPED | flags);
 }
 
-int
-buf_kmp_search(Buffer *b, const uchar *pat, int len, uint64 start, uint64 *pos)
+typedef SIZE_T (WINAPI *GetLargePageMinimumProc)(void);
+
+/* Size of large pages, or 0 before Vista, which has none. */
+static SIZE_T
+large_page_size(void)
 {
-    int *T;
-    uint64 m;
-    int i;
-    int ret;
+    static SIZE_T size;
+    static uchar looked_up;
 
-    assert(len);
-    T = xmalloc(len * sizeof *T);
-    kmp_table(T, pat, len);
-    m = start; // start of potential match
-    i = 0;
-    while (m+i < b->buffer_size) {
-        if (pat[i] == buf_getbyte(b, m+i)) {
-            if (i == len - 1) {
-                *pos = m;
-                ret = 0;
-                goto end; /* match found */
-            }
-            i++;
-        } else {
-            // current character does not match
-            if (i) {
-                m += i-T[i];
-                i = T[i];
-            } else {
-                m++;
-            }
+    if (!looked_up) {
+        HMODULE kernel32 = GetModuleHandle(TEXT("kernel32.dll"));
+        GetLargePageMinimumProc get_minimum = 0;
+
+        if (kernel32) {
+            get_minimum = (GetLargePageMinimumProc)
+                GetProcAddress(kernel32, "GetLargePageMinimum");
         }
+        if (get_minimum) size = get_minimum();
+        looked_up = 1;
     }
-    /* no match */
-    ret = -1;
-end:
-    free(T);
-    return ret;
+    return size;
+}
+
+/* Enables SeLockMemoryPrivilege, which allocating large pages needs,
+   keeping its previous state in *old. Returns the token to restore it
+   through, or 0 if the account is not granted the privilege. */
+static HANDLE
+enable_lock_memory(TOKEN_PRIVILEGES *old)
+{
+    HANDLE token;
+    TOKEN_PRIVILEGES tp;
+    DWORD len;
+
+    if (!OpenProcessToken(GetCurrentProcess(),
+                          TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+    {
+        return 0;
+    }
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    /* succeeds without enabling anything if the privilege is not held */
+    if (LookupPrivilegeValue(0, SE_LOCK_MEMORY_NAME,
+                             &tp.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &tp, sizeof *old, old, &len) &&
+        GetLastError() == ERROR_SUCCESS)
+    {
+        return token;
+    }
+    CloseHandle(token);
+    return 0;
 }
 
+/* puts back what enable_lock_memory changed */
 static void
-link(Segment *s, Segment *prev, Segment *next)
+restore_lock_memory(HANDLE token, TOKEN_PRIVILEGES *old)
 {
-    s->prev = prev;
-    prev->next = s;
-    s->next = next;
-    next->prev = s;
+    /* nothing to undo if it was enabled already */
+    if (old->PrivilegeCount) AdjustTokenPrivileges(token, FALSE, old, 0, 0, 0);
+    CloseHandle(token);
 }
 
-static Segment *new_file_seg(uint64 len, uint64 offset);
-static Segment *new_mem_seg(uint64 len);
+/* (Re)allocates the block cache with blocks of 1 << log2 bytes, on large
+   pages if possible once it spans at least one. Cached data is lost. */
+static int
+alloc_cache(Buffer *b, int log2)
+{
+    size_t size = (size_t) N_CACHE_BLOCK << log2;
+    SIZE_T large = large_page_size();
+    uchar *data = 0;
+    uchar large_pages = 0;
+    struct cache_entry *cache;
+
+    if (large && size >= large) {
+        TOKEN_PRIVILEGES old;
+        HANDLE token = enable_lock_memory(&old);
+        if (token) {
+            data = VirtualAlloc(0, size + large - 1 & ~(large - 1),
+                                MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                                PAGE_READWRITE);
+            restore_lock_memory(token, &old);
+        }
+        large_pages = data != 0;
+    }
+    /* page aligned, as unbuffered reads require */
+    if (!data) {
+        data = VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE,
+                            PAGE_READWRITE);
+        if (!data) return -1;
+    }
+    cache = malloc(N_CACHE_BLOCK * sizeof *cache);
+    if (!cache) {
+        VirtualFree(data, 0, MEM_RELEASE);
+        return -1;
+    }
+    for (int i=0; i<N_CACHE_BLOCK; i++) {
+        cache[i].addr = 0;
+        cache[i].flags = 0;
+        cache[i].data = data + ((size_t) i << log2);
+    }
+
+    free(b->cache);
+    if (b->cache_data) VirtualFree(b->cache_data, 0, MEM_RELEASE);
+    b->cache = cache;
+    b->cache_data = data;
+    b->log2_block = log2;
+    b->large_pages = large_pages;
+    b->next_cache = 0;
+    return 0;
+}
+
+/* Sets the size of cache blocks and buf_scan reads, a power of two
+   between 4 KiB and 16 MiB and at least the sector size. Small blocks
+   suit random access, large ones long scans. */
+int
+buf_set_block_size(Buffer *b, size_t size)
+{
+    int log2 = MIN_LOG2_BLOCK_SIZE;
+
+    while (log2 < MAX_LOG2_BLOCK_SIZE && ((size_t) 1 << log2) < size) log2++;
+    if (((size_t) 1 << log2) != size || size < b->sector_size) {
+        eprintf("buf_set_block_size: unsupported size %lu\n",
+                (unsigned long) size);
+        return -1;
+    }
+    if (log2 == b->log2_block) return 0;
+    if (alloc_cache(b, log2)) {
+        eprintf("buf_set_block_size: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
 
 int
 buf_load_file(Buffer *b, HANDLE file, uint slurp_thresh)
@@ -294,109 +683,342 @@ buf_load_file(Buffer *b, HANDLE file, uint slurp_thresh)
         s = new_file_seg(size, 0);
         b->file = file;
         b->file_size = size;
+        b->async_file = reopen_overlapped(file, FILE_FLAG_SEQUENTIAL_SCAN);
+        map_view(b);
     }
 
-    if (s) link(s, SEGMENT(&b->sentinel), SEGMENT(&b->sentinel));
     b->rope = ROPE(s);
     b->buffer_size = size;
 
     return 0;
 }
 
+/* Loads a disk or volume opened with FILE_FLAG_NO_BUFFERING, so reading
+   it does not push everything else out of the system cache. */
 int
-buf_init(Buffer *b)
+buf_load_device(Buffer *b, HANDLE dev)
 {
-    uchar *cache_data;
-    struct cache_entry *cache;
+    LARGE_INTEGER length;
+    DISK_GEOMETRY geom;
+    DWORD n;
 
-    cache_data = malloc(N_CACHE_BLOCK << LOG2_CACHE_BLOCK_SIZE);
-    if (!cache_data) {
-nomem:
-        fputs("out of memory\n", stderr);
+    if (!DeviceIoControl(dev, IOCTL_DISK_GET_LENGTH_INFO, 0, 0,
+                         &length, sizeof length, &n, 0))
+    {
+        TCHAR errmsg[512];
+        format_error_code(errmsg, NELEM(errmsg), GetLastError());
+        T(fputs)(errmsg, stderr);
+        return -1;
+    }
+    b->sector_size = 512;
+    if (DeviceIoControl(dev, IOCTL_DISK_GET_DRIVE_GEOMETRY, 0, 0,
+                        &geom, sizeof geom, &n, 0) &&
+        geom.BytesPerSector)
+    {
+        b->sector_size = geom.BytesPerSector;
+    }
+    if (b->sector_size > (1 << MAX_LOG2_BLOCK_SIZE) ||
+        b->sector_size & (b->sector_size - 1))
+    {
+        eprintf("unsupported sector size %u\n", b->sector_size);
         return -1;
     }
+    /* blocks are read whole */
+    while (BLOCK_SIZE(b) < b->sector_size) {
+        if (alloc_cache(b, b->log2_block + 1)) return -1;
+    }
 
-    cache = malloc(N_CACHE_BLOCK * sizeof *b->cache);
-    if (!cache) {
-        free(cache_data);
-        goto nomem;
+    b->file = dev;
+    b->fixed_size = 1;
+    b->file_size = length.QuadPart;
+    b->buffer_size = length.QuadPart;
+    b->async_file = reopen_overlapped(dev, FILE_FLAG_NO_BUFFERING);
+    if (b->buffer_size) {
+        b->rope = ROPE(new_file_seg(b->buffer_size, 0));
     }
+    return 0;
+}
 
-    for (int i=0; i<N_CACHE_BLOCK; i++) {
-        cache[i].addr = 0;
-        cache[i].flags = 0;
-        cache[i].data = cache_data + (i << LOG2_CACHE_BLOCK_SIZE);
+static Rope *build_rope(Segment **segs, int n);
+static void free_summary(Buffer *);
+static void drop_summary(Buffer *, uint64, uint64);
+static void forget_hash(Rope *, uint64, uint64);
+static void record_edit(Buffer *, uint64, uint64, uint64);
+static void push_undo(Buffer *, struct hunk *, int);
+static void detach_undo(Buffer *);
+static int reserve_memory(Buffer *, uint64);
+static void check_memory(Buffer *);
+
+/* Loads the address space of a process opened with at least
+   PROCESS_QUERY_INFORMATION and PROCESS_VM_READ. Committed, accessible
+   regions read like file data, everything else is an unreadable hole.
+   The region map is taken once, here. */
+int
+buf_load_process(Buffer *b, HANDLE process)
+{
+    SYSTEM_INFO si;
+    MEMORY_BASIC_INFORMATION mbi;
+    Segment **segs = 0;
+    int n = 0;
+    int cap = 0;
+    uint64 addr = 0;
+    uint64 top;
+
+    GetSystemInfo(&si);
+    top = ((uintptr_t) si.lpMaximumApplicationAddress | (PAGE_SIZE-1)) + 1;
+    while (addr < top) {
+        uint64 end = top;
+        int kind = SEG_HOLE;
+        if (VirtualQueryEx(process, (LPCVOID)(uintptr_t) addr,
+                           &mbi, sizeof mbi))
+        {
+            uint64 regend = (uintptr_t) mbi.BaseAddress + mbi.RegionSize;
+            if (regend > addr && regend < top) end = regend;
+            if (mbi.State == MEM_COMMIT &&
+                !(mbi.Protect & (PAGE_NOACCESS | PAGE_GUARD)))
+            {
+                kind = SEG_FILE;
+            }
+        }
+        if (n && segs[n-1]->kind == kind) {
+            segs[n-1]->len += end - addr;
+        } else {
+            if (n == cap) {
+                cap = cap ? cap*2 : 64;
+                segs = xrealloc(segs, cap * sizeof *segs);
+            }
+            segs[n++] = kind == SEG_FILE ? new_file_seg(end - addr, addr) :
+                new_hole_seg(end - addr, addr);
+        }
+        addr = end;
+    }
+
+    b->rope = build_rope(segs, n);
+    free(segs);
+    b->file = process;
+    b->source = SRC_PROCESS;
+    b->fixed_size = 1;
+    b->file_size = top;
+    b->buffer_size = top;
+    return 0;
+}
+
+int
+buf_init(Buffer *b)
+{
+    b->cache = 0;
+    b->cache_data = 0;
+    if (alloc_cache(b, LOG2_CACHE_BLOCK_SIZE)) {
+        fputs("out of memory\n", stderr);
+        return -1;
     }
 
-    b->sentinel.first = SEGMENT(&b->sentinel);
-    b->sentinel.last = SEGMENT(&b->sentinel);
     b->rope = 0;
 
     b->file = INVALID_HANDLE_VALUE;
+    b->async_file = INVALID_HANDLE_VALUE;
+    b->io_depth = DEFAULT_IO_DEPTH;
+    b->sector_size = 1;
+    b->source = SRC_FILE;
+    b->fixed_size = 0;
     b->file_size = 0;
     b->buffer_size = 0;
-    b->sentinel.kind = 0;
-    b->cache = cache;
-    b->cache_data = cache_data;
-    b->next_cache = 0;
+    b->listeners = 0;
+    b->batch = 0;
+    b->nbatch = 0;
+    b->batch_cap = 0;
+    b->batching = 0;
+    for (int l=0; l<N_SUMMARY_LEVEL; l++) b->summary[l] = 0;
+    b->summary_next = 0;
+    b->summary_buf = 0;
+    b->undo_oldest = 0;
+    b->undo_newest = 0;
+    b->undo_pos = 0;
+    b->undo_mem = 0;
+    b->undo_limit = DEFAULT_UNDO_LIMIT;
+    b->spill_file = INVALID_HANDLE_VALUE;
+    b->spill_size = 0;
+    b->view = 0;
+    b->view_failed = 0;
+    b->batch_mem = 0;
+    b->mem_soft = 0;
+    b->mem_hard = 0;
+    b->compacted = 0;
+    b->file_refs = 0;
     rinit(&b->tmp);
 
     return 0;
 }
 
+static Rope *
+ref_node(Rope *r)
+{
+    if (r) r->refs++;
+    return r;
+}
+
+/* drops a reference to r, freeing what is no longer used */
 static void
-free_node(Rope *r)
+unref_node(Rope *r)
 {
-    if (r) {
+    if (r && !--r->refs) {
         if (r->kind == BRANCH) {
-            free_node(r->left);
-            free_node(r->right);
+            unref_node(r->left);
+            unref_node(r->right);
         }
         free(r);
     }
 }
 
-struct link {
-    Segment *prev, *next;
-};
+static Segment *seg_slice(Segment *, uint64, uint64);
 
-static struct link
-delete_node(Rope *r)
+/* r, or a copy of it taking over this reference if r is shared */
+static Rope *
+own_node(Rope *r)
 {
-    assert(r);
-    struct link ret;
+    Rope *c;
+
+    if (r->refs == 1) return r;
     if (r->kind == BRANCH) {
-        struct link l1 = delete_node(r->left);
-        struct link l2 = delete_node(r->right);
-        ret.prev = l1.prev;
-        ret.next = l2.next;
+        c = xmalloc(sizeof *c);
+        *c = *r;
+        ref_node(c->left);
+        ref_node(c->right);
+        c->refs = 1;
     } else {
-        Segment *s = (Segment *) r;
-        s->next->prev = s->prev;
-        s->prev->next = s->next;
-        ret.prev = s->prev;
-        ret.next = s->next;
+        c = ROPE(seg_slice(SEGMENT(r), 0, r->len));
     }
-    free(r);
-    return ret;
+    r->refs--;
+    return c;
 }
 
 void
 buf_finalize(Buffer *b)
 {
+    unmap_view(b);
     CloseHandle(b->file);
     b->file = INVALID_HANDLE_VALUE;
-    free_node(b->rope);
-    b->sentinel.first = SEGMENT(&b->sentinel);
-    b->sentinel.last = SEGMENT(&b->sentinel);
+    if (b->file_refs && !--*b->file_refs) free(b->file_refs);
+    b->file_refs = 0;
+    if (b->async_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(b->async_file);
+        b->async_file = INVALID_HANDLE_VALUE;
+    }
+    unref_node(b->rope);
     b->rope = 0;
     b->file_size = 0;
     b->buffer_size = 0;
     free(b->cache);
     b->cache = 0;
-    free(b->cache_data);
+    if (b->cache_data) VirtualFree(b->cache_data, 0, MEM_RELEASE);
     b->cache_data = 0;
+    b->sector_size = 1;
+    b->source = SRC_FILE;
+    b->fixed_size = 0;
     rfreeall(&b->tmp);
+    while (b->listeners) {
+        struct listener *next = b->listeners->next;
+        free(b->listeners);
+        b->listeners = next;
+    }
+    buf_abort_batch(b);
+    free(b->batch);
+    b->batch = 0;
+    b->batch_cap = 0;
+    free_summary(b);
+    buf_clear_undo(b);
+    if (b->spill_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(b->spill_file);
+        b->spill_file = INVALID_HANDLE_VALUE;
+    }
+}
+
+/* destination of a buf_scan writing the buffer to another file */
+struct save_as {
+    HANDLE file;
+    uint64 pos; // where the next span goes if there is no gap
+};
+
+static int
+write_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct save_as *sa = arg;
+    if (addr != sa->pos && seek(sa->file, addr)) return -1;
+    sa->pos = addr + len;
+    while (len) {
+        DWORD n = len > 0x40000000 ? 0x40000000 : (DWORD) len;
+        DWORD nwritten;
+        if (!WriteFile(sa->file, data, n, &nwritten, 0) || nwritten != n) {
+            eprintf("write failed at %llx\n", addr);
+            return -1;
+        }
+        data += n;
+        addr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* after an in-place save, the file holds the whole buffer */
+static void
+reset_to_file(Buffer *b)
+{
+    unref_node(b->rope);
+    b->rope = 0;
+    if (b->buffer_size) b->rope = ROPE(new_file_seg(b->buffer_size, 0));
+    b->file_size = b->buffer_size;
+    /* file contents have moved under the cache */
+    for (int i=0; i<N_CACHE_BLOCK; i++) {
+        b->cache[i].flags = 0;
+    }
+    if (!b->fixed_size) map_view(b);
+}
+
+/* A device or process can't change size, so nothing has moved and only
+   the modified sectors need to be written. */
+static int
+save_fixed(Buffer *b)
+{
+    uint64 mask = b->sector_size - 1;
+    uint64 start = 0;
+    uint64 done = 0; // sectors below have been written
+    BufRange ranges[64];
+    int n;
+    uchar *buf;
+
+    buf = VirtualAlloc(0, BLOCK_SIZE(b), MEM_COMMIT | MEM_RESERVE,
+                       PAGE_READWRITE);
+    if (!buf) {
+        eprintf("out of memory\n");
+        return -1;
+    }
+    do {
+        n = buf_dirty_ranges(b, start, b->buffer_size, ranges, NELEM(ranges));
+        for (int i=0; i<n; i++) {
+            uint64 a = max(ranges[i].start & ~mask, done);
+            uint64 e = ranges[i].end + mask & ~mask;
+            if (a < e) drop_summary(b, a, e - a);
+            while (a < e) {
+                DWORD len = (DWORD) min(e - a, BLOCK_SIZE(b));
+                if (buf_read(b, buf, a, len)) {
+                    eprintf("read at %llx failed\n", a);
+                    VirtualFree(buf, 0, MEM_RELEASE);
+                    return -1;
+                }
+                if (write_source(b, a, buf, len)) {
+                    eprintf("write at %llx failed\n", a);
+                    VirtualFree(buf, 0, MEM_RELEASE);
+                    return -1;
+                }
+                a += len;
+            }
+            done = max(done, e);
+        }
+        if (n) start = ranges[n-1].end;
+    } while (n == NELEM(ranges));
+    VirtualFree(buf, 0, MEM_RELEASE);
+    reset_to_file(b);
+    return 0;
 }
 
 int
@@ -404,22 +1026,49 @@ buf_save(Buffer *b, HANDLE dstfile)
 {
     static uchar zero[4096];
 
-    uchar inplace;
     Segment *s;
     Region *r;
     void *top;
 
     assert(dstfile);
 
-    inplace = b->file == dstfile;
-    s = b->sentinel.first;
+    if (b->file != dstfile) {
+        /* stream to the new file, reading ahead while writing */
+        struct save_as sa;
+        if (b->source == SRC_PROCESS) {
+            /* the size is that of the whole address space */
+            eprintf("buf_save: cannot save a process to a file\n");
+            return -1;
+        }
+        sa.file = dstfile;
+        sa.pos = 0;
+        if (seek(dstfile, 0)) return -1;
+        if (buf_scan(b, 0, b->buffer_size, write_span, &sa)) return -1;
+        /* unreadable gaps were skipped, possibly at the end */
+        if (sa.pos != b->buffer_size) {
+            if (seek(dstfile, b->buffer_size) || !SetEndOfFile(dstfile)) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (b->file_refs && *b->file_refs > 1) {
+        eprintf("buf_save: file is shared with a clone\n");
+        return -1;
+    }
+    detach_undo(b);
+    if (b->fixed_size) return save_fixed(b);
+    /* remapped once the file holds the new contents */
+    unmap_view(b);
     r = &b->tmp;
     top = r->cur;
-    uint64 segstart = 0;
-    while (s->kind) {
+    uint64 segstart = 0, segoff;
+    while (segstart < b->buffer_size) {
+        s = find_segment(b->rope, segstart, &segoff);
         //_printf("%llx--%llx ", s->start, s->end);
         switch (s->kind) {
         case SEG_ZERO:
+        case SEG_HOLE:
             //_printf("ZERO\n");
             break;
         case SEG_MEM:
@@ -427,7 +1076,7 @@ buf_save(Buffer *b, HANDLE dstfile)
             break;
         case SEG_FILE:
             eprintf("FILE offset=%llx\n", s->file.offset);
-            if (inplace && segstart == s->file.offset) {
+            if (segstart == s->file.offset) {
                 s->file.data = 0;
             } else {
                 uint64 full_len = s->len;
@@ -457,11 +1106,10 @@ fail:
             assert(0);
         }
         segstart += s->len;
-        s = s->next;
     }
-    s = b->sentinel.first;
     segstart = 0;
-    while (s->kind) {
+    while (segstart < b->buffer_size) {
+        s = find_segment(b->rope, segstart, &segoff);
         uint64 full_seglen = s->len;
         DWORD seglen = (DWORD) full_seglen;
         DWORD nwritten;
@@ -472,6 +1120,7 @@ fail:
         }
         switch (s->kind) {
         case SEG_ZERO:
+        case SEG_HOLE:
             seek(dstfile, segstart);
             remain = seglen;
             while (remain) {
@@ -495,18 +1144,9 @@ fail:
             assert(0);
         }
         segstart += s->len;
-        s = s->next;
-    }
-    if (inplace) {
-        free_node(b->rope);
-        s = calloc(1, sizeof *s);
-        s->kind = SEG_FILE;
-        s->len = b->buffer_size;
-        b->file_size = b->buffer_size;
-        b->sentinel.first = s;
-        b->sentinel.last = s;
-        b->rope = ROPE(s);
     }
+    free_summary(b);
+    reset_to_file(b);
     rfree(r, top);
     return 0;
 }
@@ -524,7 +1164,10 @@ new_mem_seg(uint64 len)
     size_t cap = len+15&-16;
     Segment *s = calloc(1, offsetof(Segment, mem.data[cap]));
     s->kind = SEG_MEM;
+    s->refs = 1;
     s->len = len;
+    s->mem.orig = NO_ORIG;
+    s->mem.dirty_end = len;
     s->mem.cap = cap;
     return s;
 }
@@ -535,6 +1178,7 @@ new_zero_seg(uint64 len)
     assert(len);
     Segment *s = calloc(1, sizeof *s);
     s->kind = SEG_ZERO;
+    s->refs = 1;
     s->len = len;
     return s;
 }
@@ -545,145 +1189,274 @@ new_file_seg(uint64 len, uint64 offset)
     assert(len);
     Segment *s = calloc(1, sizeof *s);
     s->kind = SEG_FILE;
+    s->refs = 1;
     s->len = len;
     s->file.offset = offset;
     return s;
 }
 
-static Rope *
-make_branch(Rope *a, Rope *b)
+static Segment *
+new_hole_seg(uint64 len, uint64 offset)
 {
-    assert(a);
-    assert(b);
-    Rope *r = xmalloc(sizeof *r);
-    r->kind = BRANCH;
-    r->left = a;
-    r->right = b;
-    r->len = a->len + b->len;
-    return r;
+    Segment *s = new_file_seg(len, offset);
+    s->kind = SEG_HOLE;
+    return s;
 }
 
-// len <= r->len
-static Rope *
-rope_replace(Rope *r, uint64 offset, const uchar *data, uint64 len)
+/* if orig is not NO_ORIG, data is a copy of the file at orig */
+static Segment *
+new_data_seg(const uchar *data, uint64 len, uint64 orig)
 {
-    assert(r);
-    assert(len);
+    Segment *s;
+    if (!data) return new_zero_seg(len);
+    s = new_mem_seg(len);
+    memcpy(s->mem.data, data, len);
+    if (orig != NO_ORIG) {
+        s->mem.orig = orig;
+        s->mem.dirty_end = 0;
+    }
+    return s;
+}
 
-    switch (r->kind) {
-    case SEG_ZERO:
-        if (!data) return r;
-        goto generic;
+static size_t
+clip(size_t x, uint64 offset, uint64 len)
+{
+    if (x < offset) return 0;
+    x -= offset;
+    return x < len ? x : (size_t) len;
+}
+
+static void
+mark_dirty(Segment *s, size_t start, size_t end)
+{
+    assert(s->kind == SEG_MEM);
+    if (s->mem.dirty_start == s->mem.dirty_end) {
+        s->mem.dirty_start = start;
+        s->mem.dirty_end = end;
+    } else {
+        if (start < s->mem.dirty_start) s->mem.dirty_start = start;
+        if (end > s->mem.dirty_end) s->mem.dirty_end = end;
+    }
+}
+
+/* new segment of the same kind holding s[offset:offset+len] */
+static Segment *
+seg_slice(Segment *s, uint64 offset, uint64 len)
+{
+    Segment *t;
+    switch (s->kind) {
+    case SEG_ZERO:
+        return new_zero_seg(len);
     case SEG_FILE:
-generic:
+        return new_file_seg(len, s->file.offset + offset);
+    case SEG_HOLE:
+        return new_hole_seg(len, s->file.offset + offset);
+    case SEG_MEM:
+        t = new_mem_seg(len);
+        memcpy(t->mem.data, s->mem.data + s->mem.offset + offset, len);
+        t->mem.orig = s->mem.orig == NO_ORIG ? NO_ORIG
+                                             : s->mem.orig + offset;
+        t->mem.dirty_start = clip(s->mem.dirty_start, offset, len);
+        t->mem.dirty_end = clip(s->mem.dirty_end, offset, len);
+        return t;
+    }
+    assert(0);
+    return 0;
+}
+
+/* removes the first n bytes of s */
+static void
+seg_drop_front(Segment *s, uint64 n)
+{
+    assert(n < s->len);
+    s->len -= n;
+    switch (s->kind) {
+    case SEG_ZERO:
+        break;
+    case SEG_FILE:
+    case SEG_HOLE:
+        s->file.offset += n;
+        s->file.hashed = 0;
+        break;
+    case SEG_MEM:
+        s->mem.offset += n;
+        if (s->mem.orig != NO_ORIG) s->mem.orig += n;
+        s->mem.dirty_start = clip(s->mem.dirty_start, n, s->len);
+        s->mem.dirty_end = clip(s->mem.dirty_end, n, s->len);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+static void
+seg_truncate(Segment *s, uint64 len)
+{
+    assert(len && len <= s->len);
+    s->len = len;
+    if (s->kind == SEG_FILE) s->file.hashed = 0;
+    if (s->kind == SEG_MEM) {
+        s->mem.dirty_start = clip(s->mem.dirty_start, 0, len);
+        s->mem.dirty_end = clip(s->mem.dirty_end, 0, len);
+    }
+}
+
+/* Returns true if r holds unmodified file data, contiguous in the file
+   starting at *pfileoff. Whether that data is also at its original
+   position depends on where r is in the rope. */
+static int
+node_clean(Rope *r, uint64 *pfileoff)
+{
+    Segment *s = SEGMENT(r);
+    switch (r->kind) {
+    case BRANCH:
+        *pfileoff = r->fileoff;
+        return r->clean;
+    case SEG_FILE:
+    case SEG_HOLE:
+        *pfileoff = s->file.offset;
+        return 1;
+    case SEG_MEM:
+        *pfileoff = s->mem.orig;
+        return s->mem.dirty_start == s->mem.dirty_end;
+    }
+    return 0;
+}
+
+static uint64
+node_leaves(Rope *r)
+{
+    return r->kind == BRANCH ? r->nleaf : 1;
+}
+
+static uint64
+node_data(Rope *r)
+{
+    if (r->kind == BRANCH) return r->data;
+    return r->kind == SEG_MEM ? SEGMENT(r)->mem.cap : 0;
+}
+
+/* recomputes length and summary of a branch after its children change */
+static void
+fix_branch(Rope *r)
+{
+    uint64 loff, roff;
+    int lclean = node_clean(r->left, &loff);
+    int rclean = node_clean(r->right, &roff);
+    r->len = r->left->len + r->right->len;
+    r->clean = lclean && rclean && loff + r->left->len == roff;
+    r->fileoff = loff;
+    r->hashed = 0;
+    r->nleaf = node_leaves(r->left) + node_leaves(r->right);
+    r->data = node_data(r->left) + node_data(r->right);
+}
+
+static Rope *
+make_branch(Rope *a, Rope *b)
+{
+    assert(a);
+    assert(b);
+    Rope *r = xmalloc(sizeof *r);
+    r->kind = BRANCH;
+    r->refs = 1;
+    r->left = a;
+    r->right = b;
+    fix_branch(r);
+    return r;
+}
+
+// len <= r->len
+static Rope *
+rope_replace(Rope *r, uint64 offset, const uchar *data, uint64 len,
+             uint64 orig)
+{
+    assert(r);
+    assert(len);
+
+    switch (r->kind) {
+    case SEG_ZERO:
+        if (!data) return r;
+        /* fallthrough */
+    case SEG_FILE:
+    case SEG_HOLE:
         {
             Segment *s = (Segment *) r;
-            Segment *newseg;
-            if (data) {
-                newseg = new_mem_seg(len);
-                memcpy(newseg->mem.data, data, len);
-            } else {
-                newseg = new_zero_seg(len);
-            }
+            Segment *newseg = new_data_seg(data, len, orig);
             uint64 seglen = s->len;
             if (offset == 0) {
                 // prefix of s gets replaced
                 if (len < seglen) {
-                    s->len = seglen - len;
-                    switch (r->kind) {
-                    case SEG_ZERO:
-                        break;
-                    case SEG_FILE:
-                        s->file.offset += len;
-                        break;
-                    case SEG_MEM:
-                        s->mem.offset += len;
-                        break;
-                    default:
-                        assert(0);
-                    }
-                    link(newseg, s->prev, s);
-                    r = make_branch(ROPE(newseg), r);
+                    s = SEGMENT(own_node(r));
+                    seg_drop_front(s, len);
+                    r = make_branch(ROPE(newseg), ROPE(s));
                 } else {
-                    link(newseg, s->prev, s->next);
-                    free(s);
+                    unref_node(r);
                     r = ROPE(newseg);
                 }
             } else if (offset + len == seglen) {
                 // suffix of s gets replaced
-                s->len = offset;
-                link(newseg, s, s->next);
-                r = make_branch(r, ROPE(newseg));
+                s = SEGMENT(own_node(r));
+                seg_truncate(s, offset);
+                r = make_branch(ROPE(s), ROPE(newseg));
             } else {
-                Segment *right;
-                s->len = offset;
-                uint64 right_len = seglen - (offset+len);
-                switch (r->kind) {
-                case SEG_ZERO:
-                    right = new_zero_seg(right_len);
-                    break;
-                case SEG_FILE:
-                    right = new_file_seg(right_len, s->file.offset + (offset+len));
-                    break;
-                case SEG_MEM:
-                    right = new_mem_seg(right_len);
-                    memcpy(right->mem.data, s->mem.data + s->mem.offset + (offset+len), right_len);
-                    break;
-                default:
-                    assert(0);
-                }
-                right->next = s->next;
-                s->next->prev = right;
-                link(newseg, s, right);
+                Segment *right = seg_slice(s, offset+len, seglen-(offset+len));
+                s = SEGMENT(own_node(r));
+                seg_truncate(s, offset);
                 r = make_branch(ROPE(s), make_branch(ROPE(newseg), ROPE(right)));
             }
         }
         return r;
     case SEG_MEM:
         {
-            Segment *s = (Segment *) r;
+            Segment *s = SEGMENT(r = own_node(r));
             assert(len <= s->len);
+            if (s->mem.dirty_start < s->mem.dirty_end &&
+                (offset + len < s->mem.dirty_start ||
+                 offset > s->mem.dirty_end))
+            {
+                /* keep the dirty range exact by splitting s between it
+                   and the bytes being written */
+                uint64 cut = offset > s->mem.dirty_end ? offset : offset+len;
+                Segment *right = seg_slice(s, cut, s->len - cut);
+                seg_truncate(s, cut);
+                r = make_branch(r, ROPE(right));
+                return rope_replace(r, offset, data, len, orig);
+            }
             if (data) {
                 memcpy(s->mem.data + s->mem.offset + offset, data, len);
             } else {
                 memset(s->mem.data + s->mem.offset + offset, 0, len);
             }
+            mark_dirty(s, offset, offset+len);
         }
         return r;
     case BRANCH:
+        r = own_node(r);
         if (offset < r->left->len) {
             // left child affected
             if (offset + len > r->left->len) {
                 // right child affected
                 if (offset == 0 && len == r->len) {
                     // entire rope is being replaced
-                    struct link link = delete_node(r);
-                    Segment *s;
-                    if (data) {
-                        s = new_mem_seg(len);
-                        memcpy(s->mem.data, data, len);
-                    } else {
-                        s = new_zero_seg(len);
-                    }
-                    s->prev = link.prev;
-                    link.prev->next = s;
-                    s->next = link.next;
-                    link.next->prev = s;
-                    r = ROPE(s);
+                    unref_node(r);
+                    return ROPE(new_data_seg(data, len, orig));
                 } else {
                     uintptr_t l = r->left->len - offset;
-                    r->left = rope_replace(r->left, offset, data, l);
-                    r->right = rope_replace(r->right, 0, data+l, len-l);
+                    r->left = rope_replace(r->left, offset, data, l, orig);
+                    r->right = rope_replace(r->right, 0, data ? data+l : 0,
+                                            len-l,
+                                            orig == NO_ORIG ? NO_ORIG : orig+l);
                 }
             } else {
                 // right child unaffected
-                r->left = rope_replace(r->left, offset, data, len);
+                r->left = rope_replace(r->left, offset, data, len, orig);
             }
         } else {
             // left child unaffected, right child affected
             r->right = rope_replace
-                (r->right, offset - r->left->len, data, len);
+                (r->right, offset - r->left->len, data, len, orig);
         }
+        fix_branch(r);
         return r;
     }
     assert(0);
@@ -699,75 +1472,50 @@ rope_delete(Rope *r, uint64 offset, uint64 len)
     switch (r->kind) {
     case SEG_ZERO:
         if (r->len > len) {
+            r = own_node(r);
             r->len -= len;
         } else {
             assert(r->len == len);
-            Segment *s = (Segment *) r;
-            s->prev->next = s->next;
-            s->next->prev = s->prev;
+            unref_node(r);
             r = 0;
         }
         return r;
     case SEG_FILE:
     case SEG_MEM:
+    case SEG_HOLE:
         {
             Segment *s = (Segment *) r;
             uint64 seglen = s->len;
             if (offset == 0) {
                 // prefix of s gets deleted
                 if (len < seglen) {
-                    s->len = seglen - len;
-                    switch (r->kind) {
-                    case SEG_ZERO:
-                        break;
-                    case SEG_FILE:
-                        s->file.offset += len;
-                        break;
-                    case SEG_MEM:
-                        s->mem.offset += len;
-                        break;
-                    default:
-                        assert(0);
-                    }
+                    s = SEGMENT(r = own_node(r));
+                    seg_drop_front(s, len);
                 } else {
-                    s->prev->next = s->next;
-                    s->next->prev = s->prev;
+                    unref_node(r);
                     r = 0;
                 }
             } else if (offset + len == seglen) {
                 // suffix of s gets replaced
-                s->len = offset;
+                s = SEGMENT(r = own_node(r));
+                seg_truncate(s, offset);
             } else {
-                Segment *right;
-                s->len = offset;
-                uint64 right_len = seglen - (offset+len);
-                switch (r->kind) {
-                case SEG_ZERO:
-                    right = new_zero_seg(right_len);
-                    break;
-                case SEG_FILE:
-                    right = new_file_seg(right_len, s->file.offset + (offset+len));
-                    break;
-                case SEG_MEM:
-                    right = new_mem_seg(right_len);
-                    memcpy(right->mem.data, s->mem.data + s->mem.offset + (offset+len), right_len);
-                    break;
-                default:
-                    assert(0);
-                }
-                link(right, s, s->next);
+                Segment *right = seg_slice(s, offset+len, seglen-(offset+len));
+                s = SEGMENT(own_node(r));
+                seg_truncate(s, offset);
                 r = make_branch(ROPE(s), ROPE(right));
             }
         }
         return r;
     case BRANCH:
+        r = own_node(r);
         if (offset < r->left->len) {
             // left child affected
             if (offset + len > r->left->len) {
                 // right child affected
                 if (offset == 0 && len == r->len) {
                     // entire rope is being deleted
-                    delete_node(r);
+                    unref_node(r);
                     r = 0;
                 } else {
                     uintptr_t l = r->left->len - offset;
@@ -776,7 +1524,7 @@ rope_delete(Rope *r, uint64 offset, uint64 len)
                     Rope *oldr = r;
                     if (r->left) {
                         if (r->right) {
-                            r->len -= len;
+                            fix_branch(r);
                         } else {
                             r = r->left;
                             free(oldr);
@@ -796,7 +1544,7 @@ rope_delete(Rope *r, uint64 offset, uint64 len)
                 // right child unaffected
                 r->left = rope_delete(r->left, offset, len);
                 if (r->left) {
-                    r->len -= len;
+                    fix_branch(r);
                 } else {
                     Rope *oldr = r;
                     r = r->right;
@@ -807,7 +1555,7 @@ rope_delete(Rope *r, uint64 offset, uint64 len)
             // left child unaffected, right child affected
             r->right = rope_delete(r->right, offset - r->left->len, len);
             if (r->right) {
-                r->len -= len;
+                fix_branch(r);
             } else {
                 Rope *oldr = r;
                 r = r->left;
@@ -828,52 +1576,29 @@ rope_insert(Rope *r, uint64 offset, const uchar *data, uint64 len)
     switch (r->kind) {
     case SEG_ZERO:
         if (!data) {
+            r = own_node(r);
             r->len += len;
             return r;
         }
         goto generic;
     case SEG_FILE:
+    case SEG_HOLE:
 generic:
         {
             Segment *s = (Segment *) r;
-            Segment *newseg;
-            if (data) {
-                newseg = new_mem_seg(len);
-                memcpy(newseg->mem.data, data, len);
-            } else {
-                newseg = new_zero_seg(len);
-            }
+            Segment *newseg = new_data_seg(data, len, NO_ORIG);
             uint64 seglen = s->len;
             if (offset == 0) {
                 // insert to the left of s
-                link(newseg, s->prev, s);
                 r = make_branch(ROPE(newseg), r);
             } else if (offset == seglen) {
                 // insert to the right of s
-                link(newseg, s, s->next);
                 r = make_branch(r, ROPE(newseg));
             } else {
                 // insert in the middle of s
-                Segment *right;
-                s->len = offset;
-                uint64 right_len = seglen - offset;
-                switch (r->kind) {
-                case SEG_ZERO:
-                    right = new_zero_seg(right_len);
-                    break;
-                case SEG_FILE:
-                    right = new_file_seg(right_len, s->file.offset + offset);
-                    break;
-                case SEG_MEM:
-                    right = new_mem_seg(right_len);
-                    memcpy(right->mem.data, s->mem.data + s->mem.offset + offset, right_len);
-                    break;
-                default:
-                    assert(0);
-                }
-                right->next = s->next;
-                s->next->prev = right;
-                link(newseg, s, right);
+                Segment *right = seg_slice(s, offset, seglen - offset);
+                s = SEGMENT(own_node(r));
+                seg_truncate(s, offset);
                 r = make_branch(ROPE(s), make_branch(ROPE(newseg), ROPE(right)));
             }
         }
@@ -881,7 +1606,10 @@ generic:
     case SEG_MEM:
         {
             Segment *s = (Segment *) r;
-            if (offset == r->len && s->len + len <= s->mem.cap) {
+            /* appended in place, unless shared */
+            if (offset == r->len && s->len + len <= s->mem.cap &&
+                r->refs == 1)
+            {
                 if (s->mem.offset + s->len + len > s->mem.cap) {
                     memmove(s->mem.data, s->mem.data + s->mem.offset, s->len);
                     s->mem.offset = 0;
@@ -892,23 +1620,29 @@ generic:
                 } else {
                     memset(dst, 0, len);
                 }
+                mark_dirty(s, s->len, s->len + len);
                 r->len += len;
                 return r;
             }
         }
         goto generic;
     case BRANCH:
+        r = own_node(r);
         if (offset <= r->left->len) {
             r->left = rope_insert(r->left, offset, data, len);
         } else {
             r->right = rope_insert(r->right, offset - r->left->len, data, len);
         }
-        r->len += len;
+        fix_branch(r);
         return r;
     }
     assert(0);
 }
 
+/* Copies the cached file blocks around [addr, addr+len) into memory
+   segments, so that further edits nearby are done in place instead of
+   splitting the rope. The copies keep track of where they came from and
+   are not reported as modified. */
 static void
 lock_cache(Buffer *b, uint64 addr, uint64 len)
 {
@@ -918,25 +1652,29 @@ lock_cache(Buffer *b, uint64 addr, uint64 len)
     uint64 end = addr + len;
     do {
         uint64 segend = segstart + s->len;
-        Segment *next = s->next;
         if (s->kind == SEG_FILE) {
-            uint64 a = max(addr&-CACHE_BLOCK_SIZE, segstart);
+            uint64 fileoff = s->file.offset;
+            uint64 a = max(addr, segstart);
+            uint64 fa = max((fileoff + (a - segstart)) &
+                            -(uint64) BLOCK_SIZE(b), fileoff);
+            a = segstart + (fa - fileoff);
             do {
-                int c = find_cache_opt(b, a);
+                int c = find_cache_opt(b, fa);
+                uint blkoff = fa&BLOCK_SIZE(b)-1;
+                uint64 len1 = BLOCK_SIZE(b) - blkoff;
+                if (a + len1 > segend) len1 = segend - a;
                 if (c >= 0) {
-                    uint blkoff = a&CACHE_BLOCK_SIZE-1;
                     uchar *data = b->cache[c].data + blkoff;
-                    uint len1 = CACHE_BLOCK_SIZE - blkoff;
-                    if (a + len1 > segend) len1 = segend - a;
-                    b->rope = rope_replace(b->rope, a, data, len1);
-                    a += len1;
+                    b->rope = rope_replace(b->rope, a, data, len1, fa);
                 }
+                a += len1;
+                fa += len1;
                 if (a >= end) return;
             } while (a < segend);
         }
-        s = next;
+        s = segment_at(b->rope, segend);
         segstart = segend;
-    } while (segstart < end && s->kind);
+    } while (segstart < end && s);
 }
 
 static void
@@ -944,12 +1682,54 @@ dump_rope(Buffer *b, const char *header)
 {
     uint64 segstart = 0;
     eprintf("%s\n", header);
-    for (Segment *s = b->sentinel.first; s->kind; s = s->next) {
+    for (Segment *s = segment_at(b->rope, 0); s;
+         s = segment_at(b->rope, segstart))
+    {
         eprintf("kind=%d start=%llu len=%llu\n", s->kind, segstart, s->len);
         segstart += s->len;
     }
 }
 
+void
+buf_subscribe(Buffer *b, BufChangeProc proc, void *arg)
+{
+    struct listener *l = xmalloc(sizeof *l);
+    struct listener **pl = &b->listeners;
+    /* keep subscription order */
+    while (*pl) pl = &(*pl)->next;
+    l->next = 0;
+    l->proc = proc;
+    l->arg = arg;
+    *pl = l;
+}
+
+void
+buf_unsubscribe(Buffer *b, BufChangeProc proc, void *arg)
+{
+    struct listener **pl = &b->listeners;
+    while (*pl) {
+        struct listener *l = *pl;
+        if (l->proc == proc && l->arg == arg) {
+            *pl = l->next;
+            free(l);
+            return;
+        }
+        pl = &l->next;
+    }
+}
+
+/* removed bytes at addr were replaced with inserted new bytes */
+static void
+notify(Buffer *b, uint64 addr, uint64 removed, uint64 inserted)
+{
+    struct listener *l = b->listeners;
+    while (l) {
+        struct listener *next = l->next;
+        l->proc(l->arg, addr, removed, inserted);
+        l = next;
+    }
+}
+
 void
 buf_replace(Buffer *b, uint64 addr, const uchar *data, uint64 len)
 {
@@ -961,9 +1741,17 @@ buf_replace(Buffer *b, uint64 addr, const uchar *data, uint64 len)
     }
 
     if (!len) return;
+    if (data && reserve_memory(b, len)) {
+        eprintf("buf_replace: memory limit reached\n");
+        return;
+    }
 
-    lock_cache(b, addr, len);
-    b->rope = rope_replace(b->rope, addr, data, len);
+    record_edit(b, addr, len, len);
+    /* pinned copies of a live process would go stale */
+    if (b->source == SRC_FILE) lock_cache(b, addr, len);
+    b->rope = rope_replace(b->rope, addr, data, len, NO_ORIG);
+    check_memory(b);
+    notify(b, addr, len, len);
 }
 
 void
@@ -974,6 +1762,10 @@ buf_insert(Buffer *b, uint64 addr, const uchar *data, uint64 len)
                 addr, b->buffer_size);
         return;
     }
+    if (b->fixed_size) {
+        eprintf("buf_insert: buffer size is fixed\n");
+        return;
+    }
 
     uint64 newsize = b->buffer_size + len;
     if (newsize < b->buffer_size) {
@@ -982,22 +1774,21 @@ buf_insert(Buffer *b, uint64 addr, const uchar *data, uint64 len)
     }
 
     if (!len) return;
+    if (data && reserve_memory(b, len)) {
+        eprintf("buf_insert: memory limit reached\n");
+        return;
+    }
 
+    record_edit(b, addr, 0, len);
     if (b->rope) {
         b->rope = rope_insert(b->rope, addr, data, len);
     } else {
-        Segment *newseg;
-        if (data) {
-            newseg = new_mem_seg(len);
-            memcpy(newseg->mem.data, data, len);
-        } else {
-            newseg = new_zero_seg(len);
-        }
-        link(newseg, SEGMENT(&b->sentinel), SEGMENT(&b->sentinel));
-        b->rope = ROPE(newseg);
+        b->rope = ROPE(new_data_seg(data, len, NO_ORIG));
     }
     b->buffer_size = newsize;
     //dump_rope(b, "after buf_insert");
+    check_memory(b);
+    notify(b, addr, 0, len);
 }
 
 void
@@ -1011,68 +1802,1830 @@ buf_delete(Buffer *b, uint64 addr, uint64 len)
     }
 
     if (!len) return;
+    if (b->fixed_size) {
+        eprintf("buf_delete: buffer size is fixed\n");
+        return;
+    }
 
+    record_edit(b, addr, len, 0);
     b->rope = rope_delete(b->rope, addr, len);
     b->buffer_size -= len;
+    notify(b, addr, len, 0);
 }
 
+/* drops the cached blocks overlapping file bytes [fileoff, fileoff+n) */
 static void
-read_file(Buffer *b, uchar *dst, uint64 fileoff, size_t n)
+drop_cache(Buffer *b, uint64 fileoff, uint64 n)
 {
-    do {
-        uchar *src = get_file_data(b, fileoff);
-        size_t n1 = CACHE_BLOCK_SIZE -
-            ((size_t) fileoff & (CACHE_BLOCK_SIZE-1));
-        if (n1 > n) n1 = n;
-        memcpy(dst, src, n1);
-        dst += n1;
-        n -= n1;
-        fileoff += n1;
-    } while (n);
+    for (int i=0; i<N_CACHE_BLOCK; i++) {
+        struct cache_entry *c = &b->cache[i];
+        if (c->addr < fileoff + n && c->addr + BLOCK_SIZE(b) > fileoff) {
+            c->flags = 0;
+        }
+    }
 }
 
+/* Forgets cached file data under [addr, addr+len), for files that change
+   underneath us such as a live process. Listeners are told the range has
+   changed so that it gets read again. */
 void
-buf_read(Buffer *b, uchar *dst, uint64 addr, size_t n)
+buf_invalidate(Buffer *b, uint64 addr, uint64 len)
 {
     Segment *s;
-    uint64 segoff;
-    if (addr >= b->buffer_size) {
-        eprintf("buf_read: address %llu out of range (%llu)\n",
-                addr, b->buffer_size);
-        return;
+    uint64 segoff, pos, end;
+
+    if (addr + len > b->buffer_size || addr + len < addr) {
+        if (addr >= b->buffer_size) return;
+        len = b->buffer_size - addr;
     }
+    if (!len) return;
 
     s = find_segment(b->rope, addr, &segoff);
-    assert(segoff < s->len);
-    uint64 segstart = addr - segoff;
-    size_t rem = n;
-    for (;;) {
-        size_t n1 = min(rem, segstart + s->len - addr);
-        switch (s->kind) {
-        case SEG_ZERO:
-            memset(dst, 0, n1);
-            break;
-        case SEG_FILE:
-            read_file(b, dst, s->file.offset + segoff, n1);
-            break;
-        case SEG_MEM:
-            memcpy(dst, s->mem.data + s->mem.offset + segoff, n1);
-            break;
-        default:
-            assert(0);
+    pos = addr;
+    end = addr + len;
+    while (pos < end) {
+        uint64 n = min(s->len - segoff, end - pos);
+        if (s->kind == SEG_FILE) {
+            drop_cache(b, s->file.offset + segoff, n);
+            drop_summary(b, s->file.offset + segoff, n);
         }
-        dst += n1;
-        rem -= n1;
-        if (rem == 0) return;// n;
-        s = s->next;
-        if (!s->kind) return;// n-rem;
-        addr = segstart;
+        pos += n;
         segoff = 0;
+        if (pos < end) s = segment_at(b->rope, pos);
     }
+    forget_hash(b->rope, addr, len);
+    notify(b, addr, len, len);
 }
 
-uint64
-buf_size(Buffer *b)
+int
+buf_begin_batch(Buffer *b)
 {
-    return b->buffer_size;
+    if (b->batching) {
+        eprintf("buf_begin_batch: batch already open\n");
+        return -1;
+    }
+    b->batching = 1;
+    b->nbatch = 0;
+    return 0;
+}
+
+static int
+queue_edit(Buffer *b, uint64 addr, uint64 removed, const uchar *data,
+           uint64 len)
+{
+    struct edit *e;
+
+    if (!b->batching) {
+        eprintf("queue_edit: no batch open\n");
+        return -1;
+    }
+    if (addr + removed > b->buffer_size || addr + removed < addr) {
+        eprintf("queue_edit: out of range (%llu + %llu > %llu)\n",
+                addr, removed, b->buffer_size);
+        return -1;
+    }
+    if (!removed && !len) return 0;
+    if (removed != len && b->fixed_size) {
+        eprintf("queue_edit: buffer size is fixed\n");
+        return -1;
+    }
+    if (data && reserve_memory(b, len)) {
+        eprintf("queue_edit: memory limit reached\n");
+        return -1;
+    }
+    if (b->nbatch == b->batch_cap) {
+        b->batch_cap = b->batch_cap ? b->batch_cap*2 : 16;
+        b->batch = xrealloc(b->batch, b->batch_cap * sizeof *b->batch);
+    }
+    e = &b->batch[b->nbatch];
+    e->addr = addr;
+    e->removed = removed;
+    e->seg = len ? new_data_seg(data, len, NO_ORIG) : 0;
+    if (e->seg) b->batch_mem += node_data(ROPE(e->seg));
+    e->seq = b->nbatch++;
+    return 0;
+}
+
+int
+buf_batch_replace(Buffer *b, uint64 addr, const uchar *data, uint64 len)
+{
+    return queue_edit(b, addr, len, data, len);
+}
+
+int
+buf_batch_insert(Buffer *b, uint64 addr, const uchar *data, uint64 len)
+{
+    return queue_edit(b, addr, 0, data, len);
+}
+
+int
+buf_batch_delete(Buffer *b, uint64 addr, uint64 len)
+{
+    return queue_edit(b, addr, len, 0, 0);
+}
+
+void
+buf_abort_batch(Buffer *b)
+{
+    for (int i=0; i<b->nbatch; i++) free(b->batch[i].seg);
+    b->nbatch = 0;
+    b->batch_mem = 0;
+    b->batching = 0;
+}
+
+/* by address; inserts go before removals at the same address, otherwise
+   queue order is kept */
+static int
+cmp_edit(const void *pa, const void *pb)
+{
+    const struct edit *a = pa;
+    const struct edit *b = pb;
+    if (a->addr != b->addr) return a->addr < b->addr ? -1 : 1;
+    if (!a->removed != !b->removed) return a->removed ? 1 : -1;
+    return a->seq - b->seq;
+}
+
+/* segment list under construction by buf_commit */
+struct seglist {
+    Segment **segs;
+    int n, cap;
+};
+
+static void
+push_seg(struct seglist *l, Segment *s)
+{
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap*2 : 64;
+        l->segs = xrealloc(l->segs, l->cap * sizeof *l->segs);
+    }
+    l->segs[l->n++] = s;
+}
+
+/* Pushes the segments of r to l in order, handing over the references r
+   holds, and frees the branches. Branches shared with a clone are left
+   to it, and the segments under them gain a reference instead. */
+static void
+take_segments(Rope *r, struct seglist *l, int shared)
+{
+    if (r->kind != BRANCH) {
+        if (shared) ref_node(r);
+        push_seg(l, SEGMENT(r));
+        return;
+    }
+    if (!shared && r->refs > 1) {
+        r->refs--;
+        shared = 1;
+    }
+    take_segments(r->left, l, shared);
+    take_segments(r->right, l, shared);
+    if (!shared) free(r);
+}
+
+/* walks the old segments while buf_commit rebuilds the rope */
+struct cursor {
+    struct seglist old;
+    int i; // current segment
+    uint64 off; // offset within it
+    uint64 pos; // buffer address of old.segs[i][off]
+    uchar kept; // old.segs[i] has been pushed whole
+};
+
+/* takes the segments of b's rope apart for a cursor at address 0 */
+static void
+init_cursor(struct cursor *c, Buffer *b)
+{
+    memset(c, 0, sizeof *c);
+    if (b->rope) take_segments(b->rope, &c->old, 0);
+}
+
+/* moves c to addr, pushing the bytes passed over to l if l is non-null */
+static void
+advance(struct cursor *c, uint64 addr, struct seglist *l)
+{
+    while (c->pos < addr) {
+        Segment *s = c->old.segs[c->i];
+        uint64 n = min(s->len - c->off, addr - c->pos);
+        if (l) {
+            if (c->off == 0 && n == s->len) {
+                push_seg(l, s);
+                c->kept = 1;
+            } else {
+                push_seg(l, seg_slice(s, c->off, n));
+            }
+        }
+        c->off += n;
+        c->pos += n;
+        if (c->off == s->len) {
+            c->i++;
+            c->off = 0;
+            if (!c->kept) unref_node(ROPE(s));
+            c->kept = 0;
+        }
+    }
+}
+
+/* balanced rope over segs[0:n], built bottom-up; reuses segs as scratch */
+static Rope *
+build_rope(Segment **segs, int n)
+{
+    Rope **nodes = (Rope **) segs;
+    if (!n) return 0;
+    while (n > 1) {
+        int m = 0;
+        for (int i=0; i+1<n; i+=2) {
+            nodes[m++] = make_branch(nodes[i], nodes[i+1]);
+        }
+        if (n&1) nodes[m++] = nodes[n-1];
+        n = m;
+    }
+    return nodes[0];
+}
+
+/* Makes dst, fresh from buf_init, a copy of src that edits independently.
+   The two share the rope, whose nodes are copied on the way down to an
+   edit by whichever buffer makes it, so cloning takes the same time
+   however large or edited src is. While they share the file, neither
+   can be saved in place. */
+int
+buf_clone(Buffer *dst, Buffer *src)
+{
+    HANDLE self = GetCurrentProcess();
+
+    if (src->batching) {
+        eprintf("buf_clone: batch open\n");
+        return -1;
+    }
+    if (src->file != INVALID_HANDLE_VALUE) {
+        if (!DuplicateHandle(self, src->file, self, &dst->file, 0, FALSE,
+                             DUPLICATE_SAME_ACCESS))
+        {
+            dst->file = INVALID_HANDLE_VALUE;
+            return -1;
+        }
+        if (src->async_file != INVALID_HANDLE_VALUE) {
+            dst->async_file = reopen_overlapped(dst->file, src->fixed_size ?
+                                                FILE_FLAG_NO_BUFFERING :
+                                                FILE_FLAG_SEQUENTIAL_SCAN);
+        }
+        if (!src->file_refs) {
+            src->file_refs = xmalloc(sizeof *src->file_refs);
+            *src->file_refs = 1;
+        }
+        dst->file_refs = src->file_refs;
+        ++*dst->file_refs;
+    }
+    if (src->log2_block != dst->log2_block &&
+        alloc_cache(dst, src->log2_block))
+    {
+        return -1;
+    }
+    dst->io_depth = src->io_depth;
+    dst->sector_size = src->sector_size;
+    dst->source = src->source;
+    dst->fixed_size = src->fixed_size;
+    dst->file_size = src->file_size;
+    dst->buffer_size = src->buffer_size;
+    dst->undo_limit = src->undo_limit;
+    dst->mem_soft = src->mem_soft;
+    dst->mem_hard = src->mem_hard;
+    dst->rope = ref_node(src->rope);
+    if (src->view) map_view(dst);
+    return 0;
+}
+
+/* Applies the queued edits in one pass over the segments and
+   rebuilds the rope from scratch. Fails, leaving the buffer unchanged,
+   if two edits overlap. */
+int
+buf_commit(Buffer *b)
+{
+    struct edit *e = b->batch;
+    int n = b->nbatch;
+    struct seglist l = {0};
+    struct cursor c;
+    uint64 lo, hi, oldsize, newsize;
+    struct hunk *hunks;
+    int nhunk = 0;
+
+    if (!b->batching) {
+        eprintf("buf_commit: no batch open\n");
+        return -1;
+    }
+    if (!n) {
+        b->batching = 0;
+        return 0;
+    }
+
+    qsort(e, n, sizeof *e, cmp_edit);
+    oldsize = b->buffer_size;
+    newsize = oldsize;
+    for (int i=0; i<n; i++) {
+        if (i+1 < n && e[i+1].addr < e[i].addr + e[i].removed) {
+            eprintf("buf_commit: edits at %llu and %llu overlap\n",
+                    e[i].addr, e[i+1].addr);
+            buf_abort_batch(b);
+            return -1;
+        }
+        newsize = newsize - e[i].removed + (e[i].seg ? e[i].seg->len : 0);
+    }
+    lo = e[0].addr;
+    hi = 0;
+    for (int i=0; i<n; i++) hi = max(hi, e[i].addr + e[i].removed);
+
+    init_cursor(&c, b);
+    hunks = xmalloc(n * sizeof *hunks);
+    newsize = oldsize;
+    for (int i=0; i<n;) {
+        /* merge runs of touching edits into a single segment */
+        struct seglist old = {0};
+        struct hunk *h = &hunks[nhunk++];
+        int j = i;
+        uint64 end = e[i].addr + e[i].removed;
+        uint64 len = e[i].seg ? e[i].seg->len : 0;
+        uchar zero = !e[i].seg || e[i].seg->kind == SEG_ZERO;
+        while (j+1 < n && e[j+1].addr == end) {
+            j++;
+            end += e[j].removed;
+            if (e[j].seg) {
+                len += e[j].seg->len;
+                if (e[j].seg->kind != SEG_ZERO) zero = 0;
+            }
+        }
+        advance(&c, e[i].addr, &l);
+        advance(&c, end, &old);
+        /* undoing puts the old segments back */
+        h->addr = e[i].addr + newsize - oldsize;
+        h->removed = len;
+        h->segs = old.segs;
+        h->nseg = old.n;
+        newsize = newsize - (end - e[i].addr) + len;
+        if (i == j) {
+            if (e[i].seg) push_seg(&l, e[i].seg);
+        } else if (len) {
+            Segment *s = zero ? new_zero_seg(len) : new_mem_seg(len);
+            uchar *p = zero ? 0 : s->mem.data;
+            for (int k=i; k<=j; k++) {
+                Segment *t = e[k].seg;
+                if (!t) continue;
+                if (p) {
+                    if (t->kind == SEG_MEM) memcpy(p, t->mem.data, t->len);
+                    p += t->len;
+                }
+                free(t);
+            }
+            push_seg(&l, s);
+        }
+        i = j+1;
+    }
+    advance(&c, oldsize, &l);
+    free(c.old.segs);
+    b->rope = build_rope(l.segs, l.n);
+    b->buffer_size = newsize;
+    free(l.segs);
+    b->nbatch = 0;
+    b->batch_mem = 0;
+    b->batching = 0;
+    push_undo(b, hunks, nhunk);
+    check_memory(b);
+    notify(b, lo, hi - lo, hi - lo + newsize - oldsize);
+    return 0;
+}
+
+/* Unreadable blocks read as zeros. Returns -1 if there were any. */
+static int
+read_file(Buffer *b, uchar *dst, uint64 fileoff, size_t n)
+{
+    int ret = 0;
+
+    do {
+        uchar *src = get_file_data(b, fileoff);
+        size_t n1 = BLOCK_SIZE(b) - ((size_t) fileoff & (BLOCK_SIZE(b)-1));
+        if (n1 > n) n1 = n;
+        if (src) {
+            memcpy(dst, src, n1);
+        } else {
+            memset(dst, 0, n1);
+            ret = -1;
+        }
+        dst += n1;
+        n -= n1;
+        fileoff += n1;
+    } while (n);
+    return ret;
+}
+
+/* Undo history. Each step keeps the segments that an edit removed, so
+   that putting them back undoes it; file data is kept by reference and
+   only copied bytes count against undo_limit. Once over the limit, the
+   bytes of the oldest steps move to a temporary spill file and are read
+   back only if those steps are undone. */
+
+static uint64
+hunk_mem(struct hunk *h)
+{
+    uint64 mem = 0;
+    for (int i=0; i<h->nseg; i++) {
+        if (h->segs[i]->kind == SEG_MEM) mem += h->segs[i]->len;
+    }
+    return mem;
+}
+
+/* slices of [addr, addr+len) of the buffer */
+static void
+copy_range(Buffer *b, uint64 addr, uint64 len, struct hunk *h)
+{
+    struct seglist l = {0};
+    uint64 segoff;
+    Segment *s;
+
+    if (len) {
+        s = find_segment(b->rope, addr, &segoff);
+        while (len) {
+            uint64 n = min(s->len - segoff, len);
+            push_seg(&l, seg_slice(s, segoff, n));
+            addr += n;
+            len -= n;
+            segoff = 0;
+            if (len) s = segment_at(b->rope, addr);
+        }
+    }
+    h->segs = l.segs;
+    h->nseg = l.n;
+}
+
+static void
+free_undo(Buffer *b, struct undo *u)
+{
+    if (u->older) u->older->newer = u->newer;
+    else b->undo_oldest = u->newer;
+    if (u->newer) u->newer->older = u->older;
+    else b->undo_newest = u->older;
+    if (b->undo_pos == u) b->undo_pos = u->older;
+    b->undo_mem -= u->mem;
+    for (int i=0; i<u->nhunk; i++) {
+        for (int k=0; k<u->hunks[i].nseg; k++) {
+            unref_node(ROPE(u->hunks[i].segs[k]));
+        }
+        free(u->hunks[i].segs);
+    }
+    free(u->hunks);
+    free(u);
+}
+
+void
+buf_clear_undo(Buffer *b)
+{
+    while (b->undo_oldest) free_undo(b, b->undo_oldest);
+}
+
+/* appends p[0:len] to the spill file, creating it if needed */
+static int
+write_spill(Buffer *b, const uchar *p, uint64 len)
+{
+    if (b->spill_file == INVALID_HANDLE_VALUE) {
+        TCHAR dir[MAX_PATH], path[MAX_PATH];
+        if (!GetTempPath(MAX_PATH, dir) ||
+            !GetTempFileName(dir, TEXT("whx"), 0, path))
+        {
+            return -1;
+        }
+        b->spill_file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, 0,
+                                   CREATE_ALWAYS,
+                                   FILE_ATTRIBUTE_TEMPORARY |
+                                   FILE_FLAG_DELETE_ON_CLOSE, 0);
+        if (b->spill_file == INVALID_HANDLE_VALUE) {
+            DeleteFile(path);
+            return -1;
+        }
+        b->spill_size = 0;
+    }
+    if (seek(b->spill_file, b->spill_size)) return -1;
+    while (len) {
+        DWORD n = len > 0x40000000 ? 0x40000000 : (DWORD) len;
+        DWORD nwritten;
+        if (!WriteFile(b->spill_file, p, n, &nwritten, 0) || nwritten != n) {
+            eprintf("write_spill: write failed\n");
+            return -1;
+        }
+        p += n;
+        len -= n;
+        b->spill_size += n;
+    }
+    return 0;
+}
+
+/* moves the bytes of *ps to the spill file */
+static int
+spill_seg(Buffer *b, Segment **ps)
+{
+    Segment *s = *ps;
+    Segment *t;
+    uint64 offset = b->spill_size;
+
+    if (write_spill(b, s->mem.data + s->mem.offset, s->len)) return -1;
+    t = calloc(1, sizeof *t);
+    t->kind = SEG_SPILL;
+    t->refs = 1;
+    t->len = s->len;
+    t->spill.offset = offset;
+    t->spill.orig = s->mem.orig;
+    t->spill.dirty_start = s->mem.dirty_start;
+    t->spill.dirty_end = s->mem.dirty_end;
+    unref_node(ROPE(s));
+    *ps = t;
+    return 0;
+}
+
+/* copies the file data of *ps to the spill file, SPILL_CHUNK bytes at a
+   time */
+static int
+spill_file_seg(Buffer *b, Segment **ps)
+{
+    Segment *s = *ps;
+    Segment *t;
+    uint64 offset = b->spill_size;
+    uchar *buf = xmalloc(SPILL_CHUNK);
+
+    for (uint64 done = 0; done < s->len; done += SPILL_CHUNK) {
+        size_t n = (size_t) min(s->len - done, SPILL_CHUNK);
+        read_file(b, buf, s->file.offset + done, n);
+        if (write_spill(b, buf, n)) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    t = calloc(1, sizeof *t);
+    t->kind = SEG_SPILL;
+    t->refs = 1;
+    t->len = s->len;
+    t->spill.offset = offset;
+    t->spill.orig = NO_ORIG;
+    t->spill.dirty_start = 0;
+    t->spill.dirty_end = (size_t) s->len;
+    unref_node(ROPE(s));
+    *ps = t;
+    return 0;
+}
+
+/* reads a spilled segment back into memory */
+static Segment *
+unspill_seg(Buffer *b, Segment *t)
+{
+    Segment *s = new_mem_seg(t->len);
+    uchar *p = s->mem.data;
+    uint64 left = t->len;
+
+    if (seek(b->spill_file, t->spill.offset)) left = 0;
+    while (left) {
+        DWORD n = left > 0x40000000 ? 0x40000000 : (DWORD) left;
+        DWORD nread;
+        if (!ReadFile(b->spill_file, p, n, &nread, 0) || nread != n) break;
+        p += n;
+        left -= n;
+    }
+    if (left) eprintf("unspill_seg: read failed\n");
+    s->mem.orig = t->spill.orig;
+    s->mem.dirty_start = t->spill.dirty_start;
+    s->mem.dirty_end = t->spill.dirty_end;
+    free(t);
+    return s;
+}
+
+/* spills the oldest steps until under undo_limit; if that fails, forgets
+   them instead */
+static void
+trim_undo(Buffer *b)
+{
+    struct undo *u;
+
+    for (u = b->undo_oldest; u && b->undo_mem > b->undo_limit; u = u->newer) {
+        for (int i=0; i<u->nhunk; i++) {
+            struct hunk *h = &u->hunks[i];
+            for (int k=0; k<h->nseg; k++) {
+                uint64 len = h->segs[k]->len;
+                if (h->segs[k]->kind != SEG_MEM) continue;
+                if (spill_seg(b, &h->segs[k])) goto drop;
+                u->mem -= len;
+                b->undo_mem -= len;
+            }
+        }
+    }
+    return;
+drop:
+    /* oldest undo steps first, then the furthest redo steps */
+    while (b->undo_mem > b->undo_limit && b->undo_pos) {
+        free_undo(b, b->undo_oldest);
+    }
+    while (b->undo_mem > b->undo_limit && b->undo_newest) {
+        free_undo(b, b->undo_newest);
+    }
+}
+
+/* makes hunks the newest step, dropping the steps that were undone */
+static void
+push_undo(Buffer *b, struct hunk *hunks, int nhunk)
+{
+    struct undo *u;
+
+    while (b->undo_newest != b->undo_pos) free_undo(b, b->undo_newest);
+    u = xmalloc(sizeof *u);
+    u->hunks = hunks;
+    u->nhunk = nhunk;
+    u->mem = 0;
+    for (int i=0; i<nhunk; i++) u->mem += hunk_mem(&hunks[i]);
+    u->older = b->undo_newest;
+    u->newer = 0;
+    if (u->older) u->older->newer = u;
+    else b->undo_oldest = u;
+    b->undo_newest = u;
+    b->undo_pos = u;
+    b->undo_mem += u->mem;
+    trim_undo(b);
+}
+
+/* called before [addr, addr+removed) is replaced with inserted bytes */
+static void
+record_edit(Buffer *b, uint64 addr, uint64 removed, uint64 inserted)
+{
+    struct hunk *h = xmalloc(sizeof *h);
+    h->addr = addr;
+    h->removed = inserted;
+    copy_range(b, addr, removed, h);
+    push_undo(b, h, 1);
+}
+
+/* swaps the hunks of u with what they cover, in one pass over the
+   segments like buf_commit */
+static void
+apply_undo(Buffer *b, struct undo *u)
+{
+    struct seglist l = {0};
+    struct cursor c;
+    uint64 oldsize = b->buffer_size;
+    uint64 newsize = oldsize;
+    uint64 lo = u->hunks[0].addr;
+    uint64 hi = 0;
+
+    init_cursor(&c, b);
+    b->undo_mem -= u->mem;
+    u->mem = 0;
+    for (int i=0; i<u->nhunk; i++) {
+        struct hunk *h = &u->hunks[i];
+        struct seglist old = {0};
+        uint64 len = 0;
+        advance(&c, h->addr, &l);
+        advance(&c, h->addr + h->removed, &old);
+        for (int k=0; k<h->nseg; k++) {
+            Segment *s = h->segs[k];
+            if (s->kind == SEG_SPILL) s = unspill_seg(b, s);
+            /* the file may have changed since */
+            if (s->kind == SEG_FILE) s->file.hashed = 0;
+            push_seg(&l, s);
+            len += s->len;
+        }
+        free(h->segs);
+        hi = h->addr + h->removed;
+        h->addr += newsize - oldsize;
+        newsize = newsize - h->removed + len;
+        h->removed = len;
+        h->segs = old.segs;
+        h->nseg = old.n;
+        u->mem += hunk_mem(h);
+    }
+    advance(&c, oldsize, &l);
+    free(c.old.segs);
+    b->rope = build_rope(l.segs, l.n);
+    b->buffer_size = newsize;
+    free(l.segs);
+    b->undo_mem += u->mem;
+    notify(b, lo, hi - lo, hi - lo + newsize - oldsize);
+}
+
+/* Undoes the newest step not yet undone and sets *addr to where it was.
+   Returns -1 if there is nothing to undo. */
+int
+buf_undo(Buffer *b, uint64 *addr)
+{
+    struct undo *u = b->undo_pos;
+    if (!u || b->batching) return -1;
+    apply_undo(b, u);
+    b->undo_pos = u->older;
+    *addr = u->hunks[0].addr;
+    trim_undo(b);
+    check_memory(b);
+    return 0;
+}
+
+int
+buf_redo(Buffer *b, uint64 *addr)
+{
+    struct undo *u = b->undo_pos ? b->undo_pos->newer : b->undo_oldest;
+    if (!u || b->batching) return -1;
+    apply_undo(b, u);
+    b->undo_pos = u;
+    *addr = u->hunks[0].addr;
+    trim_undo(b);
+    check_memory(b);
+    return 0;
+}
+
+/* most bytes of undo data to keep in memory */
+void
+buf_set_undo_limit(Buffer *b, uint64 limit)
+{
+    b->undo_limit = limit;
+    trim_undo(b);
+}
+
+/* An in-place save is about to overwrite the file: copy the file data
+   that undo steps refer to, and forget where copied data came from.
+   Data that would not fit under undo_limit goes straight to the spill
+   file; if that fails the history cannot be kept. */
+static void
+detach_undo(Buffer *b)
+{
+    for (struct undo *u = b->undo_oldest; u; u = u->newer) {
+        for (int i=0; i<u->nhunk; i++) {
+            struct hunk *h = &u->hunks[i];
+            for (int k=0; k<h->nseg; k++) {
+                Segment *s = h->segs[k];
+                switch (s->kind) {
+                case SEG_FILE:
+                    if (b->undo_mem + s->len > b->undo_limit) {
+                        if (spill_file_seg(b, &h->segs[k])) {
+                            buf_clear_undo(b);
+                            return;
+                        }
+                        break;
+                    }
+                    h->segs[k] = new_mem_seg(s->len);
+                    read_file(b, h->segs[k]->mem.data, s->file.offset,
+                              (size_t) s->len);
+                    unref_node(ROPE(s));
+                    u->mem += h->segs[k]->len;
+                    b->undo_mem += h->segs[k]->len;
+                    break;
+                case SEG_MEM:
+                    s = h->segs[k] = SEGMENT(own_node(ROPE(s)));
+                    s->mem.orig = NO_ORIG;
+                    s->mem.dirty_start = 0;
+                    s->mem.dirty_end = s->len;
+                    break;
+                case SEG_SPILL:
+                    s->spill.orig = NO_ORIG;
+                    s->spill.dirty_start = 0;
+                    s->spill.dirty_end = s->len;
+                    break;
+                }
+            }
+        }
+    }
+    trim_undo(b);
+}
+
+/* Copies [addr, addr+n) of the buffer to dst. Bytes of the file that
+   could not be read come out as zeros. Returns -1 if there were any. */
+int
+buf_read(Buffer *b, uchar *dst, uint64 addr, size_t n)
+{
+    Segment *s;
+    uint64 segoff;
+    int ret = 0;
+    if (addr >= b->buffer_size) {
+        eprintf("buf_read: address %llu out of range (%llu)\n",
+                addr, b->buffer_size);
+        return -1;
+    }
+
+    const uchar *v = n >= MIN_VIEW_READ ? unedited_view(b) : 0;
+    if (v && !copy_view(b, dst, v, addr,
+                        (size_t) min(n, b->buffer_size - addr)))
+    {
+        return 0;
+    }
+
+    s = find_segment(b->rope, addr, &segoff);
+    assert(segoff < s->len);
+    uint64 segstart = addr - segoff;
+    size_t rem = n;
+    for (;;) {
+        size_t n1 = min(rem, segstart + s->len - addr);
+        switch (s->kind) {
+        case SEG_ZERO:
+        case SEG_HOLE:
+            memset(dst, 0, n1);
+            break;
+        case SEG_FILE:
+            if (read_file(b, dst, s->file.offset + segoff, n1)) ret = -1;
+            break;
+        case SEG_MEM:
+            memcpy(dst, s->mem.data + s->mem.offset + segoff, n1);
+            break;
+        default:
+            assert(0);
+        }
+        dst += n1;
+        rem -= n1;
+        if (rem == 0) return ret;
+        segstart += s->len;
+        s = segment_at(b->rope, segstart);
+        if (!s) return ret;
+        addr = segstart;
+        segoff = 0;
+    }
+}
+
+uint64
+buf_size(Buffer *b)
+{
+    return b->buffer_size;
+}
+
+void
+buf_set_io_depth(Buffer *b, int depth)
+{
+    if (depth < 1) depth = 1;
+    if (depth > MAX_IO_DEPTH) depth = MAX_IO_DEPTH;
+    b->io_depth = depth;
+}
+
+static uchar zero_block[CACHE_BLOCK_SIZE];
+
+/* State of a buf_scan. File data is read into a ring of `depth` blocks,
+   with a read outstanding on every block not yet passed to proc. */
+struct scan {
+    HANDLE file; // overlapped handle, or INVALID_HANDLE_VALUE
+    int depth;
+    int backward; // pass spans from the end of the range
+    uchar *data;
+    OVERLAPPED ov[MAX_IO_DEPTH];
+    DWORD len[MAX_IO_DEPTH];
+    DWORD nread[MAX_IO_DEPTH]; // synchronous reads only
+    /* the wanted bytes, within a read widened to sector boundaries */
+    DWORD skip[MAX_IO_DEPTH];
+    DWORD span[MAX_IO_DEPTH];
+    uint64 addr[MAX_IO_DEPTH]; // of the wanted bytes in the buffer
+    BufScanProc proc;
+    void *arg;
+};
+
+static int
+start_read(Buffer *b, struct scan *sc, int slot, uint64 fileoff, DWORD len)
+{
+    uchar *dst = sc->data + ((size_t) slot << b->log2_block);
+    OVERLAPPED *ov = &sc->ov[slot];
+    HANDLE event = ov->hEvent;
+
+    sc->len[slot] = len;
+    if (sc->file == INVALID_HANDLE_VALUE) {
+        return read_source(b, fileoff, dst, len, &sc->nread[slot]);
+    }
+    memset(ov, 0, sizeof *ov);
+    ov->Offset = (DWORD) fileoff;
+    ov->OffsetHigh = (DWORD)(fileoff >> 32);
+    ov->hEvent = event;
+    if (!ReadFile(sc->file, dst, len, 0, ov) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+finish_read(struct scan *sc, int slot)
+{
+    DWORD nread;
+    if (sc->file == INVALID_HANDLE_VALUE) {
+        nread = sc->nread[slot];
+    } else if (!GetOverlappedResult(sc->file, &sc->ov[slot], &nread, TRUE)) {
+        return -1;
+    }
+    return nread == sc->len[slot] ? 0 : -1;
+}
+
+/* passes file bytes [fileoff, fileoff+n), found at buffer address addr,
+   to sc->proc one cache block at a time, reading ahead in the direction
+   of the scan */
+static int
+scan_file(Buffer *b, struct scan *sc, uint64 addr, uint64 fileoff, uint64 n)
+{
+    uint64 end = fileoff + n;
+    uint64 next = sc->backward ? end : fileoff; // next read to issue
+    uint64 stop = sc->backward ? fileoff : end;
+    uint64 bmask = BLOCK_SIZE(b) - 1;
+    int head = 0; // next slot to read into
+    int tail = 0; // next slot to complete
+    int busy = 0;
+    int ret = 0;
+
+    while (next != stop || busy) {
+        while (next != stop && busy < sc->depth) {
+            uint64 lo, hi;
+            if (sc->backward) {
+                hi = next;
+                lo = max(next-1 & ~bmask, fileoff);
+                next = lo;
+            } else {
+                lo = next;
+                hi = min((next & ~bmask) + BLOCK_SIZE(b), end);
+                next = hi;
+            }
+            uint64 mask = b->sector_size - 1;
+            uint64 rstart = lo & ~mask;
+            uint64 rend = hi + mask & ~mask;
+            if (start_read(b, sc, head, rstart, (DWORD)(rend - rstart))) {
+                eprintf("read at %llx failed\n", rstart);
+                ret = -1;
+                goto drain;
+            }
+            sc->skip[head] = (DWORD)(lo - rstart);
+            sc->span[head] = (DWORD)(hi - lo);
+            sc->addr[head] = addr + (lo - fileoff);
+            head = (head+1) % sc->depth;
+            busy++;
+        }
+        busy--;
+        if (finish_read(sc, tail)) {
+            eprintf("short read at %llx\n", sc->addr[tail]);
+            tail = (tail+1) % sc->depth;
+            ret = -1;
+            goto drain;
+        }
+        ret = sc->proc(sc->arg, sc->addr[tail],
+                       sc->data + ((size_t) tail << b->log2_block) +
+                       sc->skip[tail],
+                       sc->span[tail]);
+        tail = (tail+1) % sc->depth;
+        if (ret) goto drain;
+    }
+    return 0;
+drain:
+    if (busy && sc->file != INVALID_HANDLE_VALUE) {
+        CancelIo(sc->file);
+        while (busy--) {
+            DWORD nread;
+            GetOverlappedResult(sc->file, &sc->ov[tail], &nread, TRUE);
+            tail = (tail+1) % sc->depth;
+        }
+    }
+    return ret;
+}
+
+/* passes bytes [segoff, segoff+n) of s, found at buffer address addr */
+static int
+scan_segment(Buffer *b, struct scan *sc, Segment *s, uint64 segoff,
+             uint64 addr, uint64 n)
+{
+    int ret = 0;
+
+    switch (s->kind) {
+    case SEG_ZERO:
+        for (uint64 i=0; !ret && i<n; i += sizeof zero_block) {
+            uint64 k = min(n-i, sizeof zero_block);
+            ret = sc->proc(sc->arg, sc->backward ? addr+n-i-k : addr+i,
+                           zero_block, (size_t) k);
+        }
+        return ret;
+    case SEG_FILE:
+        if (!sc->data) {
+            sc->data = VirtualAlloc(0, (size_t) sc->depth << b->log2_block,
+                                    MEM_COMMIT | MEM_RESERVE,
+                                    PAGE_READWRITE);
+            if (!sc->data) {
+                eprintf("buf_scan: out of memory\n");
+                return -1;
+            }
+            for (int i=0; i<sc->depth; i++) {
+                if (sc->file == INVALID_HANDLE_VALUE) break;
+                sc->ov[i].hEvent = CreateEvent(0, TRUE, FALSE, 0);
+                if (!sc->ov[i].hEvent) {
+                    /* fall back to synchronous reads */
+                    sc->file = INVALID_HANDLE_VALUE;
+                    sc->depth = 1;
+                }
+            }
+        }
+        return scan_file(b, sc, addr, s->file.offset + segoff, n);
+    case SEG_MEM:
+        return sc->proc(sc->arg, addr, s->mem.data + s->mem.offset + segoff,
+                        (size_t) n);
+    case SEG_HOLE:
+        return 0;
+    default:
+        assert(0);
+    }
+    return 0;
+}
+
+static int
+scan(Buffer *b, uint64 start, uint64 len, BufScanProc proc, void *arg,
+     int backward)
+{
+    struct scan sc;
+    Segment *s;
+    uint64 segoff, addr, end;
+    const uchar *view;
+    int ret = 0;
+
+    if (start > b->buffer_size) {
+        eprintf("buf_scan: address %llu out of range (%llu)\n",
+                start, b->buffer_size);
+        return -1;
+    }
+    if (len > b->buffer_size - start) len = b->buffer_size - start;
+    if (!len) return 0;
+    end = start + len;
+
+    view = unedited_view(b);
+    if (view) {
+        /* copied a span at a time; after a read error, the rest of the
+           range is scanned through the rope */
+        uchar *buf = xmalloc(VIEW_SPAN);
+        while (!ret && start < end) {
+            uint64 k = min(end - start, VIEW_SPAN);
+            uint64 at = backward ? end-k : start;
+            if (copy_view(b, buf, view, at, (size_t) k)) break;
+            ret = proc(arg, at, buf, (size_t) k);
+            if (backward) end -= k;
+            else start += k;
+        }
+        free(buf);
+        if (ret || start == end) return ret;
+    }
+
+    sc.file = b->async_file;
+    sc.depth = sc.file == INVALID_HANDLE_VALUE ? 1 : b->io_depth;
+    sc.backward = backward;
+    sc.data = 0;
+    sc.proc = proc;
+    sc.arg = arg;
+    for (int i=0; i<MAX_IO_DEPTH; i++) sc.ov[i].hEvent = 0;
+
+    if (backward) {
+        s = find_segment(b->rope, end-1, &segoff);
+        addr = end;
+        while (!ret && addr > start) {
+            uint64 n = min(segoff+1, addr - start);
+            addr -= n;
+            ret = scan_segment(b, &sc, s, segoff+1 - n, addr, n);
+            if (addr > start) s = find_segment(b->rope, addr-1, &segoff);
+        }
+    } else {
+        s = find_segment(b->rope, start, &segoff);
+        addr = start;
+        while (!ret && addr < end) {
+            uint64 n = min(s->len - segoff, end - addr);
+            ret = scan_segment(b, &sc, s, segoff, addr, n);
+            addr += n;
+            segoff = 0;
+            if (addr < end) s = segment_at(b->rope, addr);
+        }
+    }
+
+    for (int i=0; i<MAX_IO_DEPTH; i++) {
+        if (sc.ov[i].hEvent) CloseHandle(sc.ov[i].hEvent);
+    }
+    if (sc.data) VirtualFree(sc.data, 0, MEM_RELEASE);
+    return ret;
+}
+
+/* Passes the contents of [start, start+len) to proc in order, one span
+   at a time, skipping unreadable gaps. File data is read ahead with up
+   to io_depth reads in flight, without going through the block cache,
+   or copied from the mapped file if the buffer is unedited.
+   Returns the first nonzero value returned by proc, -1 on read errors,
+   or 0. Scans may run on several threads at once, as long as nothing
+   changes the buffer meanwhile. */
+int
+buf_scan(Buffer *b, uint64 start, uint64 len, BufScanProc proc, void *arg)
+{
+    return scan(b, start, len, proc, arg, 0);
+}
+
+/* Like buf_scan, but passes the spans from the end of the range to the
+   start, reading ahead towards the start. */
+int
+buf_scan_backward(Buffer *b, uint64 start, uint64 len, BufScanProc proc,
+                  void *arg)
+{
+    return scan(b, start, len, proc, arg, 1);
+}
+
+struct dirty_query {
+    uint64 start, end;
+    BufRange *out;
+    int n, max;
+};
+
+/* returns nonzero once q->out is full */
+static int
+add_dirty(struct dirty_query *q, uint64 start, uint64 end)
+{
+    start = max(start, q->start);
+    end = min(end, q->end);
+    if (start >= end) return 0;
+    if (q->n && q->out[q->n-1].end == start) {
+        q->out[q->n-1].end = end;
+        return 0;
+    }
+    if (q->n == q->max) return 1;
+    q->out[q->n].start = start;
+    q->out[q->n].end = end;
+    q->n++;
+    return 0;
+}
+
+/* r starts at base in the buffer */
+static int
+find_dirty(Rope *r, uint64 base, struct dirty_query *q)
+{
+    uint64 fileoff;
+    if (base >= q->end || base + r->len <= q->start) return 0;
+    if (node_clean(r, &fileoff)) {
+        /* file data in one piece, so either all in place or all moved */
+        return fileoff == base ? 0 : add_dirty(q, base, base + r->len);
+    }
+    if (r->kind == BRANCH) {
+        return find_dirty(r->left, base, q) ||
+            find_dirty(r->right, base + r->left->len, q);
+    }
+    Segment *s = SEGMENT(r);
+    if (s->kind == SEG_MEM && s->mem.orig == base) {
+        return add_dirty(q, base + s->mem.dirty_start,
+                         base + s->mem.dirty_end);
+    }
+    return add_dirty(q, base, base + s->len);
+}
+
+/* Stores the modified parts of [start, end) in out, merging adjacent
+   ones, and returns how many were stored. A byte is modified if it does
+   not hold the file data at the same offset. If max ranges are returned
+   there may be more after out[max-1].end. */
+int
+buf_dirty_ranges(Buffer *b, uint64 start, uint64 end, BufRange *out, int max)
+{
+    struct dirty_query q;
+    if (end > b->buffer_size) end = b->buffer_size;
+    if (!b->rope || start >= end || max <= 0) return 0;
+    q.start = start;
+    q.end = end;
+    q.out = out;
+    q.n = 0;
+    q.max = max;
+    find_dirty(b->rope, 0, &q);
+    return q.n;
+}
+
+/* Summary pyramid over the file: level 0 summarizes each 64 KiB block,
+   each higher level a run of blocks of the level below. Summaries are
+   indexed by file offset, so edits never invalidate them; edited bytes
+   are in memory and get summarized when asked for. */
+
+static const int summary_shift[N_SUMMARY_LEVEL] = { 16, 20, 26 };
+
+static uint64
+summary_count(Buffer *b, int level)
+{
+    int shift = summary_shift[level];
+    return (b->file_size + ((uint64) 1 << shift) - 1) >> shift;
+}
+
+static void
+summarize_data(struct block_summary *bs, const uchar *p, size_t n)
+{
+    uint32 count[256];
+    uint32 hist[16];
+    int c;
+
+    assert(n);
+    memset(count, 0, sizeof count);
+    count_bytes(count, p, n);
+
+    bs->min = 255;
+    bs->max = 0;
+    memset(hist, 0, sizeof hist);
+    for (c=0; c<256; c++) {
+        if (count[c]) {
+            if (c < bs->min) bs->min = c;
+            bs->max = c;
+            hist[c>>4] += count[c];
+        }
+    }
+    bs->entropy = (float) byte_entropy(count, n);
+    bs->flags = SUM_VALID;
+    if (bs->min == bs->max) bs->flags |= SUM_UNIFORM;
+    if (bs->max == 0) bs->flags |= SUM_ZERO;
+    for (c=0; c<16; c++) {
+        bs->hist[c] = (uchar)((uint64) hist[c] * 255 / n);
+    }
+}
+
+/* accumulates summaries weighted by length */
+struct summary_acc {
+    uint64 len;
+    uchar min, max;
+    uchar flags;
+    double entropy;
+    double hist[16];
+};
+
+static void
+acc_add(struct summary_acc *acc, const struct block_summary *bs, uint64 len)
+{
+    acc->flags |= bs->flags & SUM_UNREADABLE;
+    if (!(bs->flags & SUM_VALID)) {
+        /* unreadable blocks are done, if without data */
+        if (!(bs->flags & SUM_UNREADABLE)) acc->flags |= SUM_PARTIAL;
+        return;
+    }
+    if (!acc->len) {
+        acc->min = bs->min;
+        acc->max = bs->max;
+        acc->flags |= bs->flags & (SUM_ZERO | SUM_UNIFORM);
+    } else {
+        if (!(bs->flags & SUM_ZERO)) acc->flags &= ~SUM_ZERO;
+        if (!(bs->flags & SUM_UNIFORM) || bs->min != acc->min ||
+            !(acc->flags & SUM_UNIFORM))
+        {
+            acc->flags &= ~SUM_UNIFORM;
+        }
+        if (bs->min < acc->min) acc->min = bs->min;
+        if (bs->max > acc->max) acc->max = bs->max;
+    }
+    acc->len += len;
+    acc->entropy += (double) bs->entropy * len;
+    for (int i=0; i<16; i++) acc->hist[i] += (double) bs->hist[i] * len;
+}
+
+static void
+acc_finish(struct summary_acc *acc, struct block_summary *bs)
+{
+    bs->flags = acc->flags;
+    if (!acc->len) return;
+    bs->flags |= SUM_VALID;
+    bs->min = acc->min;
+    bs->max = acc->max;
+    bs->entropy = (float)(acc->entropy / acc->len);
+    for (int i=0; i<16; i++) bs->hist[i] = (uchar)(acc->hist[i] / acc->len);
+}
+
+/* recomputes the ancestors of level-0 block i once all their children
+   are done */
+static void
+update_parents(Buffer *b, uint64 i)
+{
+    for (int l=1; l<N_SUMMARY_LEVEL; l++) {
+        int d = summary_shift[l] - summary_shift[l-1];
+        uint64 p = i >> d;
+        uint64 first = p << d;
+        uint64 end = min(first + ((uint64) 1 << d), summary_count(b, l-1));
+        struct summary_acc acc = {0};
+        for (uint64 j=first; j<end; j++) {
+            uint64 start = j << summary_shift[l-1];
+            uint64 len = min((uint64) 1 << summary_shift[l-1],
+                             b->file_size - start);
+            acc_add(&acc, &b->summary[l-1][j], len);
+            if (acc.flags & SUM_PARTIAL) return;
+        }
+        acc_finish(&acc, &b->summary[l][p]);
+        i = p;
+    }
+}
+
+static void
+free_summary(Buffer *b)
+{
+    for (int l=0; l<N_SUMMARY_LEVEL; l++) {
+        free(b->summary[l]);
+        b->summary[l] = 0;
+    }
+    if (b->summary_buf) VirtualFree(b->summary_buf, 0, MEM_RELEASE);
+    b->summary_buf = 0;
+    b->summary_next = 0;
+}
+
+/* forgets the summaries of file bytes [fileoff, fileoff+n) */
+static void
+drop_summary(Buffer *b, uint64 fileoff, uint64 n)
+{
+    if (!b->summary[0] || !n) return;
+    for (int l=0; l<N_SUMMARY_LEVEL; l++) {
+        int shift = summary_shift[l];
+        uint64 last = min((fileoff + n - 1) >> shift, summary_count(b, l) - 1);
+        for (uint64 i = fileoff >> shift; i <= last; i++) {
+            b->summary[l][i].flags = 0;
+        }
+    }
+    b->summary_next = min(b->summary_next, fileoff >> summary_shift[0]);
+}
+
+/* Summarizes up to nblocks more blocks of the file, reading past the
+   block cache. Meant to be called when idle; returns nonzero while there
+   is work left. Process address spaces are not summarized. */
+int
+buf_summarize(Buffer *b, int nblocks)
+{
+    uint64 nblk;
+
+    if (b->source != SRC_FILE || b->file == INVALID_HANDLE_VALUE) return 0;
+    nblk = summary_count(b, 0);
+    if (!nblk) return 0;
+    if (!b->summary[0]) {
+        for (int l=0; l<N_SUMMARY_LEVEL; l++) {
+            b->summary[l] = calloc(summary_count(b, l),
+                                   sizeof *b->summary[l]);
+        }
+        /* aligned for unbuffered devices */
+        b->summary_buf = VirtualAlloc(0, 1 << summary_shift[0],
+                                      MEM_COMMIT | MEM_RESERVE,
+                                      PAGE_READWRITE);
+        if (!b->summary_buf || !b->summary[N_SUMMARY_LEVEL-1]) {
+            eprintf("buf_summarize: out of memory\n");
+            free_summary(b);
+            return 0;
+        }
+        b->summary_next = 0;
+    }
+    while (nblocks > 0 && b->summary_next < nblk) {
+        uint64 i = b->summary_next++;
+        uint64 off = i << summary_shift[0];
+        DWORD len = (DWORD) min((uint64) 1 << summary_shift[0],
+                                b->file_size - off);
+        DWORD rlen = (len + b->sector_size-1) & ~(b->sector_size-1);
+        DWORD nread;
+        if (b->summary[0][i].flags) continue;
+        if (read_source(b, off, b->summary_buf, rlen, &nread) ||
+            nread < len)
+        {
+            /* not retried until the block is invalidated */
+            b->summary[0][i].flags = SUM_UNREADABLE;
+        } else {
+            summarize_data(&b->summary[0][i], b->summary_buf, len);
+        }
+        update_parents(b, i);
+        nblocks--;
+    }
+    return b->summary_next < nblk;
+}
+
+/* adds file bytes [fileoff, fileoff+n) using the largest summaries that
+   fit; blocks only partly in the range count as a whole */
+static void
+summarize_file(Buffer *b, struct summary_acc *acc, uint64 fileoff, uint64 n)
+{
+    uint64 end = fileoff + n;
+    uint64 pos = fileoff;
+
+    if (!b->summary[0]) {
+        acc->flags |= SUM_PARTIAL;
+        return;
+    }
+    while (pos < end) {
+        int l = N_SUMMARY_LEVEL-1;
+        uint64 nodeend;
+        for (;;) {
+            uint64 size = (uint64) 1 << summary_shift[l];
+            nodeend = min((pos & -size) + size, b->file_size);
+            if (l == 0 || (!(pos & size-1) && nodeend <= end)) break;
+            l--;
+        }
+        acc_add(acc, &b->summary[l][pos >> summary_shift[l]],
+                min(nodeend, end) - pos);
+        pos = nodeend;
+    }
+}
+
+/* Summarizes [start, start+len). SUM_PARTIAL is set if some file data in
+   the range has not been summarized yet, and SUM_UNREADABLE if some could
+   not be read; the rest of the summary then covers only what has. Min
+   and max may be loose at the edges of file data, and entropy over more
+   than a block is the mean over blocks. */
+void
+buf_summary(Buffer *b, uint64 start, uint64 len, BufSummary *out)
+{
+    static const struct block_summary zero_summary = {
+        0, 0, SUM_VALID | SUM_ZERO | SUM_UNIFORM, 0.0f, { 255 }
+    };
+    struct summary_acc acc = {0};
+    struct block_summary bs;
+    Segment *s;
+    uint64 segoff, addr, end;
+
+    memset(out, 0, sizeof *out);
+    if (start >= b->buffer_size) return;
+    if (len > b->buffer_size - start) len = b->buffer_size - start;
+
+    s = find_segment(b->rope, start, &segoff);
+    addr = start;
+    end = start + len;
+    while (addr < end) {
+        uint64 n = min(s->len - segoff, end - addr);
+        const uchar *p;
+        switch (s->kind) {
+        case SEG_ZERO:
+        case SEG_HOLE:
+            acc_add(&acc, &zero_summary, n);
+            break;
+        case SEG_FILE:
+            summarize_file(b, &acc, s->file.offset + segoff, n);
+            break;
+        case SEG_MEM:
+            p = s->mem.data + s->mem.offset + segoff;
+            for (uint64 i=0; i<n; i += (uint64) 1 << summary_shift[0]) {
+                size_t n1 = (size_t) min(n-i, (uint64) 1 << summary_shift[0]);
+                summarize_data(&bs, p+i, n1);
+                acc_add(&acc, &bs, n1);
+            }
+            break;
+        default:
+            assert(0);
+        }
+        addr += n;
+        segoff = 0;
+        if (addr < end) s = segment_at(b->rope, addr);
+    }
+
+    acc_finish(&acc, &bs);
+    out->len = acc.len;
+    out->flags = bs.flags & ~SUM_VALID;
+    if (acc.len) {
+        out->min = bs.min;
+        out->max = bs.max;
+        out->entropy = bs.entropy;
+        memcpy(out->hist, bs.hist, sizeof out->hist);
+    }
+}
+
+/* Whether the summaries show that no byte in [start, start+len) is c.
+   Nothing is read, so edited bytes and data not summarized yet count as
+   possibly holding it. */
+int
+buf_summary_excludes(Buffer *b, uint64 start, uint64 len, uchar c)
+{
+    struct summary_acc acc = {0};
+    Segment *s;
+    uint64 segoff, addr, end;
+
+    if (start >= b->buffer_size) return 1;
+    if (len > b->buffer_size - start) len = b->buffer_size - start;
+
+    s = find_segment(b->rope, start, &segoff);
+    addr = start;
+    end = start + len;
+    while (addr < end) {
+        uint64 n = min(s->len - segoff, end - addr);
+        switch (s->kind) {
+        case SEG_ZERO:
+        case SEG_HOLE:
+            if (!c) return 0;
+            break;
+        case SEG_FILE:
+            summarize_file(b, &acc, s->file.offset + segoff, n);
+            if (acc.flags & (SUM_PARTIAL | SUM_UNREADABLE) ||
+                acc.len && c >= acc.min && c <= acc.max)
+            {
+                return 0;
+            }
+            break;
+        default:
+            return 0;
+        }
+        addr += n;
+        segoff = 0;
+        if (addr < end) s = segment_at(b->rope, addr);
+    }
+    return 1;
+}
+
+/* Content hashes. Bytes s[0:n] hash to the sum of (s[i]+1) * B^(n-1-i)
+   modulo 2^61-1, so the hash of two strings put together follows from
+   their hashes and lengths, and each rope node can keep the hash of its
+   subtree until something under it changes. Good for telling versions
+   apart, not for resisting deliberate collisions. */
+
+#define HASH_P (((uint64) 1 << 61) - 1)
+#define HASH_B ((uint64) 0x16a09e667f3bcc9)
+
+/* a*b mod HASH_P without 128-bit arithmetic; a, b < HASH_P */
+static uint64
+mul61(uint64 a, uint64 b)
+{
+    uint64 al = a & 0xffffffff, ah = a >> 32;
+    uint64 bl = b & 0xffffffff, bh = b >> 32;
+    uint64 lo = al*bl;
+    uint64 mid = al*bh + ah*bl;
+    uint64 hi = ah*bh;
+    /* 2^61 = 1, so 2^64 = 8 */
+    uint64 r = (lo & HASH_P) + (lo >> 61) + (hi << 3) +
+               (mid >> 29) + ((mid & ((1 << 29) - 1)) << 32);
+    r = (r & HASH_P) + (r >> 61);
+    r = (r & HASH_P) + (r >> 61);
+    return r >= HASH_P ? r - HASH_P : r;
+}
+
+static uint64
+add61(uint64 a, uint64 b)
+{
+    uint64 r = a + b;
+    return r >= HASH_P ? r - HASH_P : r;
+}
+
+static uint64
+pow61(uint64 x, uint64 n)
+{
+    uint64 r = 1;
+    while (n) {
+        if (n & 1) r = mul61(r, x);
+        x = mul61(x, x);
+        n >>= 1;
+    }
+    return r;
+}
+
+/* hash of a string with hash h followed by one with hash h2 and length n2 */
+static uint64
+hash_concat(uint64 h, uint64 h2, uint64 n2)
+{
+    return add61(mul61(h, pow61(HASH_B, n2)), h2);
+}
+
+static uint64
+hash_bytes(uint64 h, const uchar *p, size_t n)
+{
+    for (size_t i=0; i<n; i++) h = add61(mul61(h, HASH_B), p[i] + 1);
+    return h;
+}
+
+/* hash of n zero bytes, by repeated doubling */
+static uint64
+hash_zeros(uint64 n)
+{
+    uint64 h = 0;
+    uint64 bn = 1; // B to the length hashed so far
+    for (int i=63; i>=0; i--) {
+        h = add61(mul61(h, bn), h);
+        bn = mul61(bn, bn);
+        if (n >> i & 1) {
+            h = add61(mul61(h, HASH_B), 1);
+            bn = mul61(bn, HASH_B);
+        }
+    }
+    return h;
+}
+
+/* hashes s[segoff:segoff+n], which is at addr in the buffer */
+static uint64
+hash_span(Buffer *b, Segment *s, uint64 addr, uint64 segoff, uint64 n)
+{
+    uchar buf[0x4000];
+    uint64 h = 0;
+
+    switch (s->kind) {
+    case SEG_ZERO:
+    case SEG_HOLE:
+        return hash_zeros(n);
+    case SEG_MEM:
+        return hash_bytes(0, s->mem.data + s->mem.offset + segoff, n);
+    case SEG_FILE:
+        while (n) {
+            size_t n1 = (size_t) min(n, sizeof buf);
+            buf_read(b, buf, addr, n1);
+            h = hash_bytes(h, buf, n1);
+            addr += n1;
+            n -= n1;
+        }
+        return h;
+    }
+    assert(0);
+    return 0;
+}
+
+/* hash of the whole of r, which starts at addr */
+static uint64
+node_hash(Buffer *b, Rope *r, uint64 addr)
+{
+    Segment *s = SEGMENT(r);
+    switch (r->kind) {
+    case BRANCH:
+        if (!r->hashed) {
+            uint64 h = node_hash(b, r->left, addr);
+            uint64 h2 = node_hash(b, r->right, addr + r->left->len);
+            r->hash = hash_concat(h, h2, r->right->len);
+            r->hashed = 1;
+        }
+        return r->hash;
+    case SEG_FILE:
+        if (!s->file.hashed) {
+            s->file.hash = hash_span(b, s, addr, 0, s->len);
+            s->file.hashed = 1;
+        }
+        return s->file.hash;
+    }
+    return hash_span(b, s, addr, 0, s->len);
+}
+
+/* hash of r[off:off+len], where r starts at addr */
+static uint64
+range_hash(Buffer *b, Rope *r, uint64 addr, uint64 off, uint64 len)
+{
+    uint64 llen, h, n2;
+
+    if (off == 0 && len == r->len) return node_hash(b, r, addr);
+    if (r->kind != BRANCH) {
+        return hash_span(b, SEGMENT(r), addr + off, off, len);
+    }
+    llen = r->left->len;
+    if (off + len <= llen) return range_hash(b, r->left, addr, off, len);
+    if (off >= llen) {
+        return range_hash(b, r->right, addr + llen, off - llen, len);
+    }
+    h = range_hash(b, r->left, addr, off, llen - off);
+    n2 = off + len - llen;
+    return hash_concat(h, range_hash(b, r->right, addr + llen, 0, n2), n2);
+}
+
+/* drops cached hashes covering r[off:off+len], for file data that has
+   changed underneath us */
+static void
+forget_hash(Rope *r, uint64 off, uint64 len)
+{
+    uint64 llen;
+
+    if (r->kind == SEG_FILE) {
+        SEGMENT(r)->file.hashed = 0;
+        return;
+    }
+    if (r->kind != BRANCH) return;
+    r->hashed = 0;
+    llen = r->left->len;
+    if (off < llen) forget_hash(r->left, off, min(len, llen - off));
+    if (off + len > llen) {
+        uint64 o = off > llen ? off - llen : 0;
+        forget_hash(r->right, o, off + len - llen - o);
+    }
+}
+
+/* Hash of [start, start+len). Only parts of the rope that changed since
+   they were last hashed are read again. */
+uint64
+buf_tree_hash(Buffer *b, uint64 start, uint64 len)
+{
+    if (start >= b->buffer_size) return 0;
+    if (len > b->buffer_size - start) len = b->buffer_size - start;
+    if (!len) return 0;
+    return range_hash(b, b->rope, 0, start, len);
+}
+
+/* true if the buffers very probably have the same contents */
+int
+buf_equal(Buffer *a, Buffer *b)
+{
+    if (a == b) return 1;
+    if (a->buffer_size != b->buffer_size) return 0;
+    if (!a->buffer_size) return 1;
+    return node_hash(a, a->rope, 0) == node_hash(b, b->rope, 0);
+}
+
+/* Memory accounting. Rope branches keep the number of segments and
+   SEG_MEM bytes below them, so the totals are known without walking the
+   rope. Going over the soft limit compacts the buffer; edits that would
+   go over the hard limit are refused. */
+
+void
+buf_memory(Buffer *b, BufMemory *m)
+{
+    uint64 nleaf = b->rope ? node_leaves(b->rope) : 0;
+
+    m->rope = nleaf > 1 ? (nleaf - 1) * sizeof(Rope) : 0;
+    m->segments = nleaf * sizeof(Segment);
+    m->data = b->rope ? node_data(b->rope) : 0;
+    m->cache = b->cache ? N_CACHE_BLOCK *
+        (BLOCK_SIZE(b) + sizeof(struct cache_entry)) : 0;
+    m->undo = b->undo_mem;
+    m->other = rsize(&b->tmp) + b->batch_mem +
+        (uint64) b->batch_cap * sizeof *b->batch;
+    if (b->summary[0]) {
+        for (int l=0; l<N_SUMMARY_LEVEL; l++) {
+            m->other += summary_count(b, l) * sizeof(struct block_summary);
+        }
+        m->other += (uint64) 1 << summary_shift[0];
+    }
+    m->total = m->rope + m->segments + m->data + m->cache + m->undo +
+        m->other;
+}
+
+static uint64
+memory_used(Buffer *b)
+{
+    BufMemory m;
+    buf_memory(b, &m);
+    return m.total;
+}
+
+/* extends the last segment of l by file bytes that follow it */
+static int
+join_file(struct seglist *l, uint64 len, uint64 offset)
+{
+    Segment *last = l->n ? l->segs[l->n-1] : 0;
+    if (!last || last->kind != SEG_FILE ||
+        last->file.offset + last->len != offset)
+    {
+        return 0;
+    }
+    last = l->segs[l->n-1] = SEGMENT(own_node(ROPE(last)));
+    last->len += len;
+    last->file.hashed = 0;
+    return 1;
+}
+
+static void
+push_file_seg(struct seglist *l, uint64 len, uint64 offset)
+{
+    if (!join_file(l, len, offset)) push_seg(l, new_file_seg(len, offset));
+}
+
+/* Gives memory back without changing the contents: moves all undo data
+   to the spill file, turns unmodified copies of file data back into
+   references to the file and joins file pieces that then line up. */
+static void
+compact(Buffer *b)
+{
+    struct seglist l = {0};
+    struct seglist old = {0};
+    Segment *s;
+    uint64 limit = b->undo_limit;
+
+    b->undo_limit = 0;
+    trim_undo(b);
+    b->undo_limit = limit;
+
+    if (b->source == SRC_FILE && b->file != INVALID_HANDLE_VALUE &&
+        b->rope && b->rope->kind == BRANCH)
+    {
+        take_segments(b->rope, &old, 0);
+        for (int i=0; i<old.n; i++) {
+            s = old.segs[i];
+            if (s->kind == SEG_MEM && s->mem.orig != NO_ORIG &&
+                (s->mem.dirty_start || s->mem.dirty_end < s->len))
+            {
+                /* keep only the modified bytes */
+                size_t ds = s->mem.dirty_start;
+                size_t de = s->mem.dirty_end;
+                if (ds >= de) ds = de = (size_t) s->len;
+                if (ds) push_file_seg(&l, ds, s->mem.orig);
+                if (ds < de) push_seg(&l, seg_slice(s, ds, de - ds));
+                if (de < s->len) {
+                    push_file_seg(&l, s->len - de, s->mem.orig + de);
+                }
+                unref_node(ROPE(s));
+            } else if (s->kind == SEG_FILE &&
+                       join_file(&l, s->len, s->file.offset))
+            {
+                unref_node(ROPE(s));
+            } else {
+                push_seg(&l, s);
+            }
+        }
+        free(old.segs);
+        b->rope = build_rope(l.segs, l.n);
+        free(l.segs);
+    }
+    b->compacted = memory_used(b);
+}
+
+/* called after edits; compacts again only once memory has grown by an
+   eighth since the last time, so that a buffer stuck over the limit is
+   not compacted on every edit */
+static void
+check_memory(Buffer *b)
+{
+    uint64 used;
+
+    if (!b->mem_soft || b->batching) return;
+    used = memory_used(b);
+    if (used > b->mem_soft && used > b->compacted + b->compacted / 8) {
+        compact(b);
+    }
+}
+
+/* Returns -1 if more bytes would not fit under the hard limit, even
+   after compacting. */
+static int
+reserve_memory(Buffer *b, uint64 more)
+{
+    if (!b->mem_hard || memory_used(b) + more <= b->mem_hard) return 0;
+    if (!b->batching) compact(b);
+    return memory_used(b) + more > b->mem_hard ? -1 : 0;
+}
+
+/* 0 for no limit */
+void
+buf_set_memory_limit(Buffer *b, uint64 soft, uint64 hard)
+{
+    b->mem_soft = soft;
+    b->mem_hard = hard;
+    b->compacted = 0;
+    check_memory(b);
 }
@@ -1,19 +1,85 @@
 typedef struct buffer Buffer;
 
+typedef struct {
+    uint64 start, end;
+} BufRange;
+
+/* called after `removed` bytes at `addr` are replaced with `inserted`
+   new bytes */
+typedef void (*BufChangeProc)(void *arg, uint64 addr, uint64 removed,
+                              uint64 inserted);
+
+/* called with the spans of the buffer in order; returning nonzero stops
+   the scan */
+typedef int (*BufScanProc)(void *arg, uint64 addr, const uchar *data,
+                           size_t len);
+
+/* summary of a range of the buffer, see buf_summary */
+typedef struct {
+    uint64 len; // bytes covered
+    uchar min, max;
+    uchar flags;
+    float entropy; // bits per byte
+    uchar hist[16]; // share of bytes 16*i..16*i+15, scaled to 255
+} BufSummary;
+
+/* bytes of memory used by a buffer, see buf_memory */
+typedef struct {
+    uint64 rope; // branch nodes
+    uint64 segments; // segment headers
+    uint64 data; // edited bytes
+    uint64 cache; // file block cache
+    uint64 undo; // undo data not spilled to disk
+    uint64 other; // batch, summaries, save buffers
+    uint64 total;
+} BufMemory;
+
+enum {
+    SUM_ZERO = 1, // all bytes are zero
+    SUM_UNIFORM = 2, // all bytes are the same
+    SUM_PARTIAL = 4, // parts of the range have not been summarized yet
+    SUM_UNREADABLE = 8, // parts of the range could not be read
+};
+
 extern const int sizeof_Buffer;
 
 int buf_init(Buffer *);
 int buf_load_file(Buffer *, HANDLE, uint slurp_thresh);
+int buf_load_device(Buffer *, HANDLE);
+int buf_load_process(Buffer *, HANDLE);
+int buf_clone(Buffer *dst, Buffer *src);
 void buf_finalize(Buffer *);
-void buf_read(Buffer *, uchar *, uint64, size_t);
+int buf_read(Buffer *, uchar *, uint64, size_t);
 uchar buf_getbyte(Buffer *, uint64);
 int buf_save(Buffer *, HANDLE);
 int buf_save_in_place(Buffer *);
 void buf_replace(Buffer *, uint64, const uchar *, uint64);
 void buf_insert(Buffer *, uint64, const uchar *, uint64);
 void buf_delete(Buffer *, uint64, uint64);
+void buf_invalidate(Buffer *, uint64, uint64);
+int buf_begin_batch(Buffer *);
+int buf_batch_replace(Buffer *, uint64, const uchar *, uint64);
+int buf_batch_insert(Buffer *, uint64, const uchar *, uint64);
+int buf_batch_delete(Buffer *, uint64, uint64);
+int buf_commit(Buffer *);
+void buf_abort_batch(Buffer *);
+int buf_undo(Buffer *, uint64 *addr);
+int buf_redo(Buffer *, uint64 *addr);
+void buf_set_undo_limit(Buffer *, uint64);
+void buf_clear_undo(Buffer *);
+void buf_memory(Buffer *, BufMemory *);
+void buf_set_memory_limit(Buffer *, uint64 soft, uint64 hard);
 uint64 buf_size(Buffer *);
-int buf_kmp_search(Buffer *b, const uchar *pat, int len, uint64 start,
-                   uint64 *pos);
-int buf_kmp_search_backward(Buffer *b, const uchar *pat, int len, uint64 start,
-                            uint64 *pos);
+void buf_set_io_depth(Buffer *, int);
+int buf_set_block_size(Buffer *, size_t);
+int buf_scan(Buffer *, uint64 start, uint64 len, BufScanProc, void *arg);
+int buf_scan_backward(Buffer *, uint64 start, uint64 len, BufScanProc,
+                      void *arg);
+int buf_summarize(Buffer *, int nblocks);
+void buf_summary(Buffer *, uint64 start, uint64 len, BufSummary *);
+int buf_summary_excludes(Buffer *, uint64 start, uint64 len, uchar c);
+uint64 buf_tree_hash(Buffer *, uint64 start, uint64 len);
+int buf_equal(Buffer *, Buffer *);
+void buf_subscribe(Buffer *, BufChangeProc, void *arg);
+void buf_unsubscribe(Buffer *, BufChangeProc, void *arg);
+int buf_dirty_ranges(Buffer *, uint64 start, uint64 end, BufRange *, int max);
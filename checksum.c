@@ -0,0 +1,1087 @@
+#include "u.h"
+
+#include <windows.h>
+#if defined __i386__ || defined __x86_64__
+#define X86_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "buffer.h"
+#include "checksum.h"
+#include "threads.h"
+
+#define B3_CHUNK 1024
+#define B3_SUBTREE ((uint64) 1 << 20) // bytes hashed per task by threads
+
+/* Digests are in the usual byte order: big-endian for CRC32, Adler-32
+   and XXH64, as printed by common tools. */
+
+struct blake3 {
+    uint32 cv[8]; // of the chunk so far
+    uint64 chunk; // index of the chunk
+    int nblocks; // blocks of it compressed
+    uchar block[64]; // the last block, kept until more input comes
+    int nblock;
+    uint32 stack[54][8]; // chaining values of finished subtrees
+    int nstack;
+};
+
+struct ck_state {
+    int algo;
+    uint64 total; // bytes hashed
+    uint64 pos; // next address expected from buf_scan
+    union {
+        uint32 crc;
+        struct {
+            uint32 a, b;
+        } adler;
+        uint32 h[8]; // SHA-1, SHA-256
+        uint64 v[4]; // XXH64
+        struct blake3 b3;
+    };
+    uchar block[64]; // partial block
+    int nblock;
+};
+
+static const struct {
+    const char *name;
+    int size;
+    int blocksize; // 0 if the algorithm takes any length
+} algos[N_CK] = {
+    { "crc32", 4, 0 },
+    { "adler32", 4, 0 },
+    { "sha1", 20, 64 },
+    { "sha256", 32, 64 },
+    { "xxh64", 8, 32 },
+    { "blake3", 32, 0 },
+};
+
+/* kernels for instructions not every processor has */
+static int have_sse2, have_clmul, have_sha;
+
+static void
+detect_cpu(void)
+{
+#ifdef X86_KERNELS
+    static int done;
+    uint a, b, c, d;
+
+    if (done) return;
+    done = 1;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return;
+    have_sse2 = !!(d & bit_SSE2);
+    have_clmul = (c & bit_PCLMUL) && (d & bit_SSE2);
+    if ((c & bit_SSSE3) && (c & bit_SSE4_1) &&
+        __get_cpuid_count(7, 0, &a, &b, &c, &d))
+    {
+        have_sha = !!(b & bit_SHA);
+    }
+#endif
+}
+
+int
+ck_lookup(const char *name)
+{
+    for (int i=0; i<N_CK; i++) {
+        if (!strcmp(name, algos[i].name)) return i;
+    }
+    return -1;
+}
+
+const char *
+ck_name(int algo)
+{
+    return algos[algo].name;
+}
+
+int
+ck_digest_size(int algo)
+{
+    return algos[algo].size;
+}
+
+static uint32
+rol32(uint32 x, int n)
+{
+    return x << n | x >> (32-n);
+}
+
+static uint32
+ror32(uint32 x, int n)
+{
+    return x >> n | x << (32-n);
+}
+
+static uint64
+rol64(uint64 x, int n)
+{
+    return x << n | x >> (64-n);
+}
+
+static uint32
+load_be32(const uchar *p)
+{
+    return (uint32) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32
+load_le32(const uchar *p)
+{
+    return (uint32) p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static uint64
+load_le64(const uchar *p)
+{
+    return (uint64) load_le32(p+4) << 32 | load_le32(p);
+}
+
+static void
+store_le32(uchar *p, uint32 x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static void
+store_be32(uchar *p, uint32 x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+/* CRC-32 (IEEE 802.3), eight bytes at a time through tables, or 64 with
+   carry-less multiplies on processors that have them */
+
+static uint32 crc_table[8][256];
+
+static void
+init_crc_table(void)
+{
+    for (int i=0; i<256; i++) {
+        uint32 c = i;
+        for (int k=0; k<8; k++) c = c & 1 ? 0xedb88320 ^ c >> 1 : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int i=0; i<256; i++) {
+        for (int t=1; t<8; t++) {
+            uint32 c = crc_table[t-1][i];
+            crc_table[t][i] = crc_table[0][c & 0xff] ^ c >> 8;
+        }
+    }
+}
+
+static uint32
+crc32_table(uint32 crc, const uchar *p, size_t n)
+{
+    while (n >= 8) {
+        uint32 lo = crc ^ load_le32(p);
+        uint32 hi = load_le32(p+4);
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][lo >> 8 & 0xff] ^
+              crc_table[5][lo >> 16 & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][hi >> 8 & 0xff] ^
+              crc_table[1][hi >> 16 & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) crc = crc_table[0][(crc ^ *p++) & 0xff] ^ crc >> 8;
+    return crc;
+}
+
+#ifdef X86_KERNELS
+/* Folds the CRC 64 bytes at a time with carry-less multiplies, as in
+   Intel's "Fast CRC Computation Using PCLMULQDQ", down to 16 bytes that
+   leave the same remainder, which go through the table. n is a multiple
+   of 16, at least 64. */
+__attribute__((target("sse2,pclmul")))
+static uint32
+crc32_clmul(uint32 crc, const uchar *p, size_t n)
+{
+    const __m128i k4 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+    const __m128i k1 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+    __m128i x[4], t;
+    uchar rest[16];
+
+    for (int i=0; i<4; i++) {
+        x[i] = _mm_loadu_si128((const __m128i *)(p + 16*i));
+    }
+    x[0] = _mm_xor_si128(x[0], _mm_cvtsi32_si128((int) crc));
+    for (p += 64, n -= 64; n >= 64; p += 64, n -= 64) {
+        for (int i=0; i<4; i++) {
+            t = _mm_clmulepi64_si128(x[i], k4, 0x11);
+            x[i] = _mm_xor_si128(_mm_clmulepi64_si128(x[i], k4, 0x00), t);
+            x[i] = _mm_xor_si128(x[i],
+                _mm_loadu_si128((const __m128i *)(p + 16*i)));
+        }
+    }
+    for (int i=1; i<4; i++) {
+        t = _mm_clmulepi64_si128(x[0], k1, 0x11);
+        x[0] = _mm_xor_si128(_mm_clmulepi64_si128(x[0], k1, 0x00), t);
+        x[0] = _mm_xor_si128(x[0], x[i]);
+    }
+    for (; n; p += 16, n -= 16) {
+        t = _mm_clmulepi64_si128(x[0], k1, 0x11);
+        x[0] = _mm_xor_si128(_mm_clmulepi64_si128(x[0], k1, 0x00), t);
+        x[0] = _mm_xor_si128(x[0], _mm_loadu_si128((const __m128i *) p));
+    }
+    _mm_storeu_si128((__m128i *) rest, x[0]);
+    return crc32_table(0, rest, 16);
+}
+#endif
+
+static uint32
+crc32_update(uint32 crc, const uchar *p, size_t n)
+{
+#ifdef X86_KERNELS
+    if (have_clmul && n >= 64) {
+        size_t k = n & ~(size_t) 15;
+        crc = crc32_clmul(crc, p, k);
+        p += k;
+        n -= k;
+    }
+#endif
+    return crc32_table(crc, p, n);
+}
+
+/* Adler-32; 5552 is the most bytes that can be summed before b could
+   overflow 32 bits */
+
+static void
+adler32_update(struct ck_state *st, const uchar *p, size_t n)
+{
+    uint32 a = st->adler.a;
+    uint32 b = st->adler.b;
+    while (n) {
+        size_t k = n < 5552 ? n : 5552;
+        n -= k;
+        while (k--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    st->adler.a = a;
+    st->adler.b = b;
+}
+
+/* SHA-1 and SHA-256, FIPS 180-4 */
+
+static void
+sha1_block(uint32 *h, const uchar *p)
+{
+    uint32 w[80];
+    uint32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int i=0; i<16; i++) w[i] = load_be32(p + 4*i);
+    for (int i=16; i<80; i++) {
+        w[i] = rol32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    }
+    for (int i=0; i<80; i++) {
+        uint32 f, k, t;
+        if (i < 20) {
+            f = d ^ b & (c ^ d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = b & c | d & (b | c);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        t = rol32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol32(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static const uint32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void
+sha256_block(uint32 *h, const uchar *p)
+{
+    uint32 w[64];
+    uint32 a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32 e = h[4], f = h[5], g = h[6], k = h[7];
+
+    for (int i=0; i<16; i++) w[i] = load_be32(p + 4*i);
+    for (int i=16; i<64; i++) {
+        uint32 s0 = ror32(w[i-15], 7) ^ ror32(w[i-15], 18) ^ w[i-15] >> 3;
+        uint32 s1 = ror32(w[i-2], 17) ^ ror32(w[i-2], 19) ^ w[i-2] >> 10;
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    for (int i=0; i<64; i++) {
+        uint32 s1 = ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25);
+        uint32 ch = g ^ e & (f ^ g);
+        uint32 t1 = k + s1 + ch + sha256_k[i] + w[i];
+        uint32 s0 = ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22);
+        uint32 maj = a & b | c & (a | b);
+        uint32 t2 = s0 + maj;
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+#ifdef X86_KERNELS
+/* SHA-1 with the SHA extensions. A register holds four words of the
+   schedule, and each sha1rnds4 does four rounds. */
+
+__attribute__((target("sse2,ssse3,sse4.1,sha")))
+static __m128i
+sha1_rounds(__m128i abcd, __m128i e, int f)
+{
+    switch (f) {
+    case 0: return _mm_sha1rnds4_epu32(abcd, e, 0);
+    case 1: return _mm_sha1rnds4_epu32(abcd, e, 1);
+    case 2: return _mm_sha1rnds4_epu32(abcd, e, 2);
+    default: return _mm_sha1rnds4_epu32(abcd, e, 3);
+    }
+}
+
+__attribute__((target("sse2,ssse3,sse4.1,sha")))
+static void
+sha1_blocks_ni(uint32 *h, const uchar *p, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607,
+                                         0x08090a0b0c0d0e0f);
+    __m128i abcd = _mm_shuffle_epi32(
+        _mm_loadu_si128((const __m128i *) h), 0x1b);
+    __m128i e0 = _mm_set_epi32((int) h[4], 0, 0, 0);
+
+    for (; nblocks--; p += 64) {
+        __m128i abcd0 = abcd, e00 = e0, prev = abcd, e, w[4];
+        for (int g=0; g<20; g++) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + 16*g)), bswap);
+            } else {
+                __m128i t = _mm_sha1msg1_epu32(w[g%4], w[(g+1)%4]);
+                t = _mm_xor_si128(t, w[(g+2)%4]);
+                w[g%4] = _mm_sha1msg2_epu32(t, w[(g+3)%4]);
+            }
+            e = g ? _mm_sha1nexte_epu32(prev, w[g%4])
+                  : _mm_add_epi32(e0, w[0]);
+            prev = abcd;
+            abcd = sha1_rounds(abcd, e, g/5);
+        }
+        e0 = _mm_sha1nexte_epu32(prev, e00);
+        abcd = _mm_add_epi32(abcd, abcd0);
+    }
+    _mm_storeu_si128((__m128i *) h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = (uint32) _mm_extract_epi32(e0, 3);
+}
+
+/* SHA-256 with the SHA extensions, which keep the state as ABEF and
+   CDGH; each sha256rnds2 does two rounds. */
+__attribute__((target("sse2,ssse3,sse4.1,sha")))
+static void
+sha256_blocks_ni(uint32 *h, const uchar *p, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0b,
+                                         0x0405060700010203);
+    __m128i t = _mm_shuffle_epi32(
+        _mm_loadu_si128((const __m128i *) h), 0xb1);
+    __m128i s1 = _mm_shuffle_epi32(
+        _mm_loadu_si128((const __m128i *)(h+4)), 0x1b);
+    __m128i s0 = _mm_alignr_epi8(t, s1, 8);
+
+    s1 = _mm_blend_epi16(s1, t, 0xf0);
+    for (; nblocks--; p += 64) {
+        __m128i abef = s0, cdgh = s1, w[4], m;
+        for (int g=0; g<16; g++) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(p + 16*g)), bswap);
+            } else {
+                m = _mm_sha256msg1_epu32(w[g%4], w[(g+1)%4]);
+                m = _mm_add_epi32(m, _mm_alignr_epi8(w[(g+3)%4],
+                                                     w[(g+2)%4], 4));
+                w[g%4] = _mm_sha256msg2_epu32(m, w[(g+3)%4]);
+            }
+            m = _mm_add_epi32(w[g%4],
+                _mm_loadu_si128((const __m128i *)(sha256_k + 4*g)));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, m);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(m, 0x0e));
+        }
+        s0 = _mm_add_epi32(s0, abef);
+        s1 = _mm_add_epi32(s1, cdgh);
+    }
+    t = _mm_shuffle_epi32(s0, 0x1b);
+    s1 = _mm_shuffle_epi32(s1, 0xb1);
+    _mm_storeu_si128((__m128i *) h, _mm_blend_epi16(t, s1, 0xf0));
+    _mm_storeu_si128((__m128i *)(h+4), _mm_alignr_epi8(s1, t, 8));
+}
+#endif
+
+/* XXH64 with seed 0 */
+
+#define XXH_P1 ((uint64) 0x9e3779b185ebca87)
+#define XXH_P2 ((uint64) 0xc2b2ae3d27d4eb4f)
+#define XXH_P3 ((uint64) 0x165667b19e3779f9)
+#define XXH_P4 ((uint64) 0x85ebca77c2b2ae63)
+#define XXH_P5 ((uint64) 0x27d4eb2f165667c5)
+
+static uint64
+xxh_round(uint64 acc, uint64 x)
+{
+    return rol64(acc + x * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64
+xxh_merge(uint64 h, uint64 v)
+{
+    return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static void
+xxh64_block(uint64 *v, const uchar *p)
+{
+    v[0] = xxh_round(v[0], load_le64(p));
+    v[1] = xxh_round(v[1], load_le64(p+8));
+    v[2] = xxh_round(v[2], load_le64(p+16));
+    v[3] = xxh_round(v[3], load_le64(p+24));
+}
+
+static uint64
+xxh64_final(struct ck_state *st)
+{
+    const uchar *p = st->block;
+    int n = st->nblock;
+    uint64 h;
+
+    if (st->total >= 32) {
+        h = rol64(st->v[0], 1) + rol64(st->v[1], 7) +
+            rol64(st->v[2], 12) + rol64(st->v[3], 18);
+        for (int i=0; i<4; i++) h = xxh_merge(h, st->v[i]);
+    } else {
+        h = XXH_P5;
+    }
+    h += st->total;
+    for (; n >= 8; p += 8, n -= 8) {
+        h ^= xxh_round(0, load_le64(p));
+        h = rol64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (n >= 4) {
+        h ^= load_le32(p) * XXH_P1;
+        h = rol64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n; p++, n--) {
+        h ^= *p * XXH_P5;
+        h = rol64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* BLAKE3. The input is split into 1 KiB chunks, hashed into chaining
+   values that are paired up in a binary tree, larger subtrees on the
+   left. Whole subtrees can be hashed apart, which is what lets threads
+   share the work. */
+
+enum {
+    B3_CHUNK_START = 1,
+    B3_CHUNK_END = 2,
+    B3_PARENT = 4,
+    B3_ROOT = 8,
+};
+
+static const uint32 blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* message words used by each round */
+static const uchar blake3_sched[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static void
+b3_g(uint32 *v, int a, int b, int c, int d, uint32 x, uint32 y)
+{
+    v[a] += v[b] + x;
+    v[d] = ror32(v[d] ^ v[a], 16);
+    v[c] += v[d];
+    v[b] = ror32(v[b] ^ v[c], 12);
+    v[a] += v[b] + y;
+    v[d] = ror32(v[d] ^ v[a], 8);
+    v[c] += v[d];
+    v[b] = ror32(v[b] ^ v[c], 7);
+}
+
+/* compresses the block m into out, which may be cv */
+static void
+b3_compress(const uint32 *cv, const uint32 *m, uint64 counter, uint32 len,
+            uint32 flags, uint32 *out)
+{
+    uint32 v[16];
+
+    memcpy(v, cv, 32);
+    memcpy(v+8, blake3_iv, 16);
+    v[12] = (uint32) counter;
+    v[13] = (uint32)(counter >> 32);
+    v[14] = len;
+    v[15] = flags;
+    for (int r=0; r<7; r++) {
+        const uchar *s = blake3_sched[r];
+        b3_g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        b3_g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        b3_g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        b3_g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        b3_g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        b3_g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        b3_g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        b3_g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i=0; i<8; i++) out[i] = v[i] ^ v[i+8];
+}
+
+#ifdef X86_KERNELS
+/* Four whole chunks at once, a lane each: v[i] holds word i of the
+   four states. */
+
+__attribute__((target("sse2")))
+static __m128i
+rot16(__m128i x)
+{
+    return _mm_or_si128(_mm_srli_epi32(x, 16), _mm_slli_epi32(x, 16));
+}
+
+__attribute__((target("sse2")))
+static __m128i
+rot12(__m128i x)
+{
+    return _mm_or_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(x, 20));
+}
+
+__attribute__((target("sse2")))
+static __m128i
+rot8(__m128i x)
+{
+    return _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 24));
+}
+
+__attribute__((target("sse2")))
+static __m128i
+rot7(__m128i x)
+{
+    return _mm_or_si128(_mm_srli_epi32(x, 7), _mm_slli_epi32(x, 25));
+}
+
+__attribute__((target("sse2")))
+static void
+b3_g4(__m128i *v, int a, int b, int c, int d, __m128i x, __m128i y)
+{
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+    v[d] = rot16(_mm_xor_si128(v[d], v[a]));
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = rot12(_mm_xor_si128(v[b], v[c]));
+    v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+    v[d] = rot8(_mm_xor_si128(v[d], v[a]));
+    v[c] = _mm_add_epi32(v[c], v[d]);
+    v[b] = rot7(_mm_xor_si128(v[b], v[c]));
+}
+
+/* transposes four rows of four words */
+__attribute__((target("sse2")))
+static void
+transpose4(__m128i *r)
+{
+    __m128i ab0 = _mm_unpacklo_epi32(r[0], r[1]);
+    __m128i ab1 = _mm_unpackhi_epi32(r[0], r[1]);
+    __m128i cd0 = _mm_unpacklo_epi32(r[2], r[3]);
+    __m128i cd1 = _mm_unpackhi_epi32(r[2], r[3]);
+
+    r[0] = _mm_unpacklo_epi64(ab0, cd0);
+    r[1] = _mm_unpackhi_epi64(ab0, cd0);
+    r[2] = _mm_unpacklo_epi64(ab1, cd1);
+    r[3] = _mm_unpackhi_epi64(ab1, cd1);
+}
+
+/* the chaining values of the four chunks at p, the first being chunk */
+__attribute__((target("sse2")))
+static void
+b3_chunks4(const uchar *p, uint64 chunk, uint32 (*out)[8])
+{
+    __m128i h[8], v[16], m[16];
+    __m128i lo = _mm_set_epi32((int)(chunk+3), (int)(chunk+2),
+                               (int)(chunk+1), (int) chunk);
+    __m128i hi = _mm_set_epi32((int)((chunk+3) >> 32),
+                               (int)((chunk+2) >> 32),
+                               (int)((chunk+1) >> 32),
+                               (int)(chunk >> 32));
+
+    for (int i=0; i<8; i++) h[i] = _mm_set1_epi32((int) blake3_iv[i]);
+    for (int blk=0; blk<B3_CHUNK/64; blk++) {
+        int flags = (blk ? 0 : B3_CHUNK_START) |
+                    (blk < B3_CHUNK/64 - 1 ? 0 : B3_CHUNK_END);
+        for (int q=0; q<4; q++) {
+            for (int k=0; k<4; k++) {
+                m[4*q+k] = _mm_loadu_si128((const __m128i *)
+                    (p + k*B3_CHUNK + blk*64 + 16*q));
+            }
+            transpose4(m + 4*q);
+        }
+        memcpy(v, h, sizeof h);
+        for (int i=0; i<4; i++) v[8+i] = _mm_set1_epi32((int) blake3_iv[i]);
+        v[12] = lo;
+        v[13] = hi;
+        v[14] = _mm_set1_epi32(64);
+        v[15] = _mm_set1_epi32(flags);
+        for (int r=0; r<7; r++) {
+            const uchar *s = blake3_sched[r];
+            b3_g4(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+            b3_g4(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+            b3_g4(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+            b3_g4(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+            b3_g4(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+            b3_g4(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+            b3_g4(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+            b3_g4(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for (int i=0; i<8; i++) h[i] = _mm_xor_si128(v[i], v[i+8]);
+    }
+    transpose4(h);
+    transpose4(h+4);
+    for (int k=0; k<4; k++) {
+        _mm_storeu_si128((__m128i *) out[k], h[k]);
+        _mm_storeu_si128((__m128i *)(out[k] + 4), h[4+k]);
+    }
+}
+#endif
+
+static void
+b3_init(struct blake3 *s, uint64 chunk)
+{
+    memcpy(s->cv, blake3_iv, sizeof s->cv);
+    s->chunk = chunk;
+    s->nblocks = 0;
+    s->nblock = 0;
+    s->nstack = 0;
+}
+
+/* compresses a block of the chunk that is not its last */
+static void
+b3_block(struct blake3 *s, const uchar *p)
+{
+    uint32 m[16];
+
+    for (int i=0; i<16; i++) m[i] = load_le32(p + 4*i);
+    b3_compress(s->cv, m, s->chunk, 64, s->nblocks ? 0 : B3_CHUNK_START,
+                s->cv);
+    s->nblocks++;
+}
+
+/* the chaining value of the chunk, with the last block */
+static void
+b3_chunk_end(struct blake3 *s, uint32 flags, uint32 *out)
+{
+    uint32 m[16];
+
+    memset(s->block + s->nblock, 0, 64 - s->nblock);
+    for (int i=0; i<16; i++) m[i] = load_le32(s->block + 4*i);
+    flags |= B3_CHUNK_END | (s->nblocks ? 0 : B3_CHUNK_START);
+    b3_compress(s->cv, m, s->chunk, s->nblock, flags, out);
+}
+
+static void
+b3_parent(const uint32 *left, const uint32 *right, uint32 flags,
+          uint32 *out)
+{
+    uint32 m[16];
+
+    memcpy(m, left, 32);
+    memcpy(m+8, right, 32);
+    b3_compress(blake3_iv, m, 0, 64, B3_PARENT | flags, out);
+}
+
+/* Adds the chaining value of the n-th subtree of some size. The
+   subtrees it completes are merged, leaving one value on the stack per
+   bit set in n. */
+static void
+b3_push(struct blake3 *s, uint32 *cv, uint64 n)
+{
+    while (!(n & 1)) {
+        b3_parent(s->stack[--s->nstack], cv, 0, cv);
+        n >>= 1;
+    }
+    memcpy(s->stack[s->nstack++], cv, 32);
+}
+
+static void
+b3_update(struct blake3 *s, const uchar *p, size_t n)
+{
+    while (n) {
+        size_t k;
+        if (s->nblock == 64) {
+            /* more is coming, so the kept block is not the last */
+            if (s->nblocks < B3_CHUNK/64 - 1) {
+                b3_block(s, s->block);
+            } else {
+                uint32 cv[8];
+                b3_chunk_end(s, 0, cv);
+                b3_push(s, cv, ++s->chunk);
+                memcpy(s->cv, blake3_iv, sizeof s->cv);
+                s->nblocks = 0;
+            }
+            s->nblock = 0;
+        }
+#ifdef X86_KERNELS
+        if (have_sse2 && !s->nblock && !s->nblocks && n > 4*B3_CHUNK) {
+            uint32 cv[4][8];
+            b3_chunks4(p, s->chunk, cv);
+            for (int i=0; i<4; i++) b3_push(s, cv[i], ++s->chunk);
+            p += 4*B3_CHUNK;
+            n -= 4*B3_CHUNK;
+            continue;
+        }
+#endif
+        if (!s->nblock && n > 64 && s->nblocks < B3_CHUNK/64 - 1) {
+            b3_block(s, p);
+            p += 64;
+            n -= 64;
+            continue;
+        }
+        k = min(n, (size_t)(64 - s->nblock));
+        memcpy(s->block + s->nblock, p, k);
+        s->nblock += k;
+        p += k;
+        n -= k;
+    }
+}
+
+/* Stores the chaining value of everything added, as a whole subtree, or
+   with B3_ROOT the first 32 bytes of the hash. */
+static void
+b3_final(struct blake3 *s, uint32 flags, uint32 *out)
+{
+    if (!s->nstack) {
+        b3_chunk_end(s, flags, out);
+        return;
+    }
+    b3_chunk_end(s, 0, out);
+    for (int i=s->nstack; i--; ) {
+        b3_parent(s->stack[i], out, i ? 0 : flags, out);
+    }
+}
+
+static void
+ck_init(struct ck_state *st, int algo)
+{
+    static const uint32 sha1_init[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+    };
+    static const uint32 sha256_init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    st->algo = algo;
+    st->total = 0;
+    st->nblock = 0;
+    switch (algo) {
+    case CK_CRC32:
+        if (!crc_table[0][1]) init_crc_table();
+        st->crc = 0xffffffff;
+        break;
+    case CK_ADLER32:
+        st->adler.a = 1;
+        st->adler.b = 0;
+        break;
+    case CK_SHA1:
+        memcpy(st->h, sha1_init, sizeof sha1_init);
+        break;
+    case CK_SHA256:
+        memcpy(st->h, sha256_init, sizeof sha256_init);
+        break;
+    case CK_XXH64:
+        st->v[0] = XXH_P1 + XXH_P2;
+        st->v[1] = XXH_P2;
+        st->v[2] = 0;
+        st->v[3] = -XXH_P1;
+        break;
+    case CK_BLAKE3:
+        b3_init(&st->b3, 0);
+        break;
+    }
+}
+
+static void
+do_blocks(struct ck_state *st, const uchar *p, size_t nblocks)
+{
+    switch (st->algo) {
+    case CK_SHA1:
+#ifdef X86_KERNELS
+        if (have_sha) {
+            sha1_blocks_ni(st->h, p, nblocks);
+            break;
+        }
+#endif
+        for (; nblocks--; p += 64) sha1_block(st->h, p);
+        break;
+    case CK_SHA256:
+#ifdef X86_KERNELS
+        if (have_sha) {
+            sha256_blocks_ni(st->h, p, nblocks);
+            break;
+        }
+#endif
+        for (; nblocks--; p += 64) sha256_block(st->h, p);
+        break;
+    case CK_XXH64:
+        for (; nblocks--; p += 32) xxh64_block(st->v, p);
+        break;
+    }
+}
+
+static void
+ck_update(struct ck_state *st, const uchar *p, size_t n)
+{
+    int bs = algos[st->algo].blocksize;
+
+    st->total += n;
+    switch (st->algo) {
+    case CK_CRC32:
+        st->crc = crc32_update(st->crc, p, n);
+        return;
+    case CK_ADLER32:
+        adler32_update(st, p, n);
+        return;
+    case CK_BLAKE3:
+        b3_update(&st->b3, p, n);
+        return;
+    }
+    /* block algorithms: finish the partial block first, then hash
+       straight from p */
+    if (st->nblock) {
+        size_t k = bs - st->nblock;
+        if (k > n) k = n;
+        memcpy(st->block + st->nblock, p, k);
+        st->nblock += k;
+        p += k;
+        n -= k;
+        if (st->nblock < bs) return;
+        do_blocks(st, st->block, 1);
+        st->nblock = 0;
+    }
+    do_blocks(st, p, n / bs);
+    p += n / bs * bs;
+    n %= bs;
+    memcpy(st->block, p, n);
+    st->nblock = n;
+}
+
+static void
+sha_pad(struct ck_state *st)
+{
+    uint64 bits = st->total * 8;
+    uchar pad[72];
+    size_t n = 64 - (st->total + 8) % 64;
+
+    memset(pad, 0, sizeof pad);
+    pad[0] = 0x80;
+    store_be32(pad + n, (uint32)(bits >> 32));
+    store_be32(pad + n + 4, (uint32) bits);
+    ck_update(st, pad, n + 8);
+}
+
+static void
+ck_final(struct ck_state *st, uchar *digest)
+{
+    uint32 w[8];
+    uint64 h;
+
+    switch (st->algo) {
+    case CK_CRC32:
+        store_be32(digest, ~st->crc);
+        break;
+    case CK_ADLER32:
+        store_be32(digest, st->adler.b << 16 | st->adler.a);
+        break;
+    case CK_SHA1:
+    case CK_SHA256:
+        sha_pad(st);
+        for (int i=0; i<algos[st->algo].size/4; i++) {
+            store_be32(digest + 4*i, st->h[i]);
+        }
+        break;
+    case CK_XXH64:
+        h = xxh64_final(st);
+        store_be32(digest, (uint32)(h >> 32));
+        store_be32(digest + 4, (uint32) h);
+        break;
+    case CK_BLAKE3:
+        b3_final(&st->b3, B3_ROOT, w);
+        for (int i=0; i<8; i++) store_le32(digest + 4*i, w[i]);
+        break;
+    }
+}
+
+/* unreadable gaps skipped by buf_scan read as zeros */
+static void
+skip_to(struct ck_state *st, uint64 addr)
+{
+    static const uchar zero[4096];
+    while (st->pos < addr) {
+        size_t n = (size_t) min(addr - st->pos, sizeof zero);
+        ck_update(st, zero, n);
+        st->pos += n;
+    }
+}
+
+static int
+checksum_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct ck_state *st = arg;
+    skip_to(st, addr);
+    ck_update(st, data, len);
+    st->pos = addr + len;
+    return 0;
+}
+
+/* BLAKE3 subtrees hashed by threads, a batch at a time so that their
+   chaining values take bounded room */
+struct b3_job {
+    Buffer *b;
+    uint64 start; // of the first subtree
+    uint64 first; // its index
+    LONG n;
+    volatile LONG next;
+    volatile LONG failed;
+    uint32 cv[1024][8];
+};
+
+static DWORD WINAPI
+b3_worker(void *arg)
+{
+    struct b3_job *j = arg;
+    struct ck_state st;
+    LONG i;
+
+    while (!j->failed && (i = InterlockedIncrement(&j->next)) < j->n) {
+        uint64 lo = j->start + i * B3_SUBTREE;
+        ck_init(&st, CK_BLAKE3);
+        st.b3.chunk = (j->first + i) * (B3_SUBTREE / B3_CHUNK);
+        st.pos = lo;
+        if (buf_scan(j->b, lo, B3_SUBTREE, checksum_span, &st)) {
+            j->failed = 1;
+            break;
+        }
+        skip_to(&st, lo + B3_SUBTREE);
+        b3_final(&st.b3, 0, j->cv[i]);
+    }
+    return 0;
+}
+
+/* Hashes the whole subtrees of [start, start+len) before its last byte
+   on several threads, into st, and moves st->pos past them. Returns -1
+   on read errors. */
+static int
+b3_subtrees(Buffer *b, struct ck_state *st, uint64 start, uint64 len)
+{
+    uint64 n = len ? (len - 1) / B3_SUBTREE : 0;
+    struct b3_job *j;
+    int failed;
+
+    if (n < 2 || thread_count() == 1) return 0;
+    j = xmalloc(sizeof *j);
+    j->b = b;
+    j->failed = 0;
+    for (uint64 done=0; done<n; done += j->n) {
+        j->start = start + done * B3_SUBTREE;
+        j->first = done;
+        j->n = (LONG) min(n - done, NELEM(j->cv));
+        j->next = -1;
+        run_threads(b3_worker, j, min(thread_count(), j->n));
+        if (j->failed) break;
+        for (LONG i=0; i<j->n; i++) b3_push(&st->b3, j->cv[i], done+i + 1);
+    }
+    failed = j->failed;
+    free(j);
+    if (failed) return -1;
+    st->b3.chunk = n * (B3_SUBTREE / B3_CHUNK);
+    st->pos = start + n * B3_SUBTREE;
+    return 0;
+}
+
+/* Checksums [start, start+len) of the buffer into digest, which must
+   hold ck_digest_size(algo) bytes. BLAKE3 over large ranges is hashed
+   by several threads, see set_thread_count. Returns -1 on read errors. */
+int
+buf_checksum(Buffer *b, int algo, uint64 start, uint64 len, uchar *digest)
+{
+    struct ck_state st;
+    uint64 size = buf_size(b);
+
+    assert(algo >= 0 && algo < N_CK);
+    if (start > size) start = size;
+    if (len > size - start) len = size - start;
+    detect_cpu();
+    ck_init(&st, algo);
+    st.pos = start;
+    if (algo == CK_BLAKE3 && b3_subtrees(b, &st, start, len)) return -1;
+    if (buf_scan(b, st.pos, start + len - st.pos, checksum_span, &st)) {
+        return -1;
+    }
+    skip_to(&st, start + len);
+    ck_final(&st, digest);
+    return 0;
+}
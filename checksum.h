@@ -0,0 +1,18 @@
+/* checksums of buffer ranges */
+
+enum {
+    CK_CRC32,
+    CK_ADLER32,
+    CK_SHA1,
+    CK_SHA256,
+    CK_XXH64,
+    CK_BLAKE3,
+    N_CK
+};
+
+#define CK_MAX_DIGEST 32
+
+int ck_lookup(const char *name);
+const char *ck_name(int algo);
+int ck_digest_size(int algo);
+int buf_checksum(Buffer *, int algo, uint64 start, uint64 len, uchar *digest);
@@ -1,15 +1,26 @@
-buffer.o: buffer.c u.h printf.h buffer.h winutil.h
+approx.o: approx.c u.h printf.h buffer.h approx.h
+blockbench.o: blockbench.c u.h printf.h buffer.h
+buffer.o: buffer.c u.h printf.h buffer.h entropy.h winutil.h
+checksum.o: checksum.c u.h printf.h buffer.h checksum.h threads.h
+entropy.o: entropy.c u.h printf.h buffer.h entropy.h threads.h
+findall.o: findall.c u.h printf.h buffer.h search.h value.h findall.h
 luatk.o: luatk.c u.h printf.h winutil.h unicode.h
 luatk_test.o: luatk_test.c u.h printf.h winutil.h unicode.h luatk.h
 main.o: main.c u.h printf.h buffer.h tree.h unicode.h resource.h \
- monoedit.h treelistview.h winutil.h luatk.h
+ monoedit.h treelistview.h winutil.h luatk.h search.h regex.h \
+ value.h findall.h threads.h
 monoedit.o: monoedit.c u.h printf.h monoedit.h
 newedit.o: newedit.c u.h printf.h winutil.h
 printf.o: printf.c
+regex.o: regex.c u.h printf.h buffer.h regex.h
+search.o: search.c u.h printf.h buffer.h search.h threads.h
+threads.o: threads.c u.h printf.h threads.h
 tree.o: tree.c u.h printf.h tree.h
 treelistview.o: treelistview.c u.h printf.h treelistview.h
 treeviewtest.o: treeviewtest.c u.h printf.h treelistview.h
 u.o: u.c u.h printf.h printf.c
 unicode.o: unicode.c u.h printf.h unicode.h
-whex_lua.o: whex_lua.c u.h printf.h buffer.h tree.h
+whex_lua.o: whex_lua.c u.h printf.h buffer.h approx.h checksum.h \
+ entropy.h regex.h search.h threads.h tree.h value.h
+value.o: value.c u.h printf.h buffer.h search.h value.h
 winutil.o: winutil.c u.h printf.h winutil.h
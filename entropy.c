@@ -0,0 +1,419 @@
+#include "u.h"
+
+#include <math.h>
+#include <windows.h>
+
+#include "buffer.h"
+#include "entropy.h"
+#include "threads.h"
+
+/* Entropy of sliding windows of a buffer: window i covers
+   [i*step, i*step+window), cut off at the end of the buffer. Each window
+   is made of window/step chunks, so moving to the next window adds one
+   chunk histogram and removes another. Values of windows touched by
+   edits are recomputed on the next ep_update. */
+struct entropy_profile {
+    Buffer *buf;
+    uint32 window;
+    uint32 step;
+    uint64 n;
+    float *values;
+    uint64 dirty_lo, dirty_hi; // windows to recompute
+};
+
+/* most chunks per window, to bound the chunk ring */
+#define MAX_CHUNKS 1024
+#define PIECE ((uint64) 4 << 20) // bytes per task for threads
+
+/* Adds the bytes of p[0:n] to counts. Spreading them over four tables
+   avoids stalls on runs of the same byte, and they are taken eight at a
+   time from one load. */
+void
+count_bytes(uint32 *counts, const uchar *p, size_t n)
+{
+    uint32 c[3][256];
+    size_t i = 0;
+
+    if (n >= 1024) {
+        memset(c, 0, sizeof c);
+        for (; i+8<=n; i+=8) {
+            uint64 x;
+            memcpy(&x, p+i, 8);
+            counts[x & 0xff]++;
+            c[0][x >> 8 & 0xff]++;
+            c[1][x >> 16 & 0xff]++;
+            c[2][x >> 24 & 0xff]++;
+            counts[x >> 32 & 0xff]++;
+            c[0][x >> 40 & 0xff]++;
+            c[1][x >> 48 & 0xff]++;
+            c[2][x >> 56]++;
+        }
+        for (int k=0; k<256; k++) counts[k] += c[0][k] + c[1][k] + c[2][k];
+    }
+    for (; i<n; i++) counts[p[i]]++;
+}
+
+/* in bits per byte */
+double
+byte_entropy(const uint32 *counts, uint64 n)
+{
+    double h = 0;
+    if (!n) return 0;
+    for (int c=0; c<256; c++) {
+        if (counts[c]) {
+            double q = (double) counts[c] / n;
+            h -= q * log2(q);
+        }
+    }
+    return h;
+}
+
+struct histogram {
+    uint64 *counts;
+    uint64 pos; // next address expected from buf_scan
+};
+
+static int
+histogram_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct histogram *h = arg;
+    uint32 counts[256];
+
+    /* unreadable gaps read as zeros */
+    h->counts[0] += addr - h->pos;
+    h->pos = addr + len;
+    memset(counts, 0, sizeof counts);
+    count_bytes(counts, data, len);
+    for (int c=0; c<256; c++) h->counts[c] += counts[c];
+    return 0;
+}
+
+static int
+histogram_range(Buffer *b, uint64 start, uint64 end, uint64 *counts)
+{
+    struct histogram h;
+
+    h.counts = counts;
+    h.pos = start;
+    if (buf_scan(b, start, end - start, histogram_span, &h)) return -1;
+    counts[0] += end - h.pos;
+    return 0;
+}
+
+/* A range split into pieces for threads, which take them in turn. */
+struct pieces {
+    Buffer *b;
+    uint64 start, end;
+    uint64 step;
+    LONG n;
+    volatile LONG next;
+    volatile LONG failed;
+    CRITICAL_SECTION lock;
+    uint64 *counts; // histograms: the sum of every thread's
+    EntropyProfile *p; // entropy profiles: windows to compute
+};
+
+static void
+init_pieces(struct pieces *j, Buffer *b, uint64 start, uint64 end,
+            uint64 step)
+{
+    j->b = b;
+    j->start = start;
+    j->end = end;
+    j->step = max(step, 1);
+    j->n = (LONG) ((end - start + j->step-1) / j->step);
+    j->next = -1;
+    j->failed = 0;
+}
+
+static int
+next_piece(struct pieces *j, uint64 *lo, uint64 *hi)
+{
+    LONG i;
+
+    if (j->failed || (i = InterlockedIncrement(&j->next)) >= j->n) return 0;
+    *lo = j->start + i * j->step;
+    *hi = min(*lo + j->step, j->end);
+    return 1;
+}
+
+static DWORD WINAPI
+histogram_worker(void *arg)
+{
+    struct pieces *j = arg;
+    uint64 counts[256];
+    uint64 lo, hi;
+
+    memset(counts, 0, sizeof counts);
+    while (next_piece(j, &lo, &hi)) {
+        if (histogram_range(j->b, lo, hi, counts)) j->failed = 1;
+    }
+    EnterCriticalSection(&j->lock);
+    for (int c=0; c<256; c++) j->counts[c] += counts[c];
+    LeaveCriticalSection(&j->lock);
+    return 0;
+}
+
+/* Counts each byte value in [start, start+len) into counts[256]. Large
+   ranges are counted by several threads, see set_thread_count. Returns
+   -1 on read errors. */
+int
+buf_histogram(Buffer *b, uint64 start, uint64 len, uint64 *counts)
+{
+    struct pieces j;
+    uint64 size = buf_size(b);
+
+    if (start > size) start = size;
+    if (len > size - start) len = size - start;
+    memset(counts, 0, 256 * sizeof *counts);
+    init_pieces(&j, b, start, start + len, PIECE);
+    if (j.n < 2 || thread_count() == 1) {
+        return histogram_range(b, start, start + len, counts);
+    }
+    j.counts = counts;
+    InitializeCriticalSection(&j.lock);
+    run_threads(histogram_worker, &j, min(thread_count(), j.n));
+    DeleteCriticalSection(&j.lock);
+    return j.failed ? -1 : 0;
+}
+
+static uint64
+window_count(EntropyProfile *p)
+{
+    uint64 size = buf_size(p->buf);
+    return size ? (size - 1) / p->step + 1 : 0;
+}
+
+static void
+mark_dirty(EntropyProfile *p, uint64 lo, uint64 hi)
+{
+    if (hi > p->n) hi = p->n;
+    if (lo >= hi) return;
+    if (p->dirty_lo >= p->dirty_hi) {
+        p->dirty_lo = lo;
+        p->dirty_hi = hi;
+    } else {
+        p->dirty_lo = min(p->dirty_lo, lo);
+        p->dirty_hi = max(p->dirty_hi, hi);
+    }
+}
+
+static void
+on_change(void *arg, uint64 addr, uint64 removed, uint64 inserted)
+{
+    EntropyProfile *p = arg;
+    uint64 lo = addr < p->window ? 0 : (addr - p->window) / p->step + 1;
+
+    if (removed != inserted) {
+        /* everything after addr has moved */
+        p->n = window_count(p);
+        p->values = xrealloc(p->values, (size_t) max(p->n, 1) *
+                             sizeof *p->values);
+        p->dirty_hi = min(p->dirty_hi, p->n);
+        mark_dirty(p, lo, p->n);
+    } else if (removed) {
+        mark_dirty(p, lo, (addr + removed - 1) / p->step + 1);
+    }
+}
+
+/* Profile of entropy over windows of the given size, moving step bytes
+   at a time. window must be a multiple of step, at most MAX_CHUNKS times
+   as large. Values are computed by ep_update. */
+EntropyProfile *
+ep_new(Buffer *b, uint32 window, uint32 step)
+{
+    EntropyProfile *p;
+
+    if (!step || !window || window % step || window / step > MAX_CHUNKS ||
+        window > MAX_ENTROPY_WINDOW)
+    {
+        return 0;
+    }
+    p = xmalloc(sizeof *p);
+    p->buf = b;
+    p->window = window;
+    p->step = step;
+    p->n = window_count(p);
+    p->values = xmalloc((size_t) max(p->n, 1) * sizeof *p->values);
+    p->dirty_lo = 0;
+    p->dirty_hi = p->n;
+    buf_subscribe(b, on_change, p);
+    return p;
+}
+
+void
+ep_free(EntropyProfile *p)
+{
+    if (!p) return;
+    buf_unsubscribe(p->buf, on_change, p);
+    free(p->values);
+    free(p);
+}
+
+uint64
+ep_count(EntropyProfile *p)
+{
+    return p->n;
+}
+
+uint32
+ep_step(EntropyProfile *p)
+{
+    return p->step;
+}
+
+/* valid after ep_update */
+const float *
+ep_values(EntropyProfile *p)
+{
+    return p->values;
+}
+
+struct ep_scan {
+    EntropyProfile *p;
+    uint64 hi; // windows below are needed
+    uint32 k; // chunks per window
+    uint32 *ring; // k+1 chunk histograms, chunk c in slot c % (k+1)
+    uint32 *ringlen;
+    uint64 chunk; // being counted
+    uint32 fill; // bytes counted in it
+    uint64 first; // oldest chunk in win
+    uint32 win[256];
+    uint64 wlen;
+    uint64 next; // next window to compute
+    uint64 pos; // next address expected from buf_scan
+};
+
+static uint32 *
+chunk_counts(struct ep_scan *sc, uint64 c)
+{
+    return sc->ring + (size_t)(c % (sc->k+1)) * 256;
+}
+
+/* computes window i once win holds chunks [first, i+k) */
+static void
+emit(struct ep_scan *sc, uint64 i)
+{
+    while (sc->first < i) {
+        uint32 *h = chunk_counts(sc, sc->first);
+        for (int c=0; c<256; c++) sc->win[c] -= h[c];
+        sc->wlen -= sc->ringlen[sc->first % (sc->k+1)];
+        sc->first++;
+    }
+    sc->p->values[i] = (float) byte_entropy(sc->win, sc->wlen);
+    sc->next = i+1;
+}
+
+static void
+chunk_done(struct ep_scan *sc)
+{
+    uint32 *h = chunk_counts(sc, sc->chunk);
+    for (int c=0; c<256; c++) sc->win[c] += h[c];
+    sc->wlen += sc->fill;
+    sc->ringlen[sc->chunk % (sc->k+1)] = sc->fill;
+    if (sc->chunk + 1 >= sc->next + sc->k) emit(sc, sc->chunk + 1 - sc->k);
+    sc->chunk++;
+    sc->fill = 0;
+    memset(chunk_counts(sc, sc->chunk), 0, 256 * sizeof *sc->ring);
+}
+
+/* adds len bytes at data, or zeros if data is null */
+static void
+feed(struct ep_scan *sc, const uchar *data, uint64 len)
+{
+    while (len) {
+        uint32 n = (uint32) min(len, sc->p->step - sc->fill);
+        if (data) {
+            count_bytes(chunk_counts(sc, sc->chunk), data, n);
+            data += n;
+        } else {
+            chunk_counts(sc, sc->chunk)[0] += n;
+        }
+        sc->fill += n;
+        len -= n;
+        if (sc->fill == sc->p->step) chunk_done(sc);
+    }
+}
+
+static int
+profile_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct ep_scan *sc = arg;
+    feed(sc, 0, addr - sc->pos);
+    feed(sc, data, len);
+    sc->pos = addr + len;
+    return 0;
+}
+
+/* computes windows [lo, hi) */
+static int
+profile_range(EntropyProfile *p, uint64 lo, uint64 hi)
+{
+    struct ep_scan sc;
+    uint64 start, end;
+    int ret;
+
+    sc.p = p;
+    sc.hi = hi;
+    sc.k = p->window / p->step;
+    sc.ring = xmalloc((size_t)(sc.k+1) * 256 * sizeof *sc.ring);
+    sc.ringlen = xmalloc((size_t)(sc.k+1) * sizeof *sc.ringlen);
+    sc.chunk = lo;
+    sc.fill = 0;
+    sc.first = lo;
+    memset(sc.win, 0, sizeof sc.win);
+    sc.wlen = 0;
+    sc.next = lo;
+    memset(chunk_counts(&sc, lo), 0, 256 * sizeof *sc.ring);
+
+    start = lo * p->step;
+    end = min((sc.hi + sc.k - 1) * p->step, buf_size(p->buf));
+    sc.pos = start;
+    ret = buf_scan(p->buf, start, end - start, profile_span, &sc);
+    if (!ret) {
+        feed(&sc, 0, end - sc.pos);
+        if (sc.fill) chunk_done(&sc);
+        /* windows running past the end of the buffer */
+        while (sc.next < sc.hi) emit(&sc, sc.next);
+    }
+    free(sc.ring);
+    free(sc.ringlen);
+    return ret ? -1 : 0;
+}
+
+static DWORD WINAPI
+profile_worker(void *arg)
+{
+    struct pieces *j = arg;
+    uint64 lo, hi;
+
+    while (next_piece(j, &lo, &hi)) {
+        if (profile_range(j->p, lo, hi)) j->failed = 1;
+    }
+    return 0;
+}
+
+/* Recomputes the windows changed since the last call, reading only the
+   data under them. Threads take runs of windows, each reading the
+   chunks its first window shares with the run before. Returns -1 on
+   read errors. */
+int
+ep_update(EntropyProfile *p)
+{
+    struct pieces j;
+    uint32 k = p->window / p->step;
+
+    if (p->dirty_lo >= p->dirty_hi) return 0;
+    /* runs long enough for the overlap to cost at most a quarter */
+    init_pieces(&j, p->buf, p->dirty_lo, p->dirty_hi,
+                max(PIECE / p->step, 4 * (uint64) k));
+    if (j.n < 2 || thread_count() == 1) {
+        if (profile_range(p, p->dirty_lo, p->dirty_hi)) return -1;
+    } else {
+        j.p = p;
+        run_threads(profile_worker, &j, min(thread_count(), j.n));
+        if (j.failed) return -1;
+    }
+    p->dirty_lo = p->dirty_hi = 0;
+    return 0;
+}
@@ -0,0 +1,15 @@
+/* byte histograms and Shannon entropy of buffer ranges */
+
+typedef struct entropy_profile EntropyProfile;
+
+#define MAX_ENTROPY_WINDOW (1<<30)
+
+void count_bytes(uint32 *counts, const uchar *p, size_t n);
+double byte_entropy(const uint32 *counts, uint64 n);
+int buf_histogram(Buffer *, uint64 start, uint64 len, uint64 *counts);
+EntropyProfile *ep_new(Buffer *, uint32 window, uint32 step);
+void ep_free(EntropyProfile *);
+int ep_update(EntropyProfile *);
+uint64 ep_count(EntropyProfile *);
+uint32 ep_step(EntropyProfile *);
+const float *ep_values(EntropyProfile *);
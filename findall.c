@@ -0,0 +1,263 @@
+#include "u.h"
+
+#include <windows.h>
+
+#include "buffer.h"
+#include "search.h"
+#include "value.h"
+#include "findall.h"
+
+#define BLOCK 64 // occurrences per index block
+
+/* The occurrences are kept in order as varint deltas from the one
+   before. The first of every BLOCK is kept whole instead, with where its
+   block starts in data, so lookups only decode a block. */
+struct find_all {
+    Buffer *buf;
+    uchar *pat;
+    uchar *mask; // or 0
+    ValueQuery *query; // searched for instead of pat, or 0
+    size_t len;
+    uint64 pos; // occurrences starting before are in the index
+    int done;
+    int stale; // the buffer changed
+    int truncated; // stopped at MAX_FIND_ALL
+    uint64 n;
+    uint64 last;
+    uchar *data;
+    size_t ndata, datacap;
+    uint64 *block_addr;
+    size_t *block_off;
+    size_t nblock, blockcap;
+};
+
+static void
+on_change(void *arg, uint64 addr, uint64 removed, uint64 inserted)
+{
+    FindAll *fa = arg;
+    fa->stale = 1;
+}
+
+/* Starts finding every occurrence of pat[0:len], overlapping ones
+   included; mask is as in buf_search_masked, or 0. The search is done by
+   fa_step. */
+FindAll *
+fa_new(Buffer *b, const uchar *pat, const uchar *mask, size_t len)
+{
+    FindAll *fa;
+
+    if (!len) return 0;
+    fa = xmalloc0(sizeof *fa);
+    fa->buf = b;
+    fa->pat = xmalloc(len);
+    memcpy(fa->pat, pat, len);
+    if (mask) {
+        fa->mask = xmalloc(len);
+        memcpy(fa->mask, mask, len);
+    }
+    fa->len = len;
+    buf_subscribe(b, on_change, fa);
+    return fa;
+}
+
+/* Like fa_new, but finds the values of q. */
+FindAll *
+fa_new_values(Buffer *b, const ValueQuery *q)
+{
+    FindAll *fa = xmalloc0(sizeof *fa);
+
+    fa->buf = b;
+    fa->query = xmalloc(sizeof *q);
+    *fa->query = *q;
+    fa->len = q->width;
+    buf_subscribe(b, on_change, fa);
+    return fa;
+}
+
+void
+fa_free(FindAll *fa)
+{
+    if (!fa) return;
+    buf_unsubscribe(fa->buf, on_change, fa);
+    free(fa->pat);
+    free(fa->mask);
+    free(fa->query);
+    free(fa->data);
+    free(fa->block_addr);
+    free(fa->block_off);
+    free(fa);
+}
+
+static void
+add(FindAll *fa, uint64 addr)
+{
+    if (fa->n % BLOCK == 0) {
+        if (fa->nblock == fa->blockcap) {
+            fa->blockcap = fa->blockcap ? 2 * fa->blockcap : 64;
+            fa->block_addr = xrealloc(fa->block_addr,
+                                      fa->blockcap * sizeof *fa->block_addr);
+            fa->block_off = xrealloc(fa->block_off,
+                                     fa->blockcap * sizeof *fa->block_off);
+        }
+        fa->block_addr[fa->nblock] = addr;
+        fa->block_off[fa->nblock] = fa->ndata;
+        fa->nblock++;
+    } else {
+        uint64 d = addr - fa->last;
+        if (fa->datacap - fa->ndata < 10) {
+            fa->datacap = fa->datacap ? 2 * fa->datacap : 4096;
+            fa->data = xrealloc(fa->data, fa->datacap);
+        }
+        while (d >= 0x80) {
+            fa->data[fa->ndata++] = (uchar) d | 0x80;
+            d >>= 7;
+        }
+        fa->data[fa->ndata++] = (uchar) d;
+    }
+    fa->last = addr;
+    fa->n++;
+}
+
+static int
+on_match(void *arg, int pattern, uint64 addr)
+{
+    FindAll *fa = arg;
+
+    if (fa->n == MAX_FIND_ALL) {
+        fa->truncated = 1;
+        return 1;
+    }
+    add(fa, addr);
+    return 0;
+}
+
+/* Searches the next nbytes. Returns 1 while there is more to search, 0
+   once done or if the buffer has changed, or -1 on read errors, in which
+   case the step may be retried. Each step is a whole search, so steps
+   can run between edits, which only make the index stale. */
+int
+fa_step(FindAll *fa, uint64 nbytes)
+{
+    uint64 size = buf_size(fa->buf);
+    uint64 end;
+    int ret;
+
+    if (fa->done || fa->stale) return 0;
+    end = fa->pos + min(nbytes, size - fa->pos);
+    /* occurrences starting before end lie before end+len-1 */
+    if (fa->query) {
+        ret = buf_search_values(fa->buf, fa->query, fa->pos,
+                                min(end + fa->len-1, size), on_match, fa);
+    } else {
+        ret = buf_search_all(fa->buf, fa->pat, fa->mask, fa->len, fa->pos,
+                             min(end + fa->len-1, size), on_match, fa);
+    }
+    if (ret < 0) return -1;
+    fa->pos = end;
+    if (ret || end == size) fa->done = 1;
+    return !fa->done;
+}
+
+int
+fa_done(FindAll *fa)
+{
+    return fa->done;
+}
+
+int
+fa_stale(FindAll *fa)
+{
+    return fa->stale;
+}
+
+int
+fa_truncated(FindAll *fa)
+{
+    return fa->truncated;
+}
+
+uint64
+fa_progress(FindAll *fa)
+{
+    return fa->pos;
+}
+
+uint64
+fa_count(FindAll *fa)
+{
+    return fa->n;
+}
+
+/* index of the last block starting at or before addr, or -1 */
+static ptrdiff_t
+find_block(FindAll *fa, uint64 addr)
+{
+    size_t lo = 0, hi = fa->nblock;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi-lo)/2;
+        if (fa->block_addr[mid] <= addr) lo = mid+1;
+        else hi = mid;
+    }
+    return (ptrdiff_t) lo - 1;
+}
+
+/* Decodes block i into out, returning how many occurrences it holds. */
+static int
+decode_block(FindAll *fa, size_t i, uint64 *out)
+{
+    const uchar *p = fa->data + fa->block_off[i];
+    int n = (int) min(fa->n - (uint64) i * BLOCK, BLOCK);
+    uint64 a = fa->block_addr[i];
+
+    out[0] = a;
+    for (int j=1; j<n; j++) {
+        uint64 d = 0;
+        int shift = 0;
+        do {
+            d |= (uint64)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        out[j] = a += d;
+    }
+    return n;
+}
+
+/* Finds the first occurrence at or after addr among those found so far.
+   Returns 0 and stores it in *pos if there is one, or 1. */
+int
+fa_next(FindAll *fa, uint64 addr, uint64 *pos)
+{
+    uint64 a[BLOCK];
+    ptrdiff_t i = find_block(fa, addr);
+
+    if (i >= 0) {
+        int n = decode_block(fa, i, a);
+        for (int j=0; j<n; j++) {
+            if (a[j] >= addr) {
+                *pos = a[j];
+                return 0;
+            }
+        }
+    }
+    if ((size_t)(i+1) < fa->nblock) {
+        *pos = fa->block_addr[i+1];
+        return 0;
+    }
+    return 1;
+}
+
+/* Finds the last occurrence at or before addr. Returns like fa_next. */
+int
+fa_prev(FindAll *fa, uint64 addr, uint64 *pos)
+{
+    uint64 a[BLOCK];
+    ptrdiff_t i = find_block(fa, addr);
+    int n;
+
+    if (i < 0) return 1;
+    n = decode_block(fa, i, a);
+    while (a[n-1] > addr) n--;
+    *pos = a[n-1];
+    return 0;
+}
@@ -0,0 +1,17 @@
+/* all occurrences of a pattern or of values, found a step at a time */
+
+typedef struct find_all FindAll;
+
+#define MAX_FIND_ALL (1<<24) // occurrences kept
+
+FindAll *fa_new(Buffer *, const uchar *pat, const uchar *mask, size_t len);
+FindAll *fa_new_values(Buffer *, const ValueQuery *);
+void fa_free(FindAll *);
+int fa_step(FindAll *, uint64 nbytes);
+int fa_done(FindAll *);
+int fa_stale(FindAll *);
+int fa_truncated(FindAll *);
+uint64 fa_progress(FindAll *);
+uint64 fa_count(FindAll *);
+int fa_next(FindAll *, uint64 addr, uint64 *pos);
+int fa_prev(FindAll *, uint64 addr, uint64 *pos);
@@ -9,6 +9,11 @@
 #include <commctrl.h>
 
 #include "buffer.h"
+#include "search.h"
+#include "threads.h"
+#include "regex.h"
+#include "value.h"
+#include "findall.h"
 #include "tree.h"
 #include "unicode.h"
 #include "resource.h"
@@ -24,6 +29,18 @@
 
 #define BUFSIZE 512
 
+/* summarizes the file while idle */
+#define SUMMARY_TIMER 1
+#define SUMMARY_INTERVAL 10
+
+/* finds all matches of the last pattern in the background */
+#define FIND_TIMER 2
+#define FIND_INTERVAL 10
+#define FIND_STEP (4<<20) // bytes per search thread and step
+#define FIND_BUDGET 50 // milliseconds of searching per tick
+#define FIND_PART 3 // of the status bar, for find all progress
+#define VALUE_WINDOW (1<<20) // bytes a backward value search starts with
+
 /****************************************************************************
  * Type definitions                                                         *
  ****************************************************************************/
@@ -34,17 +51,26 @@ enum {
     ID_FILE_OPEN,
     ID_FILE_SAVE,
     ID_FILE_SAVEAS,
+    ID_FILE_RELOAD,
     ID_FILE_CLOSE,
     ID_FILE_EXIT,
+    ID_EDIT_UNDO,
+    ID_EDIT_REDO,
     ID_EDIT_INSERT,
     ID_EDIT_DELETE,
+    ID_EDIT_REPLACE_ALL,
     ID_NAV_GOTO,
     ID_NAV_SEARCH,
     ID_NAV_SEARCH_BACKWARDS,
     ID_NAV_HEX_SEARCH,
     ID_NAV_HEX_SEARCH_BACKWARDS,
+    ID_NAV_REGEX_SEARCH,
+    ID_NAV_REGEX_SEARCH_BACKWARDS,
     ID_NAV_NEXT_MATCH,
     ID_NAV_PREV_MATCH,
+    ID_NAV_FIND_ALL,
+    ID_NAV_CANCEL_FIND_ALL,
+    ID_NAV_FIND_VALUES,
     ID_TOOLS_LOAD_PLUGIN,
     ID_TOOLS_RUN_LUA_SCRIPT,
     ID_PLUGIN_0,
@@ -110,8 +136,15 @@ typedef struct {
     bool plugin_name_changed;
     bool cursor_pos_changed;
     bool buffer_changed;
+    /* part of buffer to be redrawn, if buffer_changed is not set */
+    uint64 changed_start;
+    uint64 changed_end;
     char *last_pat;
+    char *last_mask; // 0 unless the last hex pattern had wildcards
     int last_pat_len;
+    Regex *last_re; // used by next/prev match when set
+    ValueQuery *last_query; // values next/prev match go through, or 0
+    FindAll *find_all; // matches of last_pat, or of last_query
 } UI;
 
 /****************************************************************************
@@ -129,7 +162,7 @@ int program_dir_len;
 LRESULT CALLBACK med_wndproc(HWND, UINT, WPARAM, LPARAM);
 LRESULT CALLBACK wndproc(HWND, UINT, WPARAM, LPARAM);
 static ATOM register_wndclass(void);
-static int start_gui(int, UI *, TCHAR *);
+static int start_gui(int, UI *, TCHAR *, DWORD);
 static void update_window_title(UI *ui);
 void update_status_text(UI *, Tree *);
 void update_field_info(UI *);
@@ -143,8 +176,10 @@ void handle_char_replace(UI *, TCHAR);
 void init_font(UI *);
 void handle_WM_CREATE(UI *, LPCREATESTRUCT);
 int open_file(UI *, TCHAR *);
+int open_process(UI *, DWORD);
 void close_file(UI *);
 void update_ui(UI *);
+void on_buffer_change(void *, uint64, uint64, uint64);
 void add_overlay(UI *);
 void move_forward(UI *);
 void move_backward(UI *);
@@ -164,8 +199,44 @@ int api_buffer_peeku64(lua_State *L);
 int api_buffer_read(lua_State *L);
 int api_buffer_tree(lua_State *L);
 int api_buffer_size(lua_State *L);
+int api_buffer_set_io_depth(lua_State *L);
+int api_set_search_threads(lua_State *L);
+int api_buffer_set_block_size(lua_State *L);
+int api_buffer_invalidate(lua_State *L);
 int api_buffer_replace(lua_State *L);
 int api_buffer_insert(lua_State *L);
+int api_buffer_clone(lua_State *L);
+int api_buffer_gc(lua_State *L);
+int api_buffer_undo(lua_State *L);
+int api_buffer_redo(lua_State *L);
+int api_buffer_set_undo_limit(lua_State *L);
+int api_buffer_memory(lua_State *L);
+int api_buffer_set_memory_limit(lua_State *L);
+int api_buffer_dirty_ranges(lua_State *L);
+int api_buffer_summary(lua_State *L);
+int api_buffer_tree_hash(lua_State *L);
+int api_buffer_hash(lua_State *L);
+int api_buffer_histogram(lua_State *L);
+int api_buffer_entropy_profile(lua_State *L);
+int api_buffer_find_patterns(lua_State *L);
+int api_buffer_find_regex(lua_State *L);
+int api_buffer_find_regex_backward(lua_State *L);
+int api_buffer_find_all(lua_State *L);
+int api_buffer_replace_all(lua_State *L);
+int api_buffer_find_approx(lua_State *L);
+int api_buffer_find_values(lua_State *L);
+int api_profile_count(lua_State *L);
+int api_profile_get(lua_State *L);
+int api_profile_values(lua_State *L);
+int api_profile_gc(lua_State *L);
+int api_buffer_on_change(lua_State *L);
+int api_buffer_batch(lua_State *L);
+int api_batch_replace(lua_State *L);
+int api_batch_insert(lua_State *L);
+int api_batch_delete(lua_State *L);
+void notify_lua_listeners(void *L, uint64 addr, uint64 removed,
+                          uint64 inserted);
+void clear_lua_listeners(lua_State *L);
 void getluaobj(lua_State *L, const char *name);
 void luaerrorbox(HWND hwnd, lua_State *L);
 // runs script in a separate environment
@@ -244,14 +315,20 @@ create_menu(void)
     AppendMenu(m, MF_STRING, ID_FILE_OPEN, TEXT("Open...\tCtrl+O"));
     AppendMenu(m, MF_STRING, ID_FILE_SAVE, TEXT("Save"));
     AppendMenu(m, MF_STRING, ID_FILE_SAVEAS, TEXT("Save As..."));
+    AppendMenu(m, MF_STRING, ID_FILE_RELOAD, TEXT("Reload\tF5"));
     AppendMenu(m, MF_STRING, ID_FILE_CLOSE, TEXT("Close"));
     AppendMenu(m, MF_SEPARATOR, 0, 0);
     AppendMenu(m, MF_STRING, ID_FILE_EXIT, TEXT("Exit"));
     AppendMenu(mainmenu, MF_POPUP, (UINT_PTR) m, TEXT("File"));
 
     m = CreateMenu();
+    AppendMenu(m, MF_STRING, ID_EDIT_UNDO, TEXT("Undo\tCtrl+Z"));
+    AppendMenu(m, MF_STRING, ID_EDIT_REDO, TEXT("Redo\tCtrl+Y"));
+    AppendMenu(m, MF_SEPARATOR, 0, 0);
     AppendMenu(m, MF_STRING, ID_FILE_OPEN, TEXT("Insert...\tCtrl+I"));
     AppendMenu(m, MF_STRING, ID_FILE_OPEN, TEXT("Delete...\tCtrl+D"));
+    AppendMenu(m, MF_STRING, ID_EDIT_REPLACE_ALL,
+               TEXT("Replace all matches..."));
     AppendMenu(mainmenu, MF_POPUP, (UINT_PTR) m, TEXT("Edit"));
 
     m = CreateMenu();
@@ -264,10 +341,20 @@ create_menu(void)
                TEXT("Hex search...\tCtrl+H"));
     AppendMenu(m, MF_STRING, ID_NAV_HEX_SEARCH_BACKWARDS,
                TEXT("Backwards hex search..."));
+    AppendMenu(m, MF_STRING, ID_NAV_REGEX_SEARCH,
+               TEXT("Regex search...\tCtrl+R"));
+    AppendMenu(m, MF_STRING, ID_NAV_REGEX_SEARCH_BACKWARDS,
+               TEXT("Backwards regex search..."));
     AppendMenu(m, MF_STRING, ID_NAV_NEXT_MATCH,
                TEXT("Go to next match\tF3"));
     AppendMenu(m, MF_STRING, ID_NAV_PREV_MATCH,
-               TEXT("Go to previous match"));
+               TEXT("Go to previous match\tShift+F3"));
+    AppendMenu(m, MF_STRING, ID_NAV_FIND_ALL,
+               TEXT("Find all matches\tCtrl+F3"));
+    AppendMenu(m, MF_STRING, ID_NAV_FIND_VALUES,
+               TEXT("Find all values...\tCtrl+U"));
+    AppendMenu(m, MF_STRING, ID_NAV_CANCEL_FIND_ALL,
+               TEXT("Cancel find all"));
     AppendMenu(mainmenu, MF_POPUP, (UINT_PTR) m, TEXT("Navigate"));
 
     m = CreateMenu();
@@ -283,18 +370,25 @@ create_menu(void)
     return mainmenu;
 }
 
-/* filepath is owned */
+/* filepath is owned; a nonzero pid opens that process instead */
 static int
-start_gui(int show, UI *ui, TCHAR *filepath)
+start_gui(int show, UI *ui, TCHAR *filepath, DWORD pid)
 {
     static ACCEL accel_table[] = {
         { FCONTROL | FVIRTKEY, 'O', ID_FILE_OPEN },
+        { FCONTROL | FVIRTKEY, 'Z', ID_EDIT_UNDO },
+        { FCONTROL | FVIRTKEY, 'Y', ID_EDIT_REDO },
         { FCONTROL | FVIRTKEY, 'I', ID_EDIT_INSERT },
         { FCONTROL | FVIRTKEY, 'D', ID_EDIT_DELETE },
         { FCONTROL | FVIRTKEY, 'G', ID_NAV_GOTO },
         { FCONTROL | FVIRTKEY, 'F', ID_NAV_SEARCH },
         { FCONTROL | FVIRTKEY, 'H', ID_NAV_HEX_SEARCH },
+        { FCONTROL | FVIRTKEY, 'R', ID_NAV_REGEX_SEARCH },
         { FVIRTKEY, VK_F3, ID_NAV_NEXT_MATCH },
+        { FSHIFT | FVIRTKEY, VK_F3, ID_NAV_PREV_MATCH },
+        { FCONTROL | FVIRTKEY, VK_F3, ID_NAV_FIND_ALL },
+        { FCONTROL | FVIRTKEY, 'U', ID_NAV_FIND_VALUES },
+        { FVIRTKEY, VK_F5, ID_FILE_RELOAD },
     };
 
     HMENU menu;
@@ -307,7 +401,9 @@ start_gui(int show, UI *ui, TCHAR *filepath)
     ATOM mainwndclass = register_wndclass();
     if (!mainwndclass) return 1;
     HACCEL accel = CreateAcceleratorTable(accel_table, NELEM(accel_table));
-    if (filepath) {
+    if (pid) {
+        if (open_process(ui, pid)) return 0;
+    } else if (filepath) {
         int status = open_file(ui, filepath);
         free(filepath);
         if (status) return 0;
@@ -399,6 +495,7 @@ WinMain(HINSTANCE instance, HINSTANCE _prev_instance, LPSTR _cmdline, int show)
     TCHAR *filepath;
     void *top;
     int i;
+    DWORD pid = 0;
     lua_State *L;
     Buffer *b;
     UI *ui;
@@ -425,6 +522,13 @@ WinMain(HINSTANCE instance, HINSTANCE _prev_instance, LPSTR _cmdline, int show)
                 AllocConsole();
                 freopen("CON", "w", stdout);
                 break;
+            case 'p':
+                /* -p PID: edit the memory of a running process */
+                if (i+1 < argc) {
+                    uint64 n;
+                    if (!parse_uint(argv[++i], &n)) pid = (DWORD) n;
+                }
+                break;
             }
             i++;
         } else break;
@@ -433,7 +537,9 @@ WinMain(HINSTANCE instance, HINSTANCE _prev_instance, LPSTR _cmdline, int show)
     argv += i;
 
     /* parse command line arguments */
-    if (argc == 0) {
+    if (pid) {
+        filepath = 0;
+    } else if (argc == 0) {
         if (open_file_chooser_dialog(0, openfilename, BUFSIZE)) {
             filepath = 0;
         } else {
@@ -483,12 +589,86 @@ WinMain(HINSTANCE instance, HINSTANCE _prev_instance, LPSTR _cmdline, int show)
     lua_setfield(L, -2, "tree");
     lua_pushcfunction(L, api_buffer_size);
     lua_setfield(L, -2, "size");
+    lua_pushcfunction(L, api_buffer_set_io_depth);
+    lua_setfield(L, -2, "set_io_depth");
+    lua_pushcfunction(L, api_buffer_set_block_size);
+    lua_setfield(L, -2, "set_block_size");
+    lua_pushcfunction(L, api_buffer_invalidate);
+    lua_setfield(L, -2, "invalidate");
     lua_pushcfunction(L, api_buffer_replace);
     lua_setfield(L, -2, "replace");
     lua_pushcfunction(L, api_buffer_insert);
     lua_setfield(L, -2, "insert");
+    lua_pushcfunction(L, api_buffer_clone);
+    lua_setfield(L, -2, "clone");
+    lua_pushcfunction(L, api_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, api_buffer_undo);
+    lua_setfield(L, -2, "undo");
+    lua_pushcfunction(L, api_buffer_redo);
+    lua_setfield(L, -2, "redo");
+    lua_pushcfunction(L, api_buffer_set_undo_limit);
+    lua_setfield(L, -2, "set_undo_limit");
+    lua_pushcfunction(L, api_buffer_memory);
+    lua_setfield(L, -2, "memory");
+    lua_pushcfunction(L, api_buffer_set_memory_limit);
+    lua_setfield(L, -2, "set_memory_limit");
+    lua_pushcfunction(L, api_buffer_dirty_ranges);
+    lua_setfield(L, -2, "dirty_ranges");
+    lua_pushcfunction(L, api_buffer_summary);
+    lua_setfield(L, -2, "summary");
+    lua_pushcfunction(L, api_buffer_tree_hash);
+    lua_setfield(L, -2, "tree_hash");
+    lua_pushcfunction(L, api_buffer_hash);
+    lua_setfield(L, -2, "hash");
+    lua_pushcfunction(L, api_buffer_histogram);
+    lua_setfield(L, -2, "histogram");
+    lua_pushcfunction(L, api_buffer_entropy_profile);
+    lua_setfield(L, -2, "entropy_profile");
+    lua_pushcfunction(L, api_buffer_find_patterns);
+    lua_setfield(L, -2, "find_patterns");
+    lua_pushcfunction(L, api_buffer_find_regex);
+    lua_setfield(L, -2, "find_regex");
+    lua_pushcfunction(L, api_buffer_find_regex_backward);
+    lua_setfield(L, -2, "find_regex_backward");
+    lua_pushcfunction(L, api_buffer_find_all);
+    lua_setfield(L, -2, "find_all");
+    lua_pushcfunction(L, api_buffer_replace_all);
+    lua_setfield(L, -2, "replace_all");
+    lua_pushcfunction(L, api_buffer_find_approx);
+    lua_setfield(L, -2, "find_approx");
+    lua_pushcfunction(L, api_buffer_find_values);
+    lua_setfield(L, -2, "find_values");
+    lua_pushcfunction(L, api_buffer_on_change);
+    lua_setfield(L, -2, "on_change");
+    lua_pushcfunction(L, api_buffer_batch);
+    lua_setfield(L, -2, "batch");
     lua_pop(L, 1); /* 'buffer' */
 
+    luaL_newmetatable(L, "batch");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, api_batch_replace);
+    lua_setfield(L, -2, "replace");
+    lua_pushcfunction(L, api_batch_insert);
+    lua_setfield(L, -2, "insert");
+    lua_pushcfunction(L, api_batch_delete);
+    lua_setfield(L, -2, "delete");
+    lua_pop(L, 1); /* 'batch' */
+
+    luaL_newmetatable(L, "entropy_profile");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, api_profile_count);
+    lua_setfield(L, -2, "count");
+    lua_pushcfunction(L, api_profile_get);
+    lua_setfield(L, -2, "get");
+    lua_pushcfunction(L, api_profile_values);
+    lua_setfield(L, -2, "values");
+    lua_pushcfunction(L, api_profile_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1); /* 'entropy_profile' */
+
     lua_newtable(L); /* global 'whex' */
     b = lua_newuserdata(L, sizeof_Buffer);
     memset(b, 0, sizeof_Buffer);
@@ -498,6 +678,8 @@ WinMain(HINSTANCE instance, HINSTANCE _prev_instance, LPSTR _cmdline, int show)
     lua_setfield(L, -2, "plugin");
     lua_newtable(L);
     lua_setfield(L, -2, "customtype");
+    lua_pushcfunction(L, api_set_search_threads);
+    lua_setfield(L, -2, "set_search_threads");
 
     {
         TCHAR *ftdet_path = T(asprintf)(TEXT("%s/ftdet.lua"), program_dir);
@@ -531,7 +713,7 @@ WinMain(HINSTANCE instance, HINSTANCE _prev_instance, LPSTR _cmdline, int show)
     //ui->replace_buf_cap = 16;
     //ui->replace_buf = xmalloc(ui->replace_buf_cap);
 
-    return start_gui(show, ui, filepath);
+    return start_gui(show, ui, filepath, pid);
 }
 
 void
@@ -561,12 +743,12 @@ update_status_text(UI *ui, Tree *leaf)
 #endif
         SendMessage(sb, SB_SETTEXT, 1, (LPARAM) typename);
         SendMessage(sb, SB_SETTEXT, 2, (LPARAM) valuerepr);
-        SendMessage(sb, SB_SETTEXT, 3, (LPARAM) T_path);
+        SendMessage(sb, SB_SETTEXT, 4, (LPARAM) T_path);
         rfree(&the_region, top);
     } else {
         SendMessage(sb, SB_SETTEXT, 1, 0);
         SendMessage(sb, SB_SETTEXT, 2, 0);
-        SendMessage(sb, SB_SETTEXT, 3, 0);
+        SendMessage(sb, SB_SETTEXT, 4, 0);
     }
 }
 
@@ -600,6 +782,7 @@ update_field_info(UI *ui)
         SendMessage(statusbar, SB_SETTEXT, 1, 0);
         SendMessage(statusbar, SB_SETTEXT, 2, 0);
         SendMessage(statusbar, SB_SETTEXT, 3, 0);
+        SendMessage(statusbar, SB_SETTEXT, 4, 0);
     }
 }
 
@@ -729,31 +912,274 @@ parse_hex_string(TCHAR *s, int *len)
     }
 }
 
-/* pat is malloc'd; if pattern not found, shows message box */
+/* Like parse_hex_string, but a nibble may be ? to match any value.
+   *mask gets the bits that have to match, or 0 if that is all of them. */
+char *
+parse_hex_pattern(TCHAR *s, int *len, char **mask)
+{
+    int n = lstrlen(s);
+    char *pat = xmalloc(n);
+    char *m = xmalloc(n);
+    bool wild = false;
+    int p = 0;
+    for (;;) {
+        int b = 0, k = 0;
+        while (*s == ' ') s++;
+        if (!*s) break;
+        for (int i=0; i<2; i++) {
+            int v = s[i] == '?' ? 0 : read_nibble(s[i]);
+            if (v < 0) {
+                free(pat);
+                free(m);
+                return 0;
+            }
+            b = b<<4 | v;
+            k = k<<4 | (s[i] == '?' ? 0 : 15);
+        }
+        if (k != 0xff) wild = true;
+        s += 2;
+        pat[p] = b;
+        m[p++] = k;
+    }
+    if (!wild) {
+        free(m);
+        m = 0;
+    }
+    *len = p;
+    *mask = m;
+    return pat;
+}
+
+/* Parses "type low [high [align]]", as in "u32 0x1000" or
+   "f32be 0.9 1.1"; see value_parse_type. */
+int
+parse_value_query(char *s, ValueQuery *q)
+{
+    char *tok[4];
+    int n = 0;
+
+    for (char *t = strtok(s, " "); t; t = strtok(0, " ")) {
+        if (n == 4) return -1;
+        tok[n++] = t;
+    }
+    if (n < 2 || value_parse_type(q, tok[0]) ||
+        value_parse(q, tok[1], &q->lo) ||
+        value_parse(q, tok[n > 2 ? 2 : 1], &q->hi))
+    {
+        return -1;
+    }
+    if (n == 4) {
+        char *end;
+        long align = strtol(tok[3], &end, 0);
+        if (*end || align < 1 || align > 1 << 30) return -1;
+        q->align = (int) align;
+    }
+    return 0;
+}
+
 void
-search(UI *ui, char *pat, int patlen, int offset)
+stop_find_all(UI *ui)
+{
+    if (ui->find_all) {
+        KillTimer(ui->hwnd, FIND_TIMER);
+        fa_free(ui->find_all);
+        ui->find_all = 0;
+        SendMessage(ui->status_bar, SB_SETTEXT, FIND_PART, 0);
+    }
+}
+
+/* called by FIND_TIMER; shows progress and the count of matches in the
+   status bar */
+void
+step_find_all(UI *ui)
+{
+    FindAll *fa = ui->find_all;
+    DWORD t0 = GetTickCount();
+    TCHAR buf[64];
+    int ret;
+
+    /* big enough that every thread gets a chunk worth starting it for */
+    do ret = fa_step(fa, (uint64) FIND_STEP * thread_count());
+    while (ret > 0 && GetTickCount() - t0 < FIND_BUDGET);
+    if (ret < 0) {
+        stop_find_all(ui);
+        errorbox(ui->hwnd, TEXT("Read error"));
+        return;
+    }
+    if (fa_stale(fa)) {
+        stop_find_all(ui);
+        return;
+    }
+    if (ret) {
+        uint64 size = buf_size(ui->buffer);
+        T(_sprintf)(buf, TEXT("Finding all matches: %d%%"),
+                    (int)(fa_progress(fa) * 100 / size));
+    } else {
+        KillTimer(ui->hwnd, FIND_TIMER);
+        T(_sprintf)(buf, fa_truncated(fa) ? TEXT("%llu+ matches")
+                                          : TEXT("%llu matches"),
+                    fa_count(fa));
+    }
+    SendMessage(ui->status_bar, SB_SETTEXT, FIND_PART, (LPARAM) buf);
+}
+
+/* Goes to the next or previous match with the index of find all, once
+   it is complete. Returns nonzero if there is none to use. An index the
+   buffer has changed under is dropped. */
+int
+indexed_search(UI *ui, int backward)
+{
+    FindAll *fa = ui->find_all;
+    uint64 cur = ui->abs_cursor_pos;
+    uint64 pos;
+    int ret;
+
+    if (fa && fa_stale(fa)) {
+        stop_find_all(ui);
+        return -1;
+    }
+    if (!fa || !fa_done(fa) || fa_truncated(fa)) return -1;
+    if (!backward) {
+        ret = fa_next(fa, cur+1, &pos);
+    } else {
+        ret = cur ? fa_prev(fa, cur-1, &pos) : 1;
+    }
+    if (ret == 0) {
+        goto_address(ui, pos);
+    } else {
+        msgboxf(ui->hwnd, ui->last_query ? TEXT("No value found")
+                                         : TEXT("Pattern not found"));
+    }
+    return 0;
+}
+
+static int
+found_value(void *arg, int pattern, uint64 addr)
+{
+    *(uint64 *) arg = addr;
+    return 1;
+}
+
+static int
+last_value(void *arg, int pattern, uint64 addr)
+{
+    *(uint64 *) arg = addr;
+    return 0;
+}
+
+/* Goes to the next value of last_query after the cursor, or the last one
+   starting before it if backward, without the index of find all. Values
+   cannot be searched for backward, so backward scans windows before the
+   cursor, doubling in size until one has a value. */
+void
+value_search(UI *ui, int backward)
+{
+    ValueQuery *q = ui->last_query;
+    uint64 cur = ui->abs_cursor_pos, size = buf_size(ui->buffer);
+    uint64 pos = (uint64) -1;
+    int ret;
+
+    if (!backward) {
+        ret = buf_search_values(ui->buffer, q, cur+1, size, found_value,
+                                &pos);
+    } else {
+        /* the values starting before the cursor end before this */
+        uint64 end = min(cur + q->width - 1, size);
+        for (uint64 w = VALUE_WINDOW;; w *= 2) {
+            ret = buf_search_values(ui->buffer, q, cur > w ? cur - w : 0,
+                                    end, last_value, &pos);
+            if (ret || pos != (uint64) -1 || cur <= w) break;
+        }
+    }
+    if (ret < 0) {
+        errorbox(ui->hwnd, TEXT("Read error"));
+    } else if (pos != (uint64) -1) {
+        goto_address(ui, pos);
+    } else {
+        msgboxf(ui->hwnd, TEXT("No value found"));
+    }
+}
+
+/* pat and mask are malloc'd; mask may be 0, see parse_hex_pattern. If
+   pattern not found, shows message box. Searches from offset bytes after
+   the cursor, or before it if backward. */
+void
+search(UI *ui, char *pat, char *mask, int patlen, int offset, int backward)
 {
     if (patlen > 0) {
-        uint64 start = ui->abs_cursor_pos + offset;
+        uint64 start = ui->abs_cursor_pos;
         uint64 bufsize, pos;
         int ret;
-        if (start > (bufsize = buf_size(ui->buffer))) {
-            start = bufsize;
+        if (!backward) {
+            start += offset;
+            if (start > (bufsize = buf_size(ui->buffer))) {
+                start = bufsize;
+            }
+            ret = buf_search_masked(ui->buffer, (uchar*)pat, (uchar*)mask,
+                                    patlen, start, &pos);
+        } else if (start < (uint64) offset) {
+            ret = 1; /* nothing before the start of the buffer */
+        } else {
+            ret = buf_search_masked_backward(ui->buffer, (uchar*)pat,
+                                             (uchar*)mask, patlen,
+                                             start - offset, &pos);
         }
-        ret = buf_kmp_search(ui->buffer, (uchar*)pat, patlen, start, &pos);
         if (pat != ui->last_pat) {
             free(ui->last_pat);
+            free(ui->last_mask);
+            stop_find_all(ui);
             ui->last_pat = pat;
+            ui->last_mask = mask;
             ui->last_pat_len = patlen;
+            re_free(ui->last_re);
+            ui->last_re = 0;
+            free(ui->last_query);
+            ui->last_query = 0;
         }
         if (ret == 0) {
             goto_address(ui, pos);
+        } else if (ret < 0) {
+            errorbox(ui->hwnd, TEXT("Read error"));
         } else {
             msgboxf(ui->hwnd, TEXT("Pattern not found"));
         }
     }
 }
 
+/* re is owned. Searches from offset bytes after the cursor, or for the
+   last match ending at or before the cursor if backward. */
+void
+regex_search(UI *ui, Regex *re, int offset, int backward)
+{
+    uint64 start = ui->abs_cursor_pos;
+    uint64 bufsize, mstart, mend;
+    int ret;
+
+    if (!backward) {
+        start += offset;
+        if (start > (bufsize = buf_size(ui->buffer))) {
+            start = bufsize;
+        }
+        ret = buf_re_search(ui->buffer, re, start, &mstart, &mend);
+    } else {
+        ret = buf_re_search_backward(ui->buffer, re, start, &mstart, &mend);
+    }
+    if (re != ui->last_re) {
+        re_free(ui->last_re);
+        stop_find_all(ui);
+        ui->last_re = re;
+        free(ui->last_query);
+        ui->last_query = 0;
+    }
+    if (ret == 0) {
+        goto_address(ui, mstart);
+    } else if (ret < 0) {
+        errorbox(ui->hwnd, TEXT("Read error"));
+    } else {
+        msgboxf(ui->hwnd, TEXT("Pattern not found"));
+    }
+}
+
 void
 handle_WM_CHAR(UI *ui, TCHAR c)
 {
@@ -793,7 +1219,7 @@ handle_WM_CHAR(UI *ui, TCHAR c)
             pat = text;
 #endif
             patlen = strlen(pat);
-            search(ui, pat, patlen, 0);
+            search(ui, pat, 0, patlen, 0, 0);
         }
         SetFocus(ui->monoedit);
         break;
@@ -801,10 +1227,11 @@ handle_WM_CHAR(UI *ui, TCHAR c)
         text = inputbox(ui, TEXT("Hex Search"));
         if (text) {
             int patlen;
-            char *pat = parse_hex_string(text, &patlen);
+            char *mask;
+            char *pat = parse_hex_pattern(text, &patlen, &mask);
             free(text);
             if (pat) {
-                search(ui, pat, patlen, 0);
+                search(ui, pat, mask, patlen, 0, 0);
             } else {
                 errorbox(ui->hwnd, TEXT("Syntax error"));
             }
@@ -844,7 +1271,7 @@ handle_WM_CHAR(UI *ui, TCHAR c)
         move_right(ui);
         break;
     case 'n':
-        search(ui, ui->last_pat, ui->last_pat_len, 1);
+        search(ui, ui->last_pat, ui->last_mask, ui->last_pat_len, 1, 0);
         break;
     case 'w':
         move_next_field(ui);
@@ -1027,7 +1454,6 @@ handle_char_replace(UI *ui, TCHAR c)
     }
 
     buf_replace(b, pos, &val, 1);
-    ui->buffer_changed = true;
 }
 
 void
@@ -1072,6 +1498,9 @@ med_getline(uint64 ln, T(Buf) *p, void *arg, MedTagList *taglist)
     uint64 bufsize = buf_size(b);
     uint64 start = ln << LOG2_N_COL;
     int end, i;
+    BufRange dirty[N_COL/2];
+    int ndirty = 0;
+    MedTextAttr attr;
 
     if (start < ln) {
         // overflow
@@ -1093,6 +1522,7 @@ med_getline(uint64 ln, T(Buf) *p, void *arg, MedTagList *taglist)
     }
     if (end) {
         buf_read(b, data, start, end);
+        ndirty = buf_dirty_ranges(b, start, start+end, dirty, NELEM(dirty));
     }
     for (i=end; i<N_COL; i++) data[i] = 0;
     for (i=0; i<N_COL; i++) {
@@ -1104,24 +1534,37 @@ med_getline(uint64 ln, T(Buf) *p, void *arg, MedTagList *taglist)
         p->putc(p, (TCHAR)get_display_char(c));
     }
 
+    /* tags must be added from left to right */
+    attr.flags = MED_ATTR_TEXT_COLOR;
+    attr.text_color = RGB(204, 0, 0);
+    for (i=0; i<ndirty; i++) {
+        int x0 = (int)(dirty[i].start - start);
+        int x1 = (int)(dirty[i].end - start);
+        med_add_tag(taglist, header_len + 1 + x0 * 3, (x1 - x0) * 3 - 1,
+                    &attr);
+    }
     if (end < N_COL) {
-        int start, len;
-        MedTextAttr attr;
-        attr.flags = MED_ATTR_TEXT_COLOR;
         attr.text_color = RGB(192, 192, 192);
-        start = header_len + 1 + end * 3;
-        len = (N_COL - end) * 3 - 1;
-        med_add_tag(taglist, start, len, &attr);
-        start = header_len + 2 + N_COL*3 + end;
-        len = N_COL - end;
-        med_add_tag(taglist, start, len, &attr);
+        med_add_tag(taglist, header_len + 1 + end * 3,
+                    (N_COL - end) * 3 - 1, &attr);
+    }
+    attr.text_color = RGB(204, 0, 0);
+    for (i=0; i<ndirty; i++) {
+        int x0 = (int)(dirty[i].start - start);
+        int x1 = (int)(dirty[i].end - start);
+        med_add_tag(taglist, header_len + 2 + N_COL*3 + x0, x1 - x0, &attr);
+    }
+    if (end < N_COL) {
+        attr.text_color = RGB(192, 192, 192);
+        med_add_tag(taglist, header_len + 2 + N_COL*3 + end, N_COL - end,
+                    &attr);
     }
 }
 
 void
 handle_WM_CREATE(UI *ui, LPCREATESTRUCT create)
 {
-    static int sbparts[] = { 64, 128, 320, -1 };
+    static int sbparts[] = { 64, 128, 320, 512, -1 };
 
     HWND hwnd = ui->hwnd;
     HWND monoedit;
@@ -1185,7 +1628,7 @@ handle_WM_CREATE(UI *ui, LPCREATESTRUCT create)
          NULL,
          hwnd,
          ID_STATUS_BAR);
-    SendMessage(status_bar, SB_SETPARTS, 4, (LPARAM) sbparts);
+    SendMessage(status_bar, SB_SETPARTS, 5, (LPARAM) sbparts);
     ui->status_bar = status_bar;
 
     /* get height of status bar */
@@ -1272,6 +1715,18 @@ wndproc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
     case WM_CHAR:
         handle_WM_CHAR(ui, (TCHAR) wparam);
         return 0;
+    case WM_TIMER:
+        if (wparam == SUMMARY_TIMER) {
+            if (!ui->filepath || !buf_summarize(ui->buffer, 16)) {
+                KillTimer(hwnd, SUMMARY_TIMER);
+            }
+            return 0;
+        }
+        if (wparam == FIND_TIMER) {
+            if (ui->find_all) step_find_all(ui);
+            return 0;
+        }
+        break;
     case WM_COMMAND:
         id = LOWORD(wparam);
         {
@@ -1310,6 +1765,7 @@ wndproc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
             if (buf_save_in_place(ui->buffer)) {
                 errorbox(hwnd, TEXT("Could not save file"));
             }
+            SetTimer(hwnd, SUMMARY_TIMER, SUMMARY_INTERVAL, 0);
             break;
         case ID_FILE_SAVEAS:
 save_as:
@@ -1318,12 +1774,26 @@ save_as:
                 errorbox(hwnd, TEXT("Could not save file"));
             }
             break;
+        case ID_FILE_RELOAD:
+            /* the file or process may have changed underneath us */
+            buf_invalidate(ui->buffer, 0, buf_size(ui->buffer));
+            SetTimer(hwnd, SUMMARY_TIMER, SUMMARY_INTERVAL, 0);
+            break;
         case ID_FILE_CLOSE:
             close_file(ui);
             break;
         case ID_FILE_EXIT:
             SendMessage(hwnd, WM_SYSCOMMAND, SC_CLOSE, 0);
             break;
+        case ID_EDIT_UNDO:
+        case ID_EDIT_REDO:
+            {
+                uint64 addr;
+                int ret = id == ID_EDIT_UNDO ? buf_undo(ui->buffer, &addr)
+                                             : buf_redo(ui->buffer, &addr);
+                if (!ret) goto_address(ui, addr);
+            }
+            break;
         case ID_EDIT_INSERT:
             {
                 TCHAR *text = inputbox(ui, TEXT("Insert this many bytes"));
@@ -1336,7 +1806,6 @@ save_as:
                         uint64 bufsize = buf_size(ui->buffer);
                         if (pos > bufsize) pos = bufsize;
                         buf_insert(ui->buffer, pos, 0, n);
-                        ui->buffer_changed = true;
                     }
                     free(text);
                 }
@@ -1358,13 +1827,41 @@ save_as:
                             n = bufsize - pos;
                         }
                         buf_delete(ui->buffer, pos, n);
-                        ui->buffer_changed = true;
                     }
                     free(text);
                 }
                 SetFocus(ui->monoedit);
             }
             break;
+        case ID_EDIT_REPLACE_ALL:
+            if (ui->last_re) {
+                errorbox(hwnd, TEXT("Cannot replace regex matches"));
+            } else if (ui->last_pat_len > 0) {
+                TCHAR *text = inputbox(ui, TEXT("Replace with hex"));
+                if (text) {
+                    int replen;
+                    char *rep = parse_hex_string(text, &replen);
+                    uint64 count;
+                    free(text);
+                    if (!rep) {
+                        errorbox(hwnd, TEXT("Syntax error"));
+                    } else if (buf_replace_all(ui->buffer,
+                                               (uchar*)ui->last_pat,
+                                               (uchar*)ui->last_mask,
+                                               ui->last_pat_len,
+                                               (uchar*)rep, replen, 0,
+                                               buf_size(ui->buffer),
+                                               &count))
+                    {
+                        errorbox(hwnd, TEXT("Replace failed"));
+                    } else {
+                        msgboxf(hwnd, TEXT("%llu matches replaced"), count);
+                    }
+                    free(rep);
+                }
+                SetFocus(ui->monoedit);
+            }
+            break;
         case ID_NAV_GOTO:
             {
                 TCHAR *text = inputbox(ui, TEXT("Go to address"));
@@ -1385,6 +1882,7 @@ save_as:
             }
             break;
         case ID_NAV_SEARCH:
+        case ID_NAV_SEARCH_BACKWARDS:
             {
                 TCHAR *text = inputbox(ui, TEXT("Text Search"));
                 if (text) {
@@ -1397,20 +1895,24 @@ save_as:
                     pat = text;
 #endif
                     patlen = strlen(pat);
-                    search(ui, pat, patlen, 0);
+                    search(ui, pat, 0, patlen, 0,
+                           id == ID_NAV_SEARCH_BACKWARDS);
                 }
                 SetFocus(ui->monoedit);
             }
             break;
         case ID_NAV_HEX_SEARCH:
+        case ID_NAV_HEX_SEARCH_BACKWARDS:
             {
                 TCHAR *text = inputbox(ui, TEXT("Hex Search"));
                 if (text) {
                     int patlen;
-                    char *pat = parse_hex_string(text, &patlen);
+                    char *mask;
+                    char *pat = parse_hex_pattern(text, &patlen, &mask);
                     free(text);
                     if (pat) {
-                        search(ui, pat, patlen, 0);
+                        search(ui, pat, mask, patlen, 0,
+                               id == ID_NAV_HEX_SEARCH_BACKWARDS);
                     } else {
                         errorbox(ui->hwnd, TEXT("Syntax error"));
                     }
@@ -1418,8 +1920,101 @@ save_as:
                 SetFocus(ui->monoedit);
             }
             break;
+        case ID_NAV_REGEX_SEARCH:
+        case ID_NAV_REGEX_SEARCH_BACKWARDS:
+            {
+                TCHAR *text = inputbox(ui, TEXT("Regex Search"));
+                if (text) {
+                    char *pat;
+                    const char *err;
+                    Regex *re;
+#ifdef UNICODE
+                    pat = utf16_to_mbcs(text);
+                    free(text);
+#else
+                    pat = text;
+#endif
+                    re = re_compile((uchar*)pat, strlen(pat), &err);
+                    free(pat);
+                    if (re) {
+                        regex_search(ui, re, 0,
+                                     id == ID_NAV_REGEX_SEARCH_BACKWARDS);
+                    } else {
+                        TCHAR *msg = UTF8_TO_TSTR(err);
+                        errorbox(ui->hwnd, msg);
+                        free(msg);
+                    }
+                }
+                SetFocus(ui->monoedit);
+            }
+            break;
         case ID_NAV_NEXT_MATCH:
-            search(ui, ui->last_pat, ui->last_pat_len, 1);
+        case ID_NAV_PREV_MATCH:
+            if (ui->last_re) {
+                regex_search(ui, ui->last_re, 1, id == ID_NAV_PREV_MATCH);
+            } else if (indexed_search(ui, id == ID_NAV_PREV_MATCH)) {
+                /* no index of all matches to go by yet */
+                if (ui->last_query) {
+                    value_search(ui, id == ID_NAV_PREV_MATCH);
+                } else {
+                    search(ui, ui->last_pat, ui->last_mask,
+                           ui->last_pat_len, 1, id == ID_NAV_PREV_MATCH);
+                }
+            }
+            break;
+        case ID_NAV_FIND_ALL:
+            if (ui->last_re) {
+                errorbox(hwnd, TEXT("Cannot find all regex matches"));
+            } else if (ui->last_pat_len > 0) {
+                stop_find_all(ui);
+                ui->find_all = fa_new(ui->buffer, (uchar*)ui->last_pat,
+                                      (uchar*)ui->last_mask,
+                                      ui->last_pat_len);
+                SetTimer(hwnd, FIND_TIMER, FIND_INTERVAL, 0);
+            } else if (ui->last_query) {
+                stop_find_all(ui);
+                ui->find_all = fa_new_values(ui->buffer, ui->last_query);
+                SetTimer(hwnd, FIND_TIMER, FIND_INTERVAL, 0);
+            }
+            break;
+        case ID_NAV_FIND_VALUES:
+            {
+                TCHAR *text = inputbox(ui, TEXT("Find values "
+                                                "(type low [high [align]])"));
+                if (text) {
+                    ValueQuery q;
+                    char *s;
+#ifdef UNICODE
+                    s = utf16_to_mbcs(text);
+                    free(text);
+#else
+                    s = text;
+#endif
+                    if (parse_value_query(s, &q)) {
+                        errorbox(hwnd, TEXT("Syntax error"));
+                    } else {
+                        /* F3 goes through the values from now on */
+                        free(ui->last_pat);
+                        free(ui->last_mask);
+                        ui->last_pat = 0;
+                        ui->last_mask = 0;
+                        ui->last_pat_len = 0;
+                        re_free(ui->last_re);
+                        ui->last_re = 0;
+                        free(ui->last_query);
+                        ui->last_query = xmalloc(sizeof q);
+                        *ui->last_query = q;
+                        stop_find_all(ui);
+                        ui->find_all = fa_new_values(ui->buffer, &q);
+                        SetTimer(hwnd, FIND_TIMER, FIND_INTERVAL, 0);
+                    }
+                    free(s);
+                }
+                SetFocus(ui->monoedit);
+            }
+            break;
+        case ID_NAV_CANCEL_FIND_ALL:
+            stop_find_all(ui);
             break;
         case ID_TOOLS_LOAD_PLUGIN:
             if (open_file_chooser_dialog(hwnd, path, BUFSIZE)) break;
@@ -1460,6 +2055,14 @@ update_window_title(UI *ui)
     }
 }
 
+/* \\.\PhysicalDrive0, \\.\C: and the like */
+static int
+is_device_path(const TCHAR *path)
+{
+    return path[0] == '\\' && path[1] == '\\' &&
+        path[2] == '.' && path[3] == '\\';
+}
+
 /* pops up message box if something goes wrong */
 int
 open_file(UI *ui, TCHAR *path)
@@ -1467,15 +2070,30 @@ open_file(UI *ui, TCHAR *path)
     TCHAR errtext[BUFSIZE];
     HANDLE file;
     uchar readonly = 0;
-
-    file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
-                      0 /* lpSecurityAttributes */, OPEN_ALWAYS, 0, 0);
-    /* if cannot open file in rw mode, try ro */
-    if (file == INVALID_HANDLE_VALUE &&
-        GetLastError() == ERROR_SHARING_VIOLATION) {
-        readonly = 1;
-        file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, 0,
-                          OPEN_EXISTING, 0, 0);
+    uchar device = is_device_path(path);
+
+    if (device) {
+        /* unbuffered, to keep whole-disk scans out of the system cache */
+        file = CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+                          OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, 0);
+        if (file == INVALID_HANDLE_VALUE &&
+            GetLastError() == ERROR_ACCESS_DENIED) {
+            readonly = 1;
+            file = CreateFile(path, GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+                              OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, 0);
+        }
+    } else {
+        file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                          0 /* lpSecurityAttributes */, OPEN_ALWAYS, 0, 0);
+        /* if cannot open file in rw mode, try ro */
+        if (file == INVALID_HANDLE_VALUE &&
+            GetLastError() == ERROR_SHARING_VIOLATION) {
+            readonly = 1;
+            file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, 0,
+                              OPEN_EXISTING, 0, 0);
+        }
     }
     /* still cannot open file, fail */
     if (file == INVALID_HANDLE_VALUE) {
@@ -1484,23 +2102,64 @@ open_file(UI *ui, TCHAR *path)
         return -1;
     }
     /* initialize buffer */
-    if (buf_init(ui->buffer) < 0 || buf_load_file(ui->buffer, file, 0x100000))
+    if (buf_init(ui->buffer) < 0 ||
+        (device ? buf_load_device(ui->buffer, file) :
+         buf_load_file(ui->buffer, file, 0x100000)))
     {
         CloseHandle(file);
         return -1;
     }
 
+    buf_subscribe(ui->buffer, on_buffer_change, ui);
+    buf_subscribe(ui->buffer, notify_lua_listeners, ui->lua);
+
     ui_set_filepath(ui, lstrdup(path));
     ui->readonly = readonly;
+    SetTimer(ui->hwnd, SUMMARY_TIMER, SUMMARY_INTERVAL, 0);
 
     load_filetype_plugin(ui, path);
 
     return 0;
 }
 
+/* pops up message box if something goes wrong */
+int
+open_process(UI *ui, DWORD pid)
+{
+    TCHAR errtext[BUFSIZE];
+    HANDLE process;
+    uchar readonly = 0;
+
+    process = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ |
+                          PROCESS_VM_WRITE | PROCESS_VM_OPERATION, FALSE, pid);
+    if (!process && GetLastError() == ERROR_ACCESS_DENIED) {
+        readonly = 1;
+        process = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ,
+                              FALSE, pid);
+    }
+    if (!process) {
+        format_error_code(errtext, BUFSIZE, GetLastError());
+        errorbox(ui->hwnd, errtext);
+        return -1;
+    }
+    if (buf_init(ui->buffer) < 0 || buf_load_process(ui->buffer, process)) {
+        CloseHandle(process);
+        return -1;
+    }
+
+    buf_subscribe(ui->buffer, on_buffer_change, ui);
+    buf_subscribe(ui->buffer, notify_lua_listeners, ui->lua);
+
+    ui_set_filepath(ui, T(asprintf)(TEXT("process %lu"), pid));
+    ui->readonly = readonly;
+
+    return 0;
+}
+
 void
 close_file(UI *ui)
 {
+    stop_find_all(ui);
     buf_finalize(ui->buffer);
     free(ui->filepath);
     ui_set_filepath(ui, 0);
@@ -1522,6 +2181,7 @@ close_file(UI *ui)
     }
     ui_set_tree(ui, 0);
     rfreeall(&ui->tree_rgn);
+    clear_lua_listeners(ui->lua);
 }
 
 static uint64
@@ -1608,6 +2268,7 @@ update_ui(UI *ui)
 {
     static const int toggle_menus[] = {
         ID_FILE_SAVEAS,
+        ID_FILE_RELOAD,
         ID_FILE_CLOSE,
         ID_TOOLS_LOAD_PLUGIN,
     };
@@ -1655,9 +2316,10 @@ update_ui(UI *ui)
         }
     }
 
-    /* TODO: finer-grained UI update control */
     if (ui->buffer_changed) {
         ui->buffer_changed = false;
+        ui->changed_start = 0;
+        ui->changed_end = 0;
         bufsize = buf_size(ui->buffer);
         total_lines = bufsize >> LOG2_N_COL;
         if (bufsize&(N_COL-1)) {
@@ -1669,6 +2331,39 @@ update_ui(UI *ui)
         add_overlay(ui);
         med_update_canvas(ui->monoedit);
         InvalidateRect(ui->monoedit, 0, FALSE);
+    } else if (ui->changed_start < ui->changed_end) {
+        /* only redraw the visible rows that have changed */
+        HWND med = ui->monoedit;
+        uint64 curline = current_line(ui);
+        uint64 first = ui->changed_start >> LOG2_N_COL;
+        uint64 last = (ui->changed_end - 1) >> LOG2_N_COL;
+        int nrow = get_nrow(ui);
+        ui->changed_start = 0;
+        ui->changed_end = 0;
+        bufsize = buf_size(ui->buffer);
+        total_lines = bufsize >> LOG2_N_COL;
+        if (bufsize&(N_COL-1)) {
+            total_lines++;
+        }
+        if (total_lines != med_get_total_lines(med)) {
+            med_set_total_lines(med, total_lines);
+        }
+        if (first < curline) first = curline;
+        if (last >= curline + nrow) last = curline + nrow - 1;
+        if (first <= last) {
+            int row0 = (int)(first - curline);
+            int row1 = (int)(last - curline);
+            /* med_update_buffer_row discards overlays of that row */
+            med_clear_overlay(med);
+            for (i=row0; i<=row1; i++) {
+                med_update_buffer_row(med, i);
+            }
+            add_overlay(ui);
+            for (i=row0; i<=row1; i++) {
+                med_update_canvas_row(med, i);
+                med_invalidate_row(med, i);
+            }
+        }
     }
 
     if (ui->plugin_name_changed) {
@@ -1682,6 +2377,27 @@ update_ui(UI *ui)
     }
 }
 
+/* subscribed to ui->buffer */
+void
+on_buffer_change(void *arg, uint64 addr, uint64 removed, uint64 inserted)
+{
+    UI *ui = arg;
+    uint64 end;
+    if (removed == inserted) {
+        end = addr + inserted;
+    } else {
+        /* everything after addr has moved */
+        end = (uint64) -1;
+    }
+    if (ui->changed_start < ui->changed_end) {
+        if (addr < ui->changed_start) ui->changed_start = addr;
+        if (end > ui->changed_end) ui->changed_end = end;
+    } else {
+        ui->changed_start = addr;
+        ui->changed_end = end;
+    }
+}
+
 void
 move_forward(UI *ui)
 {
@@ -1067,6 +1067,18 @@ med_invalidate_char(HWND hwnd, int row, int col)
     InvalidateRect(hwnd, &r, 0);
 }
 
+void
+med_invalidate_row(HWND hwnd, int row)
+{
+    Med *w = (Med *) GetWindowLongPtr(hwnd, 0);
+    RECT r;
+    r.left = 0;
+    r.top = row*w->charheight;
+    r.right = w->clientwidth;
+    r.bottom = r.top + w->charheight;
+    InvalidateRect(hwnd, &r, 0);
+}
+
 void
 med_update_canvas(HWND hwnd)
 {
@@ -61,4 +61,5 @@ void med_reset_position(HWND);
 void med_update_canvas(HWND);
 void med_update_canvas_row(HWND, int);
 void med_invalidate_char(HWND, int, int);
+void med_invalidate_row(HWND, int);
 void med_add_tag(MedTagList *, int start, int len, MedTextAttr *attr);
@@ -0,0 +1,1100 @@
+#include "u.h"
+
+#include <windows.h>
+
+#include "buffer.h"
+#include "regex.h"
+
+/* Patterns match bytes, not characters:
+     .                   any byte
+     [a-f\x80] [^...]    sets of bytes
+     \xHH \n \r \t \f \v \0
+                         single bytes; other punctuation after \ stands
+                         for itself
+     \d \w \s \D \W \S   ASCII digits, word bytes, white space and their
+                         complements
+     * + ? {n} {n,} {n,m}
+                         repetition, as few times as possible if followed
+                         by ?
+     | ( ) (?: )
+   Matching is leftmost-first, as in Perl. Patterns that can match the
+   empty string are rejected. */
+
+#define MAX_REPEAT 1000
+#define MAX_DEPTH 1000 // of nested groups
+#define MAX_NODES 100000 // in the parse tree
+#define MAX_HEIGHT 4000 // of the parse tree, bounding compile's recursion
+#define MAX_PROG 50000 // instructions
+#define DFA_CACHE_SIZE (8 << 20) // bytes of states before starting over
+
+#define HAS(set, c) ((set)[(c) >> 3] >> ((c) & 7) & 1)
+#define ADD(set, c) ((set)[(c) >> 3] |= 1 << ((c) & 7))
+
+enum { N_EMPTY, N_SET, N_CAT, N_ALT, N_REPEAT };
+
+struct node {
+    uchar type;
+    uchar greedy;
+    int a, b; // children, or the set of an N_SET in a
+    int min, max; // max < 0 if unbounded
+};
+
+struct parser {
+    const uchar *p, *end;
+    const char *err;
+    int depth;
+    struct node *nodes;
+    int nnodes, nodecap;
+    uchar (*sets)[32];
+    int nsets, setcap;
+};
+
+enum { OP_SET, OP_SPLIT, OP_JMP, OP_MATCH };
+
+/* OP_SET goes on to the next instruction if the byte is in set x.
+   OP_SPLIT tries x before y. */
+struct inst {
+    uchar op;
+    int x, y;
+};
+
+struct prog {
+    struct inst *insts;
+    int n, cap;
+};
+
+enum {
+    DFA_FORWARD,
+    DFA_BACKWARD,
+    DFA_FORWARD_ANCHORED,
+    DFA_BACKWARD_ANCHORED,
+};
+
+enum {
+    DS_MATCHED = 1, // a match has ended before this state
+    DS_ACCEPT = 2, // a match ends here
+    DS_DEAD = 4, // no thread left
+};
+
+struct dstate {
+    int off, n; // ordered list of OP_SET and OP_MATCH threads in pool
+    uchar flags;
+};
+
+/* A lazily built DFA whose states are ordered lists of NFA threads.
+   Unanchored DFAs start a thread at every position until a match is
+   found, and drop the threads ranking below a match; the last match
+   seen before the DFA dies is the end of the leftmost-first match.
+   Anchored ones run every thread, so the last match seen is the
+   longest. States are thrown away once they take too much memory. */
+struct dfa {
+    Regex *re;
+    struct prog *prog;
+    int anchored;
+    const uchar *skip; // bytes that leave the unanchored start state
+    struct dstate *states;
+    int nstates, statecap;
+    int *trans; // nclass per state, -1 if not built yet
+    int *pool;
+    size_t npool, poolcap;
+    int *table; // hash table of states, -1 if empty
+    int tabsize;
+    int start;
+    /* scratch */
+    int *list, *saved, *stack;
+    uint32 *mark;
+    uint32 gen;
+};
+
+struct regex {
+    struct prog fwd, rev;
+    uchar (*sets)[32];
+    uchar cls[256]; // bytes in the same class are in the same sets
+    uchar rep[256]; // a byte of each class
+    int nclass;
+    uchar first[256]; // bytes that can start a match
+    uchar last[256]; // bytes that can end one
+    struct dfa *dfa[4];
+};
+
+static int parse_alt(struct parser *);
+
+static int
+new_node(struct parser *ps, int type, int a, int b)
+{
+    struct node *n;
+
+    if (ps->nnodes == MAX_NODES) {
+        ps->err = "pattern too large";
+        return -1;
+    }
+    if (ps->nnodes == ps->nodecap) {
+        ps->nodecap = ps->nodecap ? 2 * ps->nodecap : 64;
+        ps->nodes = xrealloc(ps->nodes, ps->nodecap * sizeof *ps->nodes);
+    }
+    n = &ps->nodes[ps->nnodes];
+    n->type = type;
+    n->greedy = 1;
+    n->a = a;
+    n->b = b;
+    n->min = n->max = 0;
+    return ps->nnodes++;
+}
+
+static int
+new_set(struct parser *ps)
+{
+    if (ps->nsets == ps->setcap) {
+        ps->setcap = ps->setcap ? 2 * ps->setcap : 16;
+        ps->sets = xrealloc(ps->sets, ps->setcap * sizeof *ps->sets);
+    }
+    memset(ps->sets[ps->nsets], 0, sizeof *ps->sets);
+    return ps->nsets++;
+}
+
+static int
+hexval(int c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int
+in_escape_class(int e, int c)
+{
+    int digit = c >= '0' && c <= '9';
+    switch (e | 0x20) {
+    case 'd':
+        return digit;
+    case 'w':
+        return digit || (c | 0x20) >= 'a' && (c | 0x20) <= 'z' || c == '_';
+    default:
+        return c == ' ' || c >= '\t' && c <= '\r';
+    }
+}
+
+/* Parses the escape after a backslash and adds what it stands for to
+   set. Returns the byte, -1 if it stands for several, or -2 on errors. */
+static int
+parse_escape(struct parser *ps, uchar *set)
+{
+    int c, hi, lo;
+
+    if (ps->p == ps->end) {
+        ps->err = "trailing backslash";
+        return -2;
+    }
+    c = *ps->p++;
+    switch (c) {
+    case 'x':
+        if (ps->end - ps->p < 2 ||
+            (hi = hexval(ps->p[0])) < 0 || (lo = hexval(ps->p[1])) < 0)
+        {
+            ps->err = "\\x needs two hex digits";
+            return -2;
+        }
+        ps->p += 2;
+        c = hi << 4 | lo;
+        break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'f': c = '\f'; break;
+    case 'v': c = '\v'; break;
+    case '0': c = 0; break;
+    case 'd': case 'w': case 's':
+    case 'D': case 'W': case 'S':
+        for (int i=0; i<256; i++) {
+            /* upper case is the complement */
+            if (in_escape_class(c, i) == !(c & 0x20)) continue;
+            ADD(set, i);
+        }
+        return -1;
+    default:
+        if (c < 128 && isalnum(c)) {
+            ps->err = "unknown escape";
+            return -2;
+        }
+    }
+    ADD(set, c);
+    return c;
+}
+
+/* after the [ */
+static int
+parse_class(struct parser *ps, uchar *set)
+{
+    int neg = 0;
+    int first = 1;
+
+    if (ps->p < ps->end && *ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    for (;;) {
+        int lo, hi, c;
+        if (ps->p == ps->end) {
+            ps->err = "missing ]";
+            return -1;
+        }
+        c = *ps->p++;
+        if (c == ']' && !first) break;
+        first = 0;
+        if (c == '\\') {
+            lo = parse_escape(ps, set);
+            if (lo == -2) return -1;
+            if (lo == -1) continue;
+        } else {
+            lo = c;
+        }
+        if (ps->end - ps->p < 2 || ps->p[0] != '-' || ps->p[1] == ']') {
+            ADD(set, lo);
+            continue;
+        }
+        ps->p++;
+        c = *ps->p++;
+        if (c == '\\') {
+            uchar tmp[32];
+            memset(tmp, 0, sizeof tmp);
+            hi = parse_escape(ps, tmp);
+            if (hi == -2) return -1;
+        } else {
+            hi = c;
+        }
+        if (hi < lo) {
+            ps->err = "bad range";
+            return -1;
+        }
+        for (c=lo; c<=hi; c++) ADD(set, c);
+    }
+    if (neg) {
+        for (int i=0; i<32; i++) set[i] = ~set[i];
+    }
+    return 0;
+}
+
+static int
+parse_atom(struct parser *ps)
+{
+    int c = *ps->p++;
+    int n;
+
+    switch (c) {
+    case '(':
+        if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':') {
+            ps->p += 2;
+        }
+        if (++ps->depth > MAX_DEPTH) {
+            ps->err = "groups nested too deeply";
+            return -1;
+        }
+        n = parse_alt(ps);
+        ps->depth--;
+        if (n < 0) return -1;
+        if (ps->p == ps->end || *ps->p != ')') {
+            ps->err = "missing )";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    case '*': case '+': case '?': case '{':
+        ps->err = "nothing to repeat";
+        return -1;
+    }
+    n = new_set(ps);
+    switch (c) {
+    case '[':
+        if (parse_class(ps, ps->sets[n])) return -1;
+        break;
+    case '.':
+        memset(ps->sets[n], 0xff, sizeof *ps->sets);
+        break;
+    case '\\':
+        if (parse_escape(ps, ps->sets[n]) == -2) return -1;
+        break;
+    default:
+        ADD(ps->sets[n], c);
+    }
+    return new_node(ps, N_SET, n, 0);
+}
+
+static int
+parse_number(struct parser *ps, int *n)
+{
+    const uchar *start = ps->p;
+
+    *n = 0;
+    while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+        *n = *n * 10 + (*ps->p++ - '0');
+        if (*n > MAX_REPEAT) return -1;
+    }
+    return ps->p > start ? 0 : -1;
+}
+
+/* {n}, {n,} or {n,m}, leaving ps->p at the } */
+static int
+parse_count(struct parser *ps, int *min, int *max)
+{
+    ps->p++;
+    if (parse_number(ps, min)) goto bad;
+    *max = *min;
+    if (ps->p < ps->end && *ps->p == ',') {
+        ps->p++;
+        *max = -1;
+        if (ps->p < ps->end && *ps->p != '}' && parse_number(ps, max)) {
+            goto bad;
+        }
+    }
+    if (ps->p == ps->end || *ps->p != '}' || *max >= 0 && *max < *min) {
+        goto bad;
+    }
+    return 0;
+bad:
+    ps->err = "bad repeat count";
+    return -1;
+}
+
+static int
+parse_repeat(struct parser *ps)
+{
+    int a = parse_atom(ps);
+
+    while (a >= 0 && ps->p < ps->end) {
+        int min, max;
+        switch (*ps->p) {
+        case '*': min = 0; max = -1; break;
+        case '+': min = 1; max = -1; break;
+        case '?': min = 0; max = 1; break;
+        case '{':
+            if (parse_count(ps, &min, &max)) return -1;
+            break;
+        default:
+            return a;
+        }
+        ps->p++;
+        a = new_node(ps, N_REPEAT, a, 0);
+        if (a < 0) return -1;
+        ps->nodes[a].min = min;
+        ps->nodes[a].max = max;
+        if (ps->p < ps->end && *ps->p == '?') {
+            ps->nodes[a].greedy = 0;
+            ps->p++;
+        }
+    }
+    return a;
+}
+
+/* nodes to be joined by parse_cat or parse_alt */
+struct items {
+    int *v;
+    int n, cap;
+};
+
+static void
+push_item(struct items *l, int n)
+{
+    if (l->n == l->cap) {
+        l->cap = l->cap ? 2 * l->cap : 16;
+        l->v = xrealloc(l->v, l->cap * sizeof *l->v);
+    }
+    l->v[l->n++] = n;
+}
+
+/* Joins v[0:n] with nodes of type, N_CAT or N_ALT, as a balanced tree,
+   so that a long literal or list of alternatives is only log n deep.
+   Both are associative, leftmost-first alternation included. */
+static int
+join(struct parser *ps, int type, const int *v, int n)
+{
+    int a, b;
+
+    if (n == 1) return v[0];
+    a = join(ps, type, v, n/2);
+    if (a < 0) return -1;
+    b = join(ps, type, v + n/2, n - n/2);
+    if (b < 0) return -1;
+    return new_node(ps, type, a, b);
+}
+
+static int
+parse_cat(struct parser *ps)
+{
+    struct items l = {0};
+    int a;
+
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        a = parse_repeat(ps);
+        if (a < 0) {
+            free(l.v);
+            return -1;
+        }
+        push_item(&l, a);
+    }
+    a = l.n ? join(ps, N_CAT, l.v, l.n) : new_node(ps, N_EMPTY, 0, 0);
+    free(l.v);
+    return a;
+}
+
+static int
+parse_alt(struct parser *ps)
+{
+    struct items l = {0};
+    int a = parse_cat(ps);
+
+    while (a >= 0) {
+        push_item(&l, a);
+        if (ps->p == ps->end || *ps->p != '|') break;
+        ps->p++;
+        a = parse_cat(ps);
+    }
+    if (a >= 0) a = join(ps, N_ALT, l.v, l.n);
+    free(l.v);
+    return a;
+}
+
+/* Children are made before their parents, so a pass over the nodes in
+   order sees each after its children. These passes stand in for
+   recursion, which a deep tree would overflow the stack with. */
+
+/* whether node n can match the empty string */
+static int
+nullable(struct parser *ps, int n)
+{
+    uchar *null = xmalloc(n+1);
+    int ret;
+
+    for (int i=0; i<=n; i++) {
+        struct node *nd = &ps->nodes[i];
+        switch (nd->type) {
+        case N_EMPTY:
+            null[i] = 1;
+            break;
+        case N_SET:
+            null[i] = 0;
+            break;
+        case N_CAT:
+            null[i] = null[nd->a] && null[nd->b];
+            break;
+        case N_ALT:
+            null[i] = null[nd->a] || null[nd->b];
+            break;
+        default:
+            null[i] = nd->min == 0 || null[nd->a];
+        }
+    }
+    ret = null[n];
+    free(null);
+    return ret;
+}
+
+/* the number of levels of node n */
+static int
+height(struct parser *ps, int n)
+{
+    int *h = xmalloc((n+1) * sizeof *h);
+    int ret;
+
+    for (int i=0; i<=n; i++) {
+        struct node *nd = &ps->nodes[i];
+        switch (nd->type) {
+        case N_CAT:
+        case N_ALT:
+            h[i] = 1 + max(h[nd->a], h[nd->b]);
+            break;
+        case N_REPEAT:
+            h[i] = 1 + h[nd->a];
+            break;
+        default:
+            h[i] = 1;
+        }
+    }
+    ret = h[n];
+    free(h);
+    return ret;
+}
+
+static int
+emit(struct prog *pg, int op, int x, int y)
+{
+    if (pg->n == pg->cap) {
+        pg->cap = pg->cap ? 2 * pg->cap : 64;
+        pg->insts = xrealloc(pg->insts, pg->cap * sizeof *pg->insts);
+    }
+    pg->insts[pg->n].op = op;
+    pg->insts[pg->n].x = x;
+    pg->insts[pg->n].y = y;
+    return pg->n++;
+}
+
+/* Appends the code of node n, matching backwards if reverse. Returns -1
+   if the program grows too large. */
+static int
+compile(struct parser *ps, struct prog *pg, int n, int reverse)
+{
+    struct node *nd = &ps->nodes[n];
+    int split, jmp, chain;
+
+    if (pg->n > MAX_PROG) return -1;
+    switch (nd->type) {
+    case N_EMPTY:
+        return 0;
+    case N_SET:
+        emit(pg, OP_SET, nd->a, 0);
+        return 0;
+    case N_CAT:
+        if (reverse) {
+            return compile(ps, pg, nd->b, 1) || compile(ps, pg, nd->a, 1)
+                ? -1 : 0;
+        }
+        return compile(ps, pg, nd->a, 0) || compile(ps, pg, nd->b, 0)
+            ? -1 : 0;
+    case N_ALT:
+        split = emit(pg, OP_SPLIT, pg->n+1, 0);
+        if (compile(ps, pg, nd->a, reverse)) return -1;
+        jmp = emit(pg, OP_JMP, 0, 0);
+        pg->insts[split].y = pg->n;
+        if (compile(ps, pg, nd->b, reverse)) return -1;
+        pg->insts[jmp].x = pg->n;
+        return 0;
+    }
+    for (int i=0; i<nd->min; i++) {
+        if (compile(ps, pg, nd->a, reverse)) return -1;
+    }
+    if (nd->max < 0) {
+        split = emit(pg, OP_SPLIT, pg->n+1, 0);
+        if (compile(ps, pg, nd->a, reverse)) return -1;
+        emit(pg, OP_JMP, split, 0);
+        pg->insts[split].y = pg->n;
+        if (!nd->greedy) {
+            pg->insts[split].x = pg->n;
+            pg->insts[split].y = split+1;
+        }
+        return 0;
+    }
+    /* optional copies, each skipping to the end; y links the splits
+       until the end is known */
+    chain = -1;
+    for (int i=nd->min; i<nd->max; i++) {
+        split = emit(pg, OP_SPLIT, pg->n+1, chain);
+        chain = split;
+        if (compile(ps, pg, nd->a, reverse)) return -1;
+    }
+    while (chain >= 0) {
+        struct inst *in = &pg->insts[chain];
+        chain = in->y;
+        in->y = pg->n;
+        if (!nd->greedy) {
+            in->y = in->x;
+            in->x = pg->n;
+        }
+    }
+    return 0;
+}
+
+/* marks the bytes that can be consumed first by pg */
+static void
+first_bytes(Regex *re, struct prog *pg, uchar *first)
+{
+    uchar *seen = xmalloc0(pg->n);
+    int *stack = xmalloc((2 * pg->n + 1) * sizeof *stack);
+    int sp = 0;
+
+    memset(first, 0, 256);
+    stack[sp++] = 0;
+    while (sp) {
+        int pc = stack[--sp];
+        struct inst *in = &pg->insts[pc];
+        if (seen[pc]) continue;
+        seen[pc] = 1;
+        switch (in->op) {
+        case OP_SET:
+            for (int c=0; c<256; c++) {
+                if (HAS(re->sets[in->x], c)) first[c] = 1;
+            }
+            break;
+        case OP_SPLIT:
+            stack[sp++] = in->y;
+            /* fallthrough */
+        case OP_JMP:
+            stack[sp++] = in->x;
+            break;
+        }
+    }
+    free(seen);
+    free(stack);
+}
+
+/* splits the bytes into classes that no set tells apart */
+static void
+make_classes(Regex *re, int nsets)
+{
+    int id[512];
+    int n = 1;
+
+    memset(re->cls, 0, sizeof re->cls);
+    for (int s=0; s<nsets; s++) {
+        int k = 0;
+        for (int i=0; i<2*n; i++) id[i] = -1;
+        for (int c=0; c<256; c++) {
+            int key = re->cls[c] * 2 + HAS(re->sets[s], c);
+            if (id[key] < 0) id[key] = k++;
+            re->cls[c] = id[key];
+        }
+        n = k;
+    }
+    re->nclass = n;
+    for (int c=255; c>=0; c--) re->rep[re->cls[c]] = c;
+}
+
+/* Compiles pat[0:len]. On errors returns null and points *err at a
+   message. */
+Regex *
+re_compile(const uchar *pat, size_t len, const char **err)
+{
+    struct parser ps;
+    Regex *re = 0;
+    int root;
+
+    memset(&ps, 0, sizeof ps);
+    ps.p = pat;
+    ps.end = pat + len;
+    root = parse_alt(&ps);
+    if (root >= 0 && ps.p != ps.end) {
+        ps.err = "unmatched )";
+        root = -1;
+    }
+    if (root >= 0 && height(&ps, root) > MAX_HEIGHT) {
+        ps.err = "pattern nested too deeply";
+        root = -1;
+    }
+    if (root >= 0 && nullable(&ps, root)) {
+        ps.err = "pattern matches the empty string";
+        root = -1;
+    }
+    if (root >= 0) {
+        re = xmalloc0(sizeof *re);
+        if (compile(&ps, &re->fwd, root, 0) ||
+            compile(&ps, &re->rev, root, 1))
+        {
+            ps.err = "pattern too large";
+            re_free(re);
+            re = 0;
+        } else {
+            emit(&re->fwd, OP_MATCH, 0, 0);
+            emit(&re->rev, OP_MATCH, 0, 0);
+            re->sets = ps.sets;
+            ps.sets = 0;
+            make_classes(re, ps.nsets);
+            first_bytes(re, &re->fwd, re->first);
+            first_bytes(re, &re->rev, re->last);
+        }
+    }
+    free(ps.nodes);
+    free(ps.sets);
+    if (!re && err) *err = ps.err;
+    return re;
+}
+
+static void
+dfa_free(struct dfa *d)
+{
+    if (!d) return;
+    free(d->states);
+    free(d->trans);
+    free(d->pool);
+    free(d->table);
+    free(d->list);
+    free(d->saved);
+    free(d->stack);
+    free(d->mark);
+    free(d);
+}
+
+void
+re_free(Regex *re)
+{
+    if (!re) return;
+    for (int i=0; i<4; i++) dfa_free(re->dfa[i]);
+    free(re->fwd.insts);
+    free(re->rev.insts);
+    free(re->sets);
+    free(re);
+}
+
+/* Appends the threads reachable from pc to d->list, in order of
+   priority. Returns 1 if a match is among them, in which case an
+   unanchored DFA drops the rest. */
+static int
+add_thread(struct dfa *d, int pc, int *n)
+{
+    struct inst *insts = d->prog->insts;
+    int sp = 0;
+    int matched = 0;
+
+    d->stack[sp++] = pc;
+    while (sp) {
+        pc = d->stack[--sp];
+        if (d->mark[pc] == d->gen) continue;
+        d->mark[pc] = d->gen;
+        switch (insts[pc].op) {
+        case OP_SPLIT:
+            d->stack[sp++] = insts[pc].y;
+            /* fallthrough */
+        case OP_JMP:
+            d->stack[sp++] = insts[pc].x;
+            break;
+        case OP_MATCH:
+            d->list[(*n)++] = pc;
+            if (!d->anchored) return 1;
+            matched = 1;
+            break;
+        default:
+            d->list[(*n)++] = pc;
+        }
+    }
+    return matched;
+}
+
+static void
+next_gen(struct dfa *d)
+{
+    if (!++d->gen) {
+        memset(d->mark, 0, d->prog->n * sizeof *d->mark);
+        d->gen = 1;
+    }
+}
+
+static uint32
+hash_state(const int *list, int n, int flags)
+{
+    uint32 h = 2166136261u ^ flags;
+    for (int i=0; i<n; i++) h = (h ^ list[i]) * 16777619u;
+    return h;
+}
+
+static int
+intern(struct dfa *d, const int *list, int n, int flags)
+{
+    int nc = d->re->nclass;
+    uint32 mask = d->tabsize - 1;
+    uint32 i;
+    struct dstate *s;
+
+    for (i = hash_state(list, n, flags) & mask; d->table[i] >= 0;
+         i = (i+1) & mask)
+    {
+        s = &d->states[d->table[i]];
+        if (s->flags == flags && s->n == n &&
+            !memcmp(d->pool + s->off, list, n * sizeof *list))
+        {
+            return d->table[i];
+        }
+    }
+    if (d->nstates == d->statecap) {
+        d->statecap = d->statecap ? 2 * d->statecap : 64;
+        d->states = xrealloc(d->states, d->statecap * sizeof *d->states);
+        d->trans = xrealloc(d->trans,
+                            (size_t) d->statecap * nc * sizeof *d->trans);
+    }
+    if (d->npool + n > d->poolcap) {
+        d->poolcap = max(2 * d->poolcap, d->npool + n + 256);
+        d->pool = xrealloc(d->pool, d->poolcap * sizeof *d->pool);
+    }
+    memcpy(d->pool + d->npool, list, n * sizeof *list);
+    s = &d->states[d->nstates];
+    s->off = (int) d->npool;
+    s->n = n;
+    s->flags = flags;
+    d->npool += n;
+    memset(d->trans + (size_t) d->nstates * nc, 0xff, nc * sizeof *d->trans);
+    d->table[i] = d->nstates;
+    if (2 * ++d->nstates > d->tabsize) {
+        /* rehash */
+        free(d->table);
+        d->tabsize *= 2;
+        d->table = xmalloc(d->tabsize * sizeof *d->table);
+        memset(d->table, 0xff, d->tabsize * sizeof *d->table);
+        mask = d->tabsize - 1;
+        for (int k=0; k<d->nstates; k++) {
+            s = &d->states[k];
+            i = hash_state(d->pool + s->off, s->n, s->flags) & mask;
+            while (d->table[i] >= 0) i = (i+1) & mask;
+            d->table[i] = k;
+        }
+    }
+    return d->nstates - 1;
+}
+
+/* forgets all states but the start state */
+static void
+dfa_reset(struct dfa *d)
+{
+    int n = 0;
+
+    d->nstates = 0;
+    d->npool = 0;
+    d->tabsize = 256;
+    free(d->table);
+    d->table = xmalloc(d->tabsize * sizeof *d->table);
+    memset(d->table, 0xff, d->tabsize * sizeof *d->table);
+    next_gen(d);
+    add_thread(d, 0, &n);
+    d->start = intern(d, d->list, n, 0);
+}
+
+static struct dfa *
+get_dfa(Regex *re, int kind)
+{
+    struct dfa *d = re->dfa[kind];
+    int n;
+
+    if (d) return d;
+    d = xmalloc0(sizeof *d);
+    d->re = re;
+    d->prog = kind == DFA_FORWARD || kind == DFA_FORWARD_ANCHORED
+        ? &re->fwd : &re->rev;
+    d->anchored = kind == DFA_FORWARD_ANCHORED ||
+        kind == DFA_BACKWARD_ANCHORED;
+    d->skip = d->prog == &re->fwd ? re->first : re->last;
+    n = d->prog->n;
+    d->list = xmalloc(n * sizeof *d->list);
+    d->saved = xmalloc(n * sizeof *d->saved);
+    d->stack = xmalloc((2*n + 1) * sizeof *d->stack);
+    d->mark = xmalloc0(n * sizeof *d->mark);
+    dfa_reset(d);
+    re->dfa[kind] = d;
+    return d;
+}
+
+/* the state reached from s on bytes of class c */
+static int
+dfa_step(struct dfa *d, int s, int c)
+{
+    Regex *re = d->re;
+    struct dstate *st = &d->states[s];
+    const int *list = d->pool + st->off;
+    int byte = re->rep[c];
+    int flags = st->flags & (DS_MATCHED | DS_ACCEPT) ? DS_MATCHED : 0;
+    int n = 0;
+    int accept = 0;
+    int t;
+
+    if ((size_t) d->nstates * (re->nclass + 4) * sizeof(int) +
+        d->npool * sizeof *d->pool > DFA_CACHE_SIZE)
+    {
+        /* start over, keeping s */
+        int sflags = st->flags;
+        n = st->n;
+        memcpy(d->saved, list, n * sizeof *list);
+        dfa_reset(d);
+        s = intern(d, d->saved, n, sflags);
+        st = &d->states[s];
+        list = d->pool + st->off;
+        n = 0;
+    }
+    next_gen(d);
+    for (int i=0; i<st->n; i++) {
+        struct inst *in = &d->prog->insts[list[i]];
+        if (in->op != OP_SET || !HAS(re->sets[in->x], byte)) continue;
+        if (add_thread(d, list[i]+1, &n)) {
+            accept = 1;
+            if (!d->anchored) break;
+        }
+    }
+    /* a new thread for a match starting at the next byte */
+    if (!d->anchored && !flags && !accept) add_thread(d, 0, &n);
+    if (accept) flags |= DS_ACCEPT;
+    if (!n) flags |= DS_DEAD;
+    t = intern(d, d->list, n, flags);
+    d->trans[(size_t) s * re->nclass + c] = t;
+    return t;
+}
+
+struct re_scan {
+    struct dfa *d;
+    int s;
+    int matched;
+    uint64 pos; // next address expected, or after the last if backward
+    uint64 found; // end of the last match, or start if backward
+};
+
+/* returns 1 once the DFA dies */
+static int
+run_forward(struct re_scan *sc, const uchar *p, size_t n)
+{
+    struct dfa *d = sc->d;
+    const uchar *cls = d->re->cls;
+    int s = sc->s;
+
+    for (size_t i=0; i<n; i++) {
+        int t;
+        if (s == d->start && !d->anchored) {
+            /* nothing can match before one of these */
+            while (i < n && !d->skip[p[i]]) i++;
+            if (i == n) break;
+        }
+        t = d->trans[(size_t) s * d->re->nclass + cls[p[i]]];
+        s = t >= 0 ? t : dfa_step(d, s, cls[p[i]]);
+        if (d->states[s].flags & (DS_ACCEPT | DS_DEAD)) {
+            if (d->states[s].flags & DS_DEAD) {
+                sc->s = s;
+                return 1;
+            }
+            sc->found = sc->pos + i+1;
+            sc->matched = 1;
+        }
+    }
+    sc->s = s;
+    sc->pos += n;
+    return 0;
+}
+
+static int
+run_backward(struct re_scan *sc, const uchar *p, size_t n)
+{
+    struct dfa *d = sc->d;
+    const uchar *cls = d->re->cls;
+    int s = sc->s;
+
+    for (size_t i=n; i>0; i--) {
+        int t;
+        if (s == d->start && !d->anchored) {
+            while (i > 0 && !d->skip[p[i-1]]) i--;
+            if (!i) break;
+        }
+        t = d->trans[(size_t) s * d->re->nclass + cls[p[i-1]]];
+        s = t >= 0 ? t : dfa_step(d, s, cls[p[i-1]]);
+        if (d->states[s].flags & (DS_ACCEPT | DS_DEAD)) {
+            if (d->states[s].flags & DS_DEAD) {
+                sc->s = s;
+                return 1;
+            }
+            sc->found = sc->pos - n + i-1;
+            sc->matched = 1;
+        }
+    }
+    sc->s = s;
+    sc->pos -= n;
+    return 0;
+}
+
+static const uchar zeros[4096];
+
+/* Feeds n zero bytes. Once a zero leads a state back to itself without
+   a match, the rest of the run is skipped. */
+static int
+run_zeros(struct re_scan *sc, uint64 n, int backward)
+{
+    struct dfa *d = sc->d;
+    int z = d->re->cls[0];
+
+    while (n) {
+        size_t k = (size_t) min(n, sizeof zeros);
+        int t;
+        if (backward ? run_backward(sc, zeros, k) : run_forward(sc, zeros, k)) {
+            return 1;
+        }
+        n -= k;
+        t = d->trans[(size_t) sc->s * d->re->nclass + z];
+        if (t < 0) t = dfa_step(d, sc->s, z);
+        if (t == sc->s && !(d->states[t].flags & DS_ACCEPT)) {
+            sc->pos = backward ? sc->pos - n : sc->pos + n;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int
+forward_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct re_scan *sc = arg;
+
+    /* unreadable gaps read as zeros */
+    if (addr > sc->pos && run_zeros(sc, addr - sc->pos, 0)) return 1;
+    return run_forward(sc, data, len);
+}
+
+static int
+backward_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct re_scan *sc = arg;
+
+    if (addr + len < sc->pos && run_zeros(sc, sc->pos - (addr + len), 1)) {
+        return 1;
+    }
+    return run_backward(sc, data, len);
+}
+
+/* Runs a DFA over [start, start+len) until it dies. Returns 0 and the
+   last match boundary it saw in *found, 1 if it saw none, or -1 on read
+   errors. */
+static int
+run(Buffer *b, Regex *re, int kind, uint64 start, uint64 len,
+    uint64 *found)
+{
+    struct re_scan sc;
+    int backward = kind == DFA_BACKWARD || kind == DFA_BACKWARD_ANCHORED;
+    int ret;
+
+    sc.d = get_dfa(re, kind);
+    sc.s = sc.d->start;
+    sc.matched = 0;
+    if (backward) {
+        sc.pos = start + len;
+        ret = buf_scan_backward(b, start, len, backward_span, &sc);
+        if (!ret && sc.pos > start) run_zeros(&sc, sc.pos - start, 1);
+    } else {
+        sc.pos = start;
+        ret = buf_scan(b, start, len, forward_span, &sc);
+        if (!ret && sc.pos < start + len) {
+            run_zeros(&sc, start + len - sc.pos, 0);
+        }
+    }
+    if (ret < 0) return -1;
+    if (!sc.matched) return 1;
+    *found = sc.found;
+    return 0;
+}
+
+/* Finds the leftmost match starting at or after start. Returns 0 and
+   its extent [*mstart, *mend) if there is one, 1 if not, or -1 on read
+   errors. */
+int
+buf_re_search(Buffer *b, Regex *re, uint64 start, uint64 *mstart,
+              uint64 *mend)
+{
+    uint64 size = buf_size(b);
+    uint64 s, e;
+    int ret;
+
+    if (start > size) start = size;
+    ret = run(b, re, DFA_FORWARD, start, size - start, &e);
+    if (ret) return ret;
+    /* the leftmost start of a match ending at e */
+    if (run(b, re, DFA_BACKWARD_ANCHORED, start, e - start, &s)) return -1;
+    *mstart = s;
+    *mend = e;
+    return 0;
+}
+
+/* Finds the match ending last at or before end, reading backwards.
+   Returns like buf_re_search. */
+int
+buf_re_search_backward(Buffer *b, Regex *re, uint64 end, uint64 *mstart,
+                       uint64 *mend)
+{
+    uint64 s, e;
+    int ret;
+
+    end = min(end, buf_size(b));
+    ret = run(b, re, DFA_BACKWARD, 0, end, &s);
+    if (ret) return ret;
+    /* the longest match from s */
+    if (run(b, re, DFA_FORWARD_ANCHORED, s, end - s, &e)) return -1;
+    *mstart = s;
+    *mend = e;
+    return 0;
+}
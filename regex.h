@@ -0,0 +1,10 @@
+/* byte regular expressions */
+
+typedef struct regex Regex;
+
+Regex *re_compile(const uchar *pat, size_t len, const char **err);
+void re_free(Regex *);
+int buf_re_search(Buffer *, Regex *, uint64 start, uint64 *mstart,
+                  uint64 *mend);
+int buf_re_search_backward(Buffer *, Regex *, uint64 end, uint64 *mstart,
+                           uint64 *mend);
@@ -0,0 +1,1136 @@
+#include "u.h"
+
+#include <windows.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "buffer.h"
+#include "search.h"
+#include "threads.h"
+
+#define CHUNK_SIZE ((uint64) 16 << 20) // per thread, finding the first
+#define MIN_CHUNK_SIZE ((uint64) 1 << 20) // per thread, finding all
+#define CHUNK_HITS 65536 // occurrences a thread collects per chunk
+#define SKIP_BLOCK ((uint64) 1 << 16) // blocks ruled out by the summaries
+
+static const uchar zeros[4096];
+
+/* Returns the offset of the first occurrence of pat[0:m] in p[0:n], or n
+   if there is none. Candidates must match both the first and the last
+   byte of the pattern, which rules out most positions 16 at a time;
+   only those left are compared in full. */
+static size_t
+find_in(const uchar *pat, size_t m, const uchar *p, size_t n)
+{
+    size_t i = 0;
+
+    if (n < m) return n;
+#ifdef __SSE2__
+    {
+        __m128i first = _mm_set1_epi8((char) pat[0]);
+        __m128i last = _mm_set1_epi8((char) pat[m-1]);
+        for (; i + m-1 + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(p+i));
+            __m128i z = _mm_loadu_si128((const __m128i *)(p+i+m-1));
+            uint mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, first),
+                              _mm_cmpeq_epi8(z, last)));
+            while (mask) {
+                int k = __builtin_ctz(mask);
+                if (m <= 2 || !memcmp(p+i+k+1, pat+1, m-2)) return i+k;
+                mask &= mask-1;
+            }
+        }
+    }
+#endif
+    while (i + m <= n) {
+        const uchar *q = memchr(p+i, pat[0], n-m+1 - i);
+        if (!q) break;
+        i = q - p;
+        if (q[m-1] == pat[m-1] && !memcmp(q, pat, m)) return i;
+        i++;
+    }
+    return n;
+}
+
+/* Returns the offset of the last occurrence of pat[0:m] in p[0:n], or n
+   if there is none. */
+static size_t
+rfind_in(const uchar *pat, size_t m, const uchar *p, size_t n)
+{
+    size_t i;
+
+    if (n < m) return n;
+    i = n-m+1; // candidates left: [0, i)
+#ifdef __SSE2__
+    {
+        __m128i first = _mm_set1_epi8((char) pat[0]);
+        __m128i last = _mm_set1_epi8((char) pat[m-1]);
+        for (; i >= 16; i -= 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(p+i-16));
+            __m128i z = _mm_loadu_si128((const __m128i *)(p+i-16+m-1));
+            uint mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, first),
+                              _mm_cmpeq_epi8(z, last)));
+            while (mask) {
+                int k = 31 - __builtin_clz(mask);
+                if (m <= 2 || !memcmp(p+i-16+k+1, pat+1, m-2)) {
+                    return i-16+k;
+                }
+                mask &= ~(1u << k);
+            }
+        }
+    }
+#endif
+    while (i--) {
+        if (p[i] == pat[0] && p[i+m-1] == pat[m-1] && !memcmp(p+i, pat, m)) {
+            return i;
+        }
+    }
+    return n;
+}
+
+/* Whether p[0:m] matches pat under mask, 16 bytes at a time. */
+static int
+masked_eq(const uchar *pat, const uchar *mask, const uchar *p, size_t m)
+{
+    size_t j = 0;
+
+#ifdef __SSE2__
+    for (; j + 16 <= m; j += 16) {
+        __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p+j)),
+                                  _mm_loadu_si128((const __m128i *)(mask+j)));
+        __m128i y = _mm_loadu_si128((const __m128i *)(pat+j));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) return 0;
+    }
+#endif
+    for (; j < m; j++) {
+        if ((p[j] & mask[j]) != pat[j]) return 0;
+    }
+    return 1;
+}
+
+/* Like find_in, but only the bits in mask have to match, and candidates
+   are filtered on the anchor bytes a and z instead of the first and the
+   last. */
+static size_t
+find_masked_in(const uchar *pat, const uchar *mask, size_t m, size_t a,
+               size_t z, const uchar *p, size_t n)
+{
+    size_t i = 0;
+
+    if (n < m) return n;
+#ifdef __SSE2__
+    {
+        __m128i pa = _mm_set1_epi8((char) pat[a]);
+        __m128i ma = _mm_set1_epi8((char) mask[a]);
+        __m128i pz = _mm_set1_epi8((char) pat[z]);
+        __m128i mz = _mm_set1_epi8((char) mask[z]);
+        for (; i + m-1 + 16 <= n; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(p+i+a));
+            __m128i y = _mm_loadu_si128((const __m128i *)(p+i+z));
+            uint bits = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(x, ma), pa),
+                              _mm_cmpeq_epi8(_mm_and_si128(y, mz), pz)));
+            while (bits) {
+                int k = __builtin_ctz(bits);
+                if (masked_eq(pat, mask, p+i+k, m)) return i+k;
+                bits &= bits-1;
+            }
+        }
+    }
+#endif
+    while (i + m <= n) {
+        if (mask[a] == 0xff) {
+            const uchar *q = memchr(p+i+a, pat[a], n-m+1 - i);
+            if (!q) break;
+            i = q - p - a;
+        }
+        if ((p[i+z] & mask[z]) == pat[z] && masked_eq(pat, mask, p+i, m)) {
+            return i;
+        }
+        i++;
+    }
+    return n;
+}
+
+/* Like rfind_in, with a mask as in find_masked_in. */
+static size_t
+rfind_masked_in(const uchar *pat, const uchar *mask, size_t m, size_t a,
+                size_t z, const uchar *p, size_t n)
+{
+    size_t i;
+
+    if (n < m) return n;
+    i = n-m+1;
+#ifdef __SSE2__
+    {
+        __m128i pa = _mm_set1_epi8((char) pat[a]);
+        __m128i ma = _mm_set1_epi8((char) mask[a]);
+        __m128i pz = _mm_set1_epi8((char) pat[z]);
+        __m128i mz = _mm_set1_epi8((char) mask[z]);
+        for (; i >= 16; i -= 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(p+i-16+a));
+            __m128i y = _mm_loadu_si128((const __m128i *)(p+i-16+z));
+            uint bits = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(x, ma), pa),
+                              _mm_cmpeq_epi8(_mm_and_si128(y, mz), pz)));
+            while (bits) {
+                int k = 31 - __builtin_clz(bits);
+                if (masked_eq(pat, mask, p+i-16+k, m)) return i-16+k;
+                bits &= ~(1u << k);
+            }
+        }
+    }
+#endif
+    while (i--) {
+        if ((p[i+a] & mask[a]) == pat[a] && (p[i+z] & mask[z]) == pat[z] &&
+            masked_eq(pat, mask, p+i, m))
+        {
+            return i;
+        }
+    }
+    return n;
+}
+
+/* State of a search. The len-1 bytes seen last are kept in carry, so
+   that matches straddling two spans are found: those before the next
+   span when searching forward, those after it when searching backward. */
+struct finder {
+    const uchar *pat; // already masked, if there is a mask
+    const uchar *mask; // bits that have to match, or 0 for all of them
+    size_t len;
+    size_t a, z; // masked searches filter candidates on these bytes
+    int backward;
+    uchar *carry; // room for 2*(len-1) bytes
+    size_t ncarry;
+    uchar *win; // backward only, as large as carry
+    uint64 pos; // address after the bytes fed, or of the first if backward
+    uint64 found;
+    int zeros; // whether a run of zeros matches
+    PatternMatchProc proc; // finding all, forward only
+    void *arg;
+    int ret; // what proc stopped with
+    volatile LONG *best; // stop once it is below chunk
+    LONG chunk;
+};
+
+static size_t
+find(const struct finder *f, const uchar *p, size_t n)
+{
+    if (f->mask) {
+        return find_masked_in(f->pat, f->mask, f->len, f->a, f->z, p, n);
+    }
+    return find_in(f->pat, f->len, p, n);
+}
+
+static size_t
+rfind(const struct finder *f, const uchar *p, size_t n)
+{
+    if (f->mask) {
+        return rfind_masked_in(f->pat, f->mask, f->len, f->a, f->z, p, n);
+    }
+    return rfind_in(f->pat, f->len, p, n);
+}
+
+/* Reports the matches in p[0:n] that start before lim, p being at addr.
+   Returns 1 if proc stops the search. */
+static int
+report_all(struct finder *f, const uchar *p, size_t n, size_t lim,
+           uint64 addr)
+{
+    size_t i = 0, j;
+
+    while (i < lim && (j = find(f, p+i, n-i)) < n-i && i+j < lim) {
+        f->ret = f->proc(f->arg, 0, addr+i+j);
+        if (f->ret) return 1;
+        i += j+1;
+    }
+    return 0;
+}
+
+/* returns 1 once a match is found, or if proc stops the search */
+static int
+feed(struct finder *f, const uchar *data, size_t n)
+{
+    size_t keep = f->len - 1;
+    size_t i;
+
+    if (f->ncarry) {
+        /* matches starting in carry end within the next keep bytes */
+        size_t k = min(n, keep);
+        memcpy(f->carry + f->ncarry, data, k);
+        if (f->proc) {
+            if (report_all(f, f->carry, f->ncarry + k, f->ncarry,
+                           f->pos - f->ncarry)) return 1;
+        } else if ((i = find(f, f->carry, f->ncarry + k)) <
+                   f->ncarry + k)
+        {
+            f->found = f->pos - f->ncarry + i;
+            return 1;
+        }
+        if (n < keep) {
+            f->ncarry += n;
+            if (f->ncarry > keep) {
+                memmove(f->carry, f->carry + f->ncarry - keep, keep);
+                f->ncarry = keep;
+            }
+            f->pos += n;
+            return 0;
+        }
+    }
+    if (f->proc) {
+        if (report_all(f, data, n, n, f->pos)) return 1;
+    } else if ((i = find(f, data, n)) < n) {
+        f->found = f->pos + i;
+        return 1;
+    }
+    if (n >= keep) {
+        memcpy(f->carry, data + n - keep, keep);
+        f->ncarry = keep;
+    } else {
+        memcpy(f->carry, data, n);
+        f->ncarry = n;
+    }
+    f->pos += n;
+    return 0;
+}
+
+/* feeds the span before the bytes seen so far; returns 1 once a match
+   is found */
+static int
+feed_back(struct finder *f, const uchar *data, size_t n)
+{
+    size_t keep = f->len - 1;
+    size_t i;
+
+    if (f->ncarry) {
+        /* matches ending in carry start within the last keep bytes */
+        size_t k = min(n, keep);
+        memcpy(f->win, data + n - k, k);
+        memcpy(f->win + k, f->carry, f->ncarry);
+        i = rfind(f, f->win, k + f->ncarry);
+        if (i < k + f->ncarry) {
+            f->found = f->pos - k + i;
+            return 1;
+        }
+        if (n < keep) {
+            f->ncarry = min(k + f->ncarry, keep);
+            memcpy(f->carry, f->win, f->ncarry);
+            f->pos -= n;
+            return 0;
+        }
+    }
+    i = rfind(f, data, n);
+    if (i < n) {
+        f->found = f->pos - n + i;
+        return 1;
+    }
+    f->ncarry = min(n, keep);
+    memcpy(f->carry, data, f->ncarry);
+    f->pos -= n;
+    return 0;
+}
+
+/* Feeds n zero bytes. Past the first len of a long run only the last
+   len-1 can be part of a match, so the rest is skipped, unless all the
+   matches within the run are wanted. */
+static int
+feed_zeros(struct finder *f, uint64 n)
+{
+    uint64 head = n > 2 * (uint64) f->len && !(f->proc && f->zeros) ?
+                  f->len : n;
+
+    n -= head;
+    while (head) {
+        size_t k = (size_t) min(head, sizeof zeros);
+        if (f->backward ? feed_back(f, zeros, k) : feed(f, zeros, k)) {
+            return 1;
+        }
+        head -= k;
+    }
+    if (n) {
+        memset(f->carry, 0, f->len - 1);
+        f->ncarry = f->len - 1;
+        f->pos = f->backward ? f->pos - n : f->pos + n;
+    }
+    return 0;
+}
+
+/* whether a chunk before this one has a result, making it moot */
+static int
+beaten(struct finder *f)
+{
+    /* read atomically: other threads lower it */
+    return f->best && InterlockedCompareExchange(f->best, 0, 0) < f->chunk;
+}
+
+static int
+find_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct finder *f = arg;
+
+    if (beaten(f)) return 2;
+    /* unreadable gaps read as zeros */
+    if (addr > f->pos && feed_zeros(f, addr - f->pos)) return 1;
+    return feed(f, data, len);
+}
+
+static int
+rfind_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct finder *f = arg;
+
+    if (beaten(f)) return 2;
+    if (addr + len < f->pos && feed_zeros(f, f->pos - (addr + len))) {
+        return 1;
+    }
+    return feed_back(f, data, len);
+}
+
+/* Bytes to filter masked candidates on score by the bits they fix, and
+   a little more if they are neither 0x00 nor 0xff, which are common in
+   binaries. */
+static int
+anchor_score(uchar c, uchar mask)
+{
+    return 2 * __builtin_popcount(mask) + (mask == 0xff && c && c != 0xff);
+}
+
+static int
+all_zero(const uchar *p, size_t n)
+{
+    for (size_t i=0; i<n; i++) {
+        if (p[i]) return 0;
+    }
+    return 1;
+}
+
+static void
+init_finder(struct finder *f, const uchar *pat, const uchar *mask,
+            size_t len, int backward)
+{
+    uchar *mpat;
+    size_t i;
+
+    assert(len);
+    f->pat = pat;
+    f->mask = 0;
+    f->len = len;
+    f->backward = backward;
+    f->carry = xmalloc(2 * len);
+    f->win = backward ? xmalloc(2 * len) : 0;
+    f->ncarry = 0;
+    f->proc = 0;
+    f->best = 0;
+    for (i=0; mask && i<len; i++) {
+        if (mask[i] != 0xff) break;
+    }
+    if (!mask || i == len) {
+        f->zeros = all_zero(pat, len);
+        return;
+    }
+
+    mpat = xmalloc(len);
+    for (i=0; i<len; i++) mpat[i] = pat[i] & mask[i];
+    f->pat = mpat;
+    f->mask = mask;
+    f->zeros = all_zero(mpat, len);
+    f->a = 0;
+    for (i=1; i<len; i++) {
+        if (anchor_score(mpat[i], mask[i]) >
+            anchor_score(mpat[f->a], mask[f->a])) f->a = i;
+    }
+    f->z = f->a ? 0 : len-1;
+    for (i=0; i<len; i++) {
+        if (i != f->a && anchor_score(mpat[i], mask[i]) >
+                         anchor_score(mpat[f->z], mask[f->z])) f->z = i;
+    }
+}
+
+static void
+free_finder(struct finder *f)
+{
+    if (f->mask) free((uchar *) f->pat);
+    free(f->carry);
+    free(f->win);
+}
+
+/* A search split into chunks for worker threads. Forward, chunk i holds
+   the occurrences starting in [start + i*step, start + (i+1)*step);
+   backward, those ending in (end - (i+1)*step, end - i*step]. Each chunk
+   is searched with len-1 bytes of overlap into the next, so none is
+   missed. */
+struct job {
+    Buffer *b;
+    const uchar *pat;
+    const uchar *mask;
+    size_t len;
+    size_t k; // byte checked against the summaries, or len for none
+    int backward;
+    uint64 start, end;
+    uint64 step;
+    LONG nchunk;
+    volatile LONG next; // last chunk taken
+    /* first match: the first chunk in search order with a result decides
+       it, and chunks after it are dropped */
+    volatile LONG best; // or nchunk
+    CRITICAL_SECTION lock;
+    int ret;
+    uint64 pos;
+    /* finding all: the occurrences of every chunk, merged in order */
+    struct hits *hits;
+};
+
+struct hits {
+    uint64 *addr;
+    size_t n, cap;
+    uint64 resume; // first one not collected, if CHUNK_HITS were
+    int ret;
+};
+
+struct range {
+    uint64 lo, hi;
+};
+
+/* The byte the summaries are asked about: one that has to match in
+   full, preferably not 0x00 or 0xff, which most blocks hold, and then
+   the highest, which text lacks. Returns len if there is none. */
+static size_t
+skip_byte(const uchar *pat, const uchar *mask, size_t len)
+{
+    size_t k = len;
+
+    for (size_t i=0; i<len; i++) {
+        if (mask && mask[i] != 0xff) continue;
+        if (k == len || anchor_score(pat[i], 0xff) * 256 + pat[i] >
+                        anchor_score(pat[k], 0xff) * 256 + pat[k]) k = i;
+    }
+    return k;
+}
+
+/* Splits [lo, hi) into the ranges that may hold matches, in order. A
+   match has pat[k] at offset k, so none starts where that byte would be
+   in a block the summaries show to lack it. Returns how many ranges
+   there are, in *out, which is to be freed. */
+static size_t
+match_ranges(struct job *j, uint64 lo, uint64 hi, struct range **out)
+{
+    struct range *r = xmalloc(sizeof *r);
+    size_t n = 0, cap = 1;
+    uint64 a, last;
+
+    if (j->k == j->len || hi - lo < j->len) {
+        r->lo = lo;
+        r->hi = hi;
+        *out = r;
+        return 1;
+    }
+    /* where pat[k] can be */
+    a = lo + j->k;
+    last = hi - j->len + j->k + 1;
+    while (a < last) {
+        uint64 block = a & -SKIP_BLOCK;
+        uint64 next = min(block + SKIP_BLOCK, last);
+        if (!buf_summary_excludes(j->b, block, SKIP_BLOCK, j->pat[j->k])) {
+            if (n && r[n-1].hi == a) {
+                r[n-1].hi = next;
+            } else {
+                if (n == cap) {
+                    cap *= 2;
+                    r = xrealloc(r, cap * sizeof *r);
+                }
+                r[n].lo = a;
+                r[n].hi = next;
+                n++;
+            }
+        }
+        a = next;
+    }
+    /* and the bytes of the matches around it */
+    for (size_t i=0; i<n; i++) {
+        r[i].lo -= j->k;
+        r[i].hi += j->len-1 - j->k;
+    }
+    *out = r;
+    return n;
+}
+
+static void
+chunk_range(struct job *j, LONG i, uint64 *lo, uint64 *hi)
+{
+    uint64 span = j->step + j->len-1;
+
+    if (j->backward) {
+        *hi = j->end - i * j->step;
+        *lo = *hi - min(*hi - j->start, span);
+    } else {
+        *lo = j->start + i * j->step;
+        *hi = *lo + min(j->end - *lo, span);
+    }
+}
+
+/* Finds the first occurrence of chunk i in search order. Returns like
+   buf_search; a chunk dropped halfway counts as having none. */
+static int
+search_chunk(struct job *j, LONG i, uint64 *pos)
+{
+    struct finder f;
+    struct range *r;
+    uint64 lo, hi;
+    size_t n;
+    int ret = 0;
+
+    chunk_range(j, i, &lo, &hi);
+    n = match_ranges(j, lo, hi, &r);
+    init_finder(&f, j->pat, j->mask, j->len, j->backward);
+    f.best = &j->best;
+    f.chunk = i;
+    if (j->backward) {
+        for (size_t k=n; !ret && k--; ) {
+            f.ncarry = 0;
+            f.pos = r[k].hi;
+            ret = buf_scan_backward(j->b, r[k].lo, r[k].hi - r[k].lo,
+                                    rfind_span, &f);
+            if (!ret && f.pos > r[k].lo) ret = feed_zeros(&f, f.pos - r[k].lo);
+        }
+    } else {
+        for (size_t k=0; !ret && k<n; k++) {
+            f.ncarry = 0;
+            f.pos = r[k].lo;
+            ret = buf_scan(j->b, r[k].lo, r[k].hi - r[k].lo, find_span, &f);
+            if (!ret && f.pos < r[k].hi) ret = feed_zeros(&f, r[k].hi - f.pos);
+        }
+    }
+    free_finder(&f);
+    free(r);
+    if (ret == 1) {
+        *pos = f.found;
+        return 0;
+    }
+    return ret < 0 ? -1 : 1;
+}
+
+/* Reports the occurrences in [lo, hi) to proc, forward. Returns like
+   buf_search_all. */
+static int
+search_all_range(struct job *j, uint64 lo, uint64 hi, PatternMatchProc proc,
+                 void *arg)
+{
+    struct finder f;
+    struct range *r;
+    size_t n = match_ranges(j, lo, hi, &r);
+    int ret = 0;
+
+    init_finder(&f, j->pat, j->mask, j->len, 0);
+    f.proc = proc;
+    f.arg = arg;
+    f.ret = 0;
+    for (size_t k=0; !ret && k<n; k++) {
+        f.ncarry = 0;
+        f.pos = r[k].lo;
+        ret = buf_scan(j->b, r[k].lo, r[k].hi - r[k].lo, find_span, &f);
+        if (!ret && f.pos < r[k].hi) ret = feed_zeros(&f, r[k].hi - f.pos);
+    }
+    free_finder(&f);
+    free(r);
+    if (ret == 1) return f.ret;
+    return ret ? -1 : 0;
+}
+
+static int
+collect(void *arg, int pattern, uint64 addr)
+{
+    struct hits *h = arg;
+
+    if (h->n == CHUNK_HITS) {
+        h->resume = addr;
+        return 1;
+    }
+    if (h->n == h->cap) {
+        h->cap = h->cap ? 2 * h->cap : 256;
+        h->addr = xrealloc(h->addr, h->cap * sizeof *h->addr);
+    }
+    h->addr[h->n++] = addr;
+    return 0;
+}
+
+static DWORD WINAPI
+search_worker(void *arg)
+{
+    struct job *j = arg;
+    LONG i;
+
+    while ((i = InterlockedIncrement(&j->next)) < j->nchunk) {
+        uint64 lo, hi, pos;
+        int ret;
+        if (j->hits) {
+            chunk_range(j, i, &lo, &hi);
+            j->hits[i].ret = search_all_range(j, lo, hi, collect,
+                                              &j->hits[i]);
+            continue;
+        }
+        if (i > InterlockedCompareExchange(&j->best, 0, 0)) break;
+        ret = search_chunk(j, i, &pos);
+        if (ret == 1) continue;
+        EnterCriticalSection(&j->lock);
+        if (i < InterlockedCompareExchange(&j->best, 0, 0)) {
+            InterlockedExchange(&j->best, i);
+            j->ret = ret;
+            j->pos = pos;
+        }
+        LeaveCriticalSection(&j->lock);
+    }
+    return 0;
+}
+
+static void
+init_job(struct job *j, Buffer *b, const uchar *pat, const uchar *mask,
+         size_t len, int backward, uint64 start, uint64 end, uint64 step)
+{
+    assert(len);
+    j->b = b;
+    j->pat = pat;
+    j->mask = mask;
+    j->len = len;
+    j->k = skip_byte(pat, mask, len);
+    j->backward = backward;
+    j->start = start;
+    j->end = end;
+    /* keeps the chunk count within a LONG */
+    j->step = max(step, (end - start) >> 30);
+    j->nchunk = (LONG) max((end - start + j->step-1) / j->step, 1);
+    j->next = 0;
+    j->best = j->nchunk;
+    j->ret = 1;
+    j->hits = 0;
+}
+
+static int
+search(Buffer *b, const uchar *pat, const uchar *mask, size_t len,
+       uint64 start, int backward, uint64 *pos)
+{
+    struct job j;
+    uint64 size = buf_size(b);
+    int ret;
+
+    if (backward) {
+        if (start > size - min(size, len)) start = size - min(size, len);
+        init_job(&j, b, pat, mask, len, 1, 0, min(start + len, size),
+                 CHUNK_SIZE);
+    } else {
+        init_job(&j, b, pat, mask, len, 0, min(start, size), size,
+                 CHUNK_SIZE);
+    }
+    /* most searches end in the first chunk, so only go wide after it */
+    ret = search_chunk(&j, 0, pos);
+    if (ret != 1 || j.nchunk == 1) return ret;
+    InitializeCriticalSection(&j.lock);
+    run_threads(search_worker, &j, min(thread_count(), j.nchunk-1));
+    DeleteCriticalSection(&j.lock);
+    if (j.ret == 0) *pos = j.pos;
+    return j.ret;
+}
+
+/* Finds the first occurrence of pat[0:len] at or after start, reading
+   the buffer a span at a time. Large ranges are split into chunks for
+   several threads, see set_thread_count. Returns 0 and stores its
+   address in *pos if there is one, 1 if not, or -1 on read errors. */
+int
+buf_search(Buffer *b, const uchar *pat, size_t len, uint64 start,
+           uint64 *pos)
+{
+    return search(b, pat, 0, len, start, 0, pos);
+}
+
+/* Finds the last occurrence of pat[0:len] at or before start, reading
+   the buffer backwards a span at a time. Returns like buf_search. */
+int
+buf_search_backward(Buffer *b, const uchar *pat, size_t len, uint64 start,
+                    uint64 *pos)
+{
+    return search(b, pat, 0, len, start, 1, pos);
+}
+
+/* Reports every occurrence of pat[0:len] in [start, end) to proc, in
+   order, overlapping ones included. mask is as in buf_search_masked, or
+   0. proc returns nonzero to stop the search, which should be positive.
+   Returns the value proc stopped with, -1 on read errors, or 0. Large
+   ranges are searched by several threads, but proc is only called on
+   the calling one. */
+int
+buf_search_all(Buffer *b, const uchar *pat, const uchar *mask, size_t len,
+               uint64 start, uint64 end, PatternMatchProc proc, void *arg)
+{
+    struct job j;
+    uint64 size = buf_size(b);
+    int n = thread_count();
+    uint64 nchunk;
+    int ret = 0;
+
+    if (end > size) end = size;
+    if (start > end) start = end;
+    /* a chunk per thread, none smaller than MIN_CHUNK_SIZE, so that a
+       range just over a multiple of it has no sliver left for a thread
+       of its own */
+    nchunk = max(min((end - start) / MIN_CHUNK_SIZE, (uint64) n), 1);
+    init_job(&j, b, pat, mask, len, 0, start, end,
+             (end - start) / nchunk + 1);
+    if (n == 1 || j.nchunk == 1) {
+        return search_all_range(&j, start, end, proc, arg);
+    }
+    j.next = -1;
+    j.hits = xmalloc0(j.nchunk * sizeof *j.hits);
+    run_threads(search_worker, &j, min(n, j.nchunk));
+    for (LONG i=0; i<j.nchunk; i++) {
+        struct hits *h = &j.hits[i];
+        for (size_t k=0; !ret && k<h->n; k++) ret = proc(arg, 0, h->addr[k]);
+        if (!ret && h->ret) {
+            uint64 lo, hi;
+            chunk_range(&j, i, &lo, &hi);
+            ret = h->ret < 0 ? -1 :
+                  search_all_range(&j, h->resume, hi, proc, arg);
+        }
+        if (ret) break;
+    }
+    for (LONG i=0; i<j.nchunk; i++) free(j.hits[i].addr);
+    free(j.hits);
+    return ret;
+}
+
+/* Like buf_search, but a byte matches pat[i] if the bits set in mask[i]
+   are the same. */
+int
+buf_search_masked(Buffer *b, const uchar *pat, const uchar *mask,
+                  size_t len, uint64 start, uint64 *pos)
+{
+    return search(b, pat, mask, len, start, 0, pos);
+}
+
+int
+buf_search_masked_backward(Buffer *b, const uchar *pat, const uchar *mask,
+                           size_t len, uint64 start, uint64 *pos)
+{
+    return search(b, pat, mask, len, start, 1, pos);
+}
+
+struct replace {
+    Buffer *b;
+    size_t len;
+    const uchar *rep;
+    size_t replen;
+    uint64 next; // end of the last occurrence replaced
+    uint64 count;
+};
+
+static int
+queue_replace(void *arg, int pattern, uint64 addr)
+{
+    struct replace *r = arg;
+
+    if (addr < r->next) return 0;
+    if (r->replen == r->len) {
+        /* fixed size buffers take these too */
+        if (buf_batch_replace(r->b, addr, r->rep, r->len)) return -1;
+    } else if (buf_batch_delete(r->b, addr, r->len) ||
+               buf_batch_insert(r->b, addr, r->rep, r->replen))
+    {
+        return -1;
+    }
+    r->next = addr + r->len;
+    r->count++;
+    return 0;
+}
+
+/* Replaces the occurrences of pat[0:len] in [start, end) with
+   rep[0:replen], left to right without overlaps, as a single edit: the
+   occurrences are all found first and the buffer is rebuilt once, so
+   there is one change notification and one undo step. mask is as in
+   buf_search_masked, or 0. Stores how many were replaced in *count.
+   Returns 0, or -1 on read errors or if the edit fails, in which case
+   the buffer is left unchanged. */
+int
+buf_replace_all(Buffer *b, const uchar *pat, const uchar *mask, size_t len,
+                const uchar *rep, size_t replen, uint64 start, uint64 end,
+                uint64 *count)
+{
+    struct replace r;
+
+    if (buf_begin_batch(b)) return -1;
+    r.b = b;
+    r.len = len;
+    r.rep = rep;
+    r.replen = replen;
+    r.next = 0;
+    r.count = 0;
+    if (buf_search_all(b, pat, mask, len, start, end, queue_replace, &r)) {
+        buf_abort_batch(b);
+        return -1;
+    }
+    if (buf_commit(b)) return -1;
+    *count = r.count;
+    return 0;
+}
+
+/* A set of patterns searched for at once, with an Aho-Corasick automaton
+   built on first use. Bytes that behave the same in every pattern share
+   a class, so a DFA row has one entry per class rather than 256. */
+struct pattern_set {
+    int n, cap;
+    uchar **pats;
+    size_t *lens;
+    int *next_same; // next pattern ending in the same state, or -1
+    int built;
+    uchar cls[256];
+    int nclass;
+    uint32 nstates;
+    uint32 *delta; // nstates rows of nclass transitions
+    int *own; // first pattern ending in each state, or -1
+    uint32 *dict; // nearest state down the failure chain with own
+                  // patterns, or 0
+    uchar start[256]; // bytes leading out of the root
+};
+
+PatternSet *
+ps_new(void)
+{
+    PatternSet *ps = xmalloc0(sizeof *ps);
+    return ps;
+}
+
+static void
+ps_clear(PatternSet *ps)
+{
+    free(ps->delta);
+    free(ps->own);
+    free(ps->dict);
+    ps->delta = 0;
+    ps->own = 0;
+    ps->dict = 0;
+    ps->built = 0;
+}
+
+void
+ps_free(PatternSet *ps)
+{
+    if (!ps) return;
+    ps_clear(ps);
+    for (int i=0; i<ps->n; i++) free(ps->pats[i]);
+    free(ps->pats);
+    free(ps->lens);
+    free(ps->next_same);
+    free(ps);
+}
+
+/* Adds pat[0:len] to the set and returns its index, counting from 0, or
+   -1 if it is empty. */
+int
+ps_add(PatternSet *ps, const uchar *pat, size_t len)
+{
+    if (!len) return -1;
+    if (ps->n == ps->cap) {
+        ps->cap = ps->cap ? 2 * ps->cap : 16;
+        ps->pats = xrealloc(ps->pats, ps->cap * sizeof *ps->pats);
+        ps->lens = xrealloc(ps->lens, ps->cap * sizeof *ps->lens);
+        ps->next_same = xrealloc(ps->next_same,
+                                 ps->cap * sizeof *ps->next_same);
+    }
+    ps->pats[ps->n] = xmalloc(len);
+    memcpy(ps->pats[ps->n], pat, len);
+    ps->lens[ps->n] = len;
+    ps_clear(ps);
+    return ps->n++;
+}
+
+int
+ps_count(PatternSet *ps)
+{
+    return ps->n;
+}
+
+static void
+ps_build(PatternSet *ps)
+{
+    uchar used[256];
+    uint64 total = 1;
+    uint32 *fail, *queue;
+    uint32 head = 0, tail = 0;
+    int nc, k;
+
+    memset(used, 0, sizeof used);
+    for (int i=0; i<ps->n; i++) {
+        total += ps->lens[i];
+        for (size_t j=0; j<ps->lens[i]; j++) used[ps->pats[i][j]] = 1;
+    }
+    /* class 0 holds the bytes in no pattern, if there are any */
+    k = memchr(used, 0, sizeof used) ? 1 : 0;
+    for (int c=0; c<256; c++) ps->cls[c] = used[c] ? k++ : 0;
+    ps->nclass = nc = k;
+
+    /* trie; a transition to 0 means there is none yet */
+    ps->delta = xmalloc0((size_t) total * nc * sizeof *ps->delta);
+    ps->own = xmalloc((size_t) total * sizeof *ps->own);
+    ps->dict = xmalloc0((size_t) total * sizeof *ps->dict);
+    ps->own[0] = -1;
+    ps->nstates = 1;
+    for (int i=0; i<ps->n; i++) {
+        uint32 s = 0;
+        for (size_t j=0; j<ps->lens[i]; j++) {
+            uint32 *t = &ps->delta[(size_t) s * nc + ps->cls[ps->pats[i][j]]];
+            if (!*t) {
+                *t = ps->nstates++;
+                ps->own[*t] = -1;
+            }
+            s = *t;
+        }
+        ps->next_same[i] = ps->own[s];
+        ps->own[s] = i;
+    }
+
+    /* breadth first, so that failure targets are complete before they
+       are used */
+    fail = xmalloc((size_t) ps->nstates * sizeof *fail);
+    queue = xmalloc((size_t) ps->nstates * sizeof *queue);
+    fail[0] = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        uint32 s = queue[head++];
+        uint32 *row = ps->delta + (size_t) s * nc;
+        uint32 *frow = ps->delta + (size_t) fail[s] * nc;
+        for (int c=0; c<nc; c++) {
+            uint32 t = row[c];
+            if (!t) {
+                if (s) row[c] = frow[c];
+                continue;
+            }
+            fail[t] = s ? frow[c] : 0;
+            ps->dict[t] = ps->own[fail[t]] >= 0 ? fail[t]
+                                                 : ps->dict[fail[t]];
+            queue[tail++] = t;
+        }
+    }
+    free(fail);
+    free(queue);
+
+    for (int c=0; c<256; c++) {
+        ps->start[c] = ps->delta[ps->cls[c]] != 0;
+    }
+    ps->built = 1;
+}
+
+struct set_scan {
+    PatternSet *ps;
+    uint32 state;
+    uint64 pos; // next address expected from buf_scan
+    PatternMatchProc proc;
+    void *arg;
+};
+
+/* reports the matches ending at addr in state s */
+static int
+report(struct set_scan *sc, uint32 s, uint64 addr)
+{
+    PatternSet *ps = sc->ps;
+    int ret;
+
+    for (uint32 t = ps->own[s] >= 0 ? s : ps->dict[s]; t; t = ps->dict[t]) {
+        for (int i=ps->own[t]; i>=0; i=ps->next_same[i]) {
+            ret = sc->proc(sc->arg, i, addr+1 - ps->lens[i]);
+            if (ret) return ret;
+        }
+    }
+    return 0;
+}
+
+static int
+set_feed(struct set_scan *sc, const uchar *p, size_t n)
+{
+    PatternSet *ps = sc->ps;
+    uint32 s = sc->state;
+    int ret;
+
+    for (size_t i=0; i<n; i++) {
+        if (!s) {
+            /* most bytes leave the root where it is */
+            while (i < n && !ps->start[p[i]]) i++;
+            if (i == n) break;
+        }
+        s = ps->delta[(size_t) s * ps->nclass + ps->cls[p[i]]];
+        if (ps->own[s] >= 0 || ps->dict[s]) {
+            ret = report(sc, s, sc->pos + i);
+            if (ret) return ret;
+        }
+    }
+    sc->state = s;
+    sc->pos += n;
+    return 0;
+}
+
+/* Feeds n zero bytes. Once zeros lead a state back to itself and it
+   reports nothing, the rest of the run can be skipped. */
+static int
+set_feed_zeros(struct set_scan *sc, uint64 n)
+{
+    PatternSet *ps = sc->ps;
+    int ret;
+
+    while (n) {
+        size_t k = (size_t) min(n, sizeof zeros);
+        uint32 s;
+        ret = set_feed(sc, zeros, k);
+        if (ret) return ret;
+        n -= k;
+        s = sc->state;
+        if (ps->delta[(size_t) s * ps->nclass + ps->cls[0]] == s &&
+            ps->own[s] < 0 && !ps->dict[s])
+        {
+            sc->pos += n;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int
+set_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct set_scan *sc = arg;
+    int ret;
+
+    /* unreadable gaps read as zeros */
+    if (addr > sc->pos) {
+        ret = set_feed_zeros(sc, addr - sc->pos);
+        if (ret) return ret;
+    }
+    return set_feed(sc, data, len);
+}
+
+/* Reports every occurrence of the patterns of ps in [start, start+len)
+   to proc, in order of where they end, in a single pass over the
+   buffer. Overlapping occurrences are all reported. proc returns nonzero
+   to stop the search, which should be positive. Returns the value proc
+   stopped with, -1 on read errors, or 0. */
+int
+buf_search_set(Buffer *b, PatternSet *ps, uint64 start, uint64 len,
+               PatternMatchProc proc, void *arg)
+{
+    struct set_scan sc;
+    uint64 size = buf_size(b);
+    int ret;
+
+    if (!ps->n) return 0;
+    if (!ps->built) ps_build(ps);
+    if (start > size) start = size;
+    if (len > size - start) len = size - start;
+    sc.ps = ps;
+    sc.state = 0;
+    sc.pos = start;
+    sc.proc = proc;
+    sc.arg = arg;
+    ret = buf_scan(b, start, len, set_span, &sc);
+    if (!ret && sc.pos < start + len) {
+        ret = set_feed_zeros(&sc, start + len - sc.pos);
+    }
+    return ret;
+}
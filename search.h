@@ -0,0 +1,31 @@
+/* searching buffer contents */
+
+int buf_search(Buffer *, const uchar *pat, size_t len, uint64 start,
+               uint64 *pos);
+int buf_search_backward(Buffer *, const uchar *pat, size_t len,
+                        uint64 start, uint64 *pos);
+int buf_search_masked(Buffer *, const uchar *pat, const uchar *mask,
+                      size_t len, uint64 start, uint64 *pos);
+int buf_search_masked_backward(Buffer *, const uchar *pat,
+                               const uchar *mask, size_t len, uint64 start,
+                               uint64 *pos);
+
+typedef int (*PatternMatchProc)(void *arg, int pattern, uint64 addr);
+
+int buf_search_all(Buffer *, const uchar *pat, const uchar *mask,
+                   size_t len, uint64 start, uint64 end, PatternMatchProc,
+                   void *arg);
+int buf_replace_all(Buffer *, const uchar *pat, const uchar *mask,
+                    size_t len, const uchar *rep, size_t replen,
+                    uint64 start, uint64 end, uint64 *count);
+
+/* multiple patterns at once */
+
+typedef struct pattern_set PatternSet;
+
+PatternSet *ps_new(void);
+void ps_free(PatternSet *);
+int ps_add(PatternSet *, const uchar *pat, size_t len);
+int ps_count(PatternSet *);
+int buf_search_set(Buffer *, PatternSet *, uint64 start, uint64 len,
+                   PatternMatchProc, void *arg);
@@ -0,0 +1,43 @@
+#include "u.h"
+
+#include <windows.h>
+
+#include "threads.h"
+
+static int nthreads; // 0 for one per processor
+
+/* Sets how many threads work on large ranges, in searches, checksums
+   and histograms, 0 meaning one per processor. */
+void
+set_thread_count(int n)
+{
+    nthreads = max(0, min(n, MAX_THREADS));
+}
+
+int
+thread_count(void)
+{
+    if (!nthreads) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        nthreads = max(1, min((int) si.dwNumberOfProcessors, MAX_THREADS));
+    }
+    return nthreads;
+}
+
+/* Runs fn(arg) on n threads, the calling one included, and waits for
+   them. Threads that can't be started are done without. */
+void
+run_threads(LPTHREAD_START_ROUTINE fn, void *arg, int n)
+{
+    HANDLE threads[MAX_THREADS];
+    int k = 0;
+
+    for (int i=1; i<n; i++) {
+        threads[k] = CreateThread(0, 0, fn, arg, 0, 0);
+        if (threads[k]) k++;
+    }
+    fn(arg);
+    if (k) WaitForMultipleObjects(k, threads, TRUE, INFINITE);
+    for (int i=0; i<k; i++) CloseHandle(threads[i]);
+}
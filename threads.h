@@ -0,0 +1,7 @@
+/* running work on several threads */
+
+#define MAX_THREADS 64 // as many as WaitForMultipleObjects waits for
+
+void set_thread_count(int);
+int thread_count(void);
+void run_threads(LPTHREAD_START_ROUTINE, void *arg, int n);
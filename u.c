@@ -106,6 +106,19 @@ rfree(Region *r, void *p)
     r->head = c;
 }
 
+/* bytes allocated by the region */
+size_t
+rsize(Region *r)
+{
+    Chunk *c = r->head;
+    size_t n = 0;
+    while (c) {
+        n += (char *) c->limit - (char *) c;
+        c = c->next;
+    }
+    return n;
+}
+
 /* common definitions for both versions of printf */
 
 #define INIT_BUFSIZE 32
@@ -44,6 +44,7 @@ void *ralloc(Region *r, int size);
 void rinit(Region *r);
 void rfreeall(Region *r);
 void rfree(Region *r, void *p);
+size_t rsize(Region *r);
 
 #define T_(x) x
 #define _TCHAR char
@@ -0,0 +1,433 @@
+#include "u.h"
+
+#include <errno.h>
+#include <math.h>
+
+#include <windows.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "buffer.h"
+#include "search.h"
+#include "value.h"
+
+/* Every type is mapped to an unsigned key of the same order: signed
+   integers have their sign bit flipped, and floats have it flipped if
+   clear, or all bits flipped if set, which puts negative floats below
+   positive ones in reverse order and NaNs outside every range. A query
+   is then the single compare key - lo <= span. */
+struct vscan {
+    int width;
+    int type;
+    int big_endian;
+    int align;
+    uint64 lo, span;
+    uint64 pos; // address of the next byte
+    uchar carry[8]; // the bytes before pos a value may start in
+    size_t ncarry;
+    PatternMatchProc proc;
+    void *arg;
+};
+
+static const uchar zeros[4096];
+
+/* Parses a type such as u8, i32be or f64le: unsigned, signed or float,
+   the width in bits, and the byte order, little endian by default.
+   Values are aligned to their width. Returns 0, or -1 if it is not
+   one. */
+int
+value_parse_type(ValueQuery *q, const char *s)
+{
+    char *end;
+    long bits;
+
+    switch (*s++) {
+    case 'u': q->type = VALUE_UINT; break;
+    case 'i': q->type = VALUE_INT; break;
+    case 'f': q->type = VALUE_FLOAT; break;
+    default: return -1;
+    }
+    if (!isdigit((uchar) *s)) return -1;
+    bits = strtol(s, &end, 10);
+    if (bits != 8 && bits != 16 && bits != 32 && bits != 64) return -1;
+    if (q->type == VALUE_FLOAT && bits < 32) return -1;
+    if (!strcmp(end, "be")) q->big_endian = 1;
+    else if (!*end || !strcmp(end, "le")) q->big_endian = 0;
+    else return -1;
+    q->width = (int) bits / 8;
+    q->align = q->width;
+    return 0;
+}
+
+/* Parses a number of the type of q into *v: decimal or 0x hex for
+   integers. Returns 0, or -1 if it is not one. */
+int
+value_parse(const ValueQuery *q, const char *s, Value *v)
+{
+    char *end;
+
+    errno = 0;
+    switch (q->type) {
+    case VALUE_UINT:
+        if (*s == '-') return -1;
+        v->u = strtoull(s, &end, 0);
+        break;
+    case VALUE_INT:
+        v->i = strtoll(s, &end, 0);
+        break;
+    default:
+        v->f = strtod(s, &end);
+        break;
+    }
+    return end == s || *end || errno == ERANGE && q->type != VALUE_FLOAT
+           ? -1 : 0;
+}
+
+static uint64
+float_key(uint64 bits, int width)
+{
+    uint64 top = (uint64) 1 << (8*width - 1);
+    uint64 mask = top | (top-1);
+    return bits & top ? ~bits & mask : bits | top;
+}
+
+/* Sets the key range of sc from q. Returns -1 if nothing can match. */
+static int
+compile(struct vscan *sc, const ValueQuery *q)
+{
+    int w = q->width;
+    uint64 top = (uint64) 1 << (8*w - 1);
+    uint64 mask = top | (top-1);
+    uint64 lo, hi;
+
+    if (q->type == VALUE_UINT) {
+        lo = q->lo.u;
+        hi = min(q->hi.u, mask);
+    } else if (q->type == VALUE_INT) {
+        int64_t l = max(q->lo.i, -(int64_t)(top-1) - 1);
+        int64_t h = min(q->hi.i, (int64_t)(top-1));
+        if (l > h) return -1;
+        lo = ((uint64) l & mask) ^ top;
+        hi = ((uint64) h & mask) ^ top;
+    } else {
+        double l = q->lo.f, h = q->hi.f;
+        if (!(l <= h)) return -1;
+        /* so that the range takes in both zeros */
+        if (l == 0) l = -0.0;
+        if (h == 0) h = 0.0;
+        if (w == 4) {
+            /* the floats within [l, h] */
+            float fl = (float) l, fh = (float) h;
+            uint32 bl, bh;
+            if (fl < l) fl = nextafterf(fl, INFINITY);
+            if (fh > h) fh = nextafterf(fh, -INFINITY);
+            if (!(fl <= fh)) return -1;
+            memcpy(&bl, &fl, 4);
+            memcpy(&bh, &fh, 4);
+            lo = float_key(bl, 4);
+            hi = float_key(bh, 4);
+        } else {
+            memcpy(&lo, &l, 8);
+            memcpy(&hi, &h, 8);
+            lo = float_key(lo, 8);
+            hi = float_key(hi, 8);
+        }
+    }
+    if (lo > hi) return -1;
+    sc->width = w;
+    sc->type = q->type;
+    sc->big_endian = q->big_endian;
+    sc->align = max(q->align, 1);
+    sc->lo = lo;
+    sc->span = hi - lo;
+    return 0;
+}
+
+static uint64
+load(struct vscan *sc, const uchar *p)
+{
+    uint64 x = 0;
+    int w = sc->width;
+
+    if (sc->big_endian) {
+        for (int i=0; i<w; i++) x = x << 8 | p[i];
+    } else {
+        for (int i=w-1; i>=0; i--) x = x << 8 | p[i];
+    }
+    return x;
+}
+
+static int
+matches(struct vscan *sc, uint64 x)
+{
+    uint64 top = (uint64) 1 << (8*sc->width - 1);
+
+    if (sc->type == VALUE_INT) x ^= top;
+    else if (sc->type == VALUE_FLOAT) x = float_key(x, sc->width);
+    return x - sc->lo <= sc->span;
+}
+
+/* first i at or after from with base+i aligned */
+static size_t
+first_aligned(struct vscan *sc, uint64 base, size_t from)
+{
+    uint64 a = sc->align;
+    return from + (size_t)((a - (base + from) % a) % a);
+}
+
+/* Reports the values in p[0:n] at base starting before p+nstart. */
+static int
+scan_scalar(struct vscan *sc, const uchar *p, size_t n, uint64 base,
+            size_t i, size_t nstart)
+{
+    int ret;
+
+    for (i = first_aligned(sc, base, i);
+         i < nstart && i + sc->width <= n; i += sc->align)
+    {
+        if (matches(sc, load(sc, p+i))) {
+            ret = sc->proc(sc->arg, 0, base+i);
+            if (ret) return ret;
+        }
+    }
+    return 0;
+}
+
+#ifdef __SSE2__
+/* The values starting at p to p+15 that match, bit j for p+j, of each
+   width. A load for each start modulo the number of values per register
+   that is aligned covers them all. Unsigned compares are signed ones
+   with the top bits flipped. */
+
+static uint32
+hits_sse2_8(struct vscan *sc, const uchar *p)
+{
+    __m128i bias = _mm_set1_epi8((char) 0x80);
+    __m128i lo = _mm_set1_epi8((char) sc->lo);
+    __m128i span = _mm_xor_si128(_mm_set1_epi8((char) sc->span), bias);
+    __m128i x = _mm_loadu_si128((const __m128i *) p);
+
+    if (sc->type == VALUE_INT) x = _mm_xor_si128(x, bias);
+    x = _mm_xor_si128(_mm_sub_epi8(x, lo), bias);
+    return ~_mm_movemask_epi8(_mm_cmpgt_epi8(x, span)) & 0xffff;
+}
+
+static uint32
+hits_sse2_16(struct vscan *sc, const uchar *p)
+{
+    __m128i bias = _mm_set1_epi16((short) 0x8000);
+    __m128i lo = _mm_set1_epi16((short) sc->lo);
+    __m128i span = _mm_xor_si128(_mm_set1_epi16((short) sc->span), bias);
+    uint32 hits = 0;
+
+    for (int off=0; off<2; off+=sc->align) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p+off));
+        if (sc->big_endian) {
+            x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        }
+        if (sc->type == VALUE_INT) x = _mm_xor_si128(x, bias);
+        x = _mm_xor_si128(_mm_sub_epi16(x, lo), bias);
+        hits |= (~_mm_movemask_epi8(_mm_cmpgt_epi16(x, span)) & 0x5555)
+                << off;
+    }
+    return hits;
+}
+
+static uint32
+hits_sse2_32(struct vscan *sc, const uchar *p)
+{
+    __m128i bias = _mm_set1_epi32((int) 0x80000000);
+    __m128i lo = _mm_set1_epi32((int)(uint32) sc->lo);
+    __m128i span = _mm_xor_si128(_mm_set1_epi32((int)(uint32) sc->span),
+                                 bias);
+    uint32 hits = 0;
+
+    for (int off=0; off<4; off+=sc->align) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p+off));
+        int m;
+        if (sc->big_endian) {
+            x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            x = _mm_shufflelo_epi16(x, 0xb1);
+            x = _mm_shufflehi_epi16(x, 0xb1);
+        }
+        if (sc->type == VALUE_INT) {
+            x = _mm_xor_si128(x, bias);
+        } else if (sc->type == VALUE_FLOAT) {
+            __m128i s = _mm_srai_epi32(x, 31);
+            x = _mm_xor_si128(x, _mm_or_si128(s, bias));
+        }
+        x = _mm_xor_si128(_mm_sub_epi32(x, lo), bias);
+        m = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(x, span)))
+            & 15;
+        hits |= (m & 1 | (m & 2) << 3 | (m & 4) << 6 | (m & 8) << 9)
+                << off;
+    }
+    return hits;
+}
+
+/* There is no 64-bit compare: a high word greater, or equal with a
+   greater low word, makes the value greater. */
+static uint32
+hits_sse2_64(struct vscan *sc, const uchar *p)
+{
+    __m128i bias = _mm_set1_epi32((int) 0x80000000);
+    __m128i top = _mm_set_epi32((int) 0x80000000, 0, (int) 0x80000000, 0);
+    __m128i lo = _mm_set_epi64x((long long) sc->lo, (long long) sc->lo);
+    __m128i span = _mm_set_epi64x((long long) sc->span,
+                                  (long long) sc->span);
+    __m128i bspan = _mm_xor_si128(span, bias);
+    uint32 hits = 0;
+
+    for (int off=0; off<8; off+=sc->align) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p+off));
+        __m128i gt;
+        int m;
+        if (sc->big_endian) {
+            x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            x = _mm_shufflelo_epi16(x, 0x1b);
+            x = _mm_shufflehi_epi16(x, 0x1b);
+        }
+        if (sc->type == VALUE_INT) {
+            x = _mm_xor_si128(x, top);
+        } else if (sc->type == VALUE_FLOAT) {
+            __m128i s = _mm_shuffle_epi32(_mm_srai_epi32(x, 31), 0xf5);
+            x = _mm_xor_si128(x, _mm_or_si128(s, top));
+        }
+        x = _mm_sub_epi64(x, lo);
+        gt = _mm_cmpgt_epi32(_mm_xor_si128(x, bias), bspan);
+        gt = _mm_or_si128(gt, _mm_and_si128(_mm_cmpeq_epi32(x, span),
+                                            _mm_slli_epi64(gt, 32)));
+        m = ~_mm_movemask_ps(_mm_castsi128_ps(gt));
+        hits |= (m >> 1 & 1 | (m >> 3 & 1) << 8) << off;
+    }
+    return hits;
+}
+
+/* Reports the matches starting from the first aligned one in p, 16
+   starts a step, and sets *pi to where the steps stopped. */
+static int
+scan_sse2(struct vscan *sc, const uchar *p, size_t n, uint64 base,
+          size_t *pi)
+{
+    size_t i = first_aligned(sc, base, 0);
+    int ret;
+
+    for (; i + 15 + sc->width <= n; i += 16) {
+        uint32 hits;
+        switch (sc->width) {
+        case 1: hits = hits_sse2_8(sc, p+i); break;
+        case 2: hits = hits_sse2_16(sc, p+i); break;
+        case 4: hits = hits_sse2_32(sc, p+i); break;
+        default: hits = hits_sse2_64(sc, p+i); break;
+        }
+        while (hits) {
+            int k = 0;
+            while (!(hits >> k & 1)) k++;
+            hits &= hits - 1;
+            ret = sc->proc(sc->arg, 0, base+i+k);
+            if (ret) return ret;
+        }
+    }
+    *pi = i;
+    return 0;
+}
+#endif
+
+static int
+feed(struct vscan *sc, const uchar *p, size_t n)
+{
+    size_t w = sc->width, i = 0, nc = sc->ncarry;
+    uchar tmp[16];
+    int ret;
+
+    /* values starting in the carry */
+    if (nc) {
+        size_t k = min(n, w-1);
+        memcpy(tmp, sc->carry, nc);
+        memcpy(tmp+nc, p, k);
+        ret = scan_scalar(sc, tmp, nc+k, sc->pos - nc, 0, nc);
+        if (ret) return ret;
+    }
+#ifdef __SSE2__
+    if (w % sc->align == 0) {
+        ret = scan_sse2(sc, p, n, sc->pos, &i);
+        if (ret) return ret;
+    }
+#endif
+    ret = scan_scalar(sc, p, n, sc->pos, i, n);
+    if (ret) return ret;
+
+    if (n >= w-1) {
+        memcpy(sc->carry, p + n - (w-1), w-1);
+        sc->ncarry = w-1;
+    } else {
+        size_t k = min(nc + n, w-1);
+        memcpy(tmp, sc->carry, nc);
+        memcpy(tmp+nc, p, n);
+        memcpy(sc->carry, tmp + nc + n - k, k);
+        sc->ncarry = k;
+    }
+    sc->pos += n;
+    return 0;
+}
+
+/* Feeds n zero bytes. If 0 does not match, only the values at the edges
+   of the run need looking at. */
+static int
+feed_zeros(struct vscan *sc, uint64 n)
+{
+    int zero = matches(sc, 0);
+    int ret;
+
+    while (n) {
+        size_t k = (size_t) min(n, sizeof zeros);
+        ret = feed(sc, zeros, k);
+        if (ret) return ret;
+        n -= k;
+        if (!zero) {
+            sc->pos += n;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int
+value_span(void *arg, uint64 addr, const uchar *data, size_t len)
+{
+    struct vscan *sc = arg;
+    int ret;
+
+    /* unreadable gaps read as zeros */
+    if (addr > sc->pos) {
+        ret = feed_zeros(sc, addr - sc->pos);
+        if (ret) return ret;
+    }
+    return feed(sc, data, len);
+}
+
+/* Reports to proc, in order, the address of every value of q's type
+   lying in [start, end) that is within q's bounds. proc returns nonzero
+   to stop the search, which should be positive. Returns the value proc
+   stopped with, -1 on read errors, or 0. */
+int
+buf_search_values(Buffer *b, const ValueQuery *q, uint64 start, uint64 end,
+                  PatternMatchProc proc, void *arg)
+{
+    struct vscan sc;
+    uint64 size = buf_size(b);
+    int ret;
+
+    if (end > size) end = size;
+    if (start > end) start = end;
+    if (compile(&sc, q)) return 0;
+    sc.pos = start;
+    sc.ncarry = 0;
+    sc.proc = proc;
+    sc.arg = arg;
+    ret = buf_scan(b, start, end - start, value_span, &sc);
+    if (!ret && sc.pos < end) ret = feed_zeros(&sc, end - sc.pos);
+    return ret;
+}
@@ -0,0 +1,22 @@
+/* searching for numbers by value */
+
+enum { VALUE_UINT, VALUE_INT, VALUE_FLOAT };
+
+typedef union {
+    uint64 u;
+    int64_t i;
+    double f;
+} Value;
+
+typedef struct {
+    int type;
+    int width; // 1, 2, 4 or 8 bytes; 4 or 8 for floats
+    int big_endian;
+    int align; // values start at multiples of this
+    Value lo, hi; // bounds, inclusive
+} ValueQuery;
+
+int value_parse_type(ValueQuery *, const char *);
+int value_parse(const ValueQuery *, const char *, Value *);
+int buf_search_values(Buffer *, const ValueQuery *, uint64 start,
+                      uint64 end, PatternMatchProc, void *arg);
@@ -7,7 +7,14 @@
 #include <windows.h>
 
 #include "buffer.h"
+#include "approx.h"
+#include "checksum.h"
+#include "entropy.h"
+#include "regex.h"
+#include "search.h"
+#include "threads.h"
 #include "tree.h"
+#include "value.h"
 
 static int
 checkaddr(lua_State *L, int index, uint64 *addr)
@@ -40,7 +47,7 @@ api_buffer_peeku16(lua_State *L)
     } u;
     if (checkaddr(L, 2, &addr)) return 0;
     if (addr+2 > buf_size(b)) return 0;
-    buf_read(b, u.b, addr, 2);
+    if (buf_read(b, u.b, addr, 2)) return luaL_error(L, "read error");
     lua_pushinteger(L, u.i);
     return 1;
 }
@@ -56,7 +63,7 @@ api_buffer_peeku32(lua_State *L)
     } u;
     if (checkaddr(L, 2, &addr)) return 0;
     if (addr+4 > buf_size(b)) return 0;
-    buf_read(b, u.b, addr, 4);
+    if (buf_read(b, u.b, addr, 4)) return luaL_error(L, "read error");
     lua_pushinteger(L, u.i);
     return 1;
 }
@@ -72,7 +79,7 @@ api_buffer_peeku64(lua_State *L)
     } u;
     if (checkaddr(L, 2, &addr)) return 0;
     if (addr+8 > buf_size(b)) return 0;
-    buf_read(b, u.b, addr, 8);
+    if (buf_read(b, u.b, addr, 8)) return luaL_error(L, "read error");
     lua_pushinteger(L, u.i);
     return 1;
 }
@@ -89,7 +96,10 @@ api_buffer_read(lua_State *L)
     n = (long) luaL_checkinteger(L, 3);
     if (addr + n > buf_size(b)) return 0;
     s = xmalloc(n+1);
-    buf_read(b, s, addr, n);
+    if (buf_read(b, s, addr, n)) {
+        free(s);
+        return luaL_error(L, "read error");
+    }
     s[n] = 0;
     lua_pushlstring(L, (char *) s, n);
     free(s);
@@ -200,6 +210,56 @@ api_buffer_size(lua_State *L)
     return 1;
 }
 
+/* buffer:set_io_depth(n) sets how many reads whole-buffer scans keep
+   in flight */
+int
+api_buffer_set_io_depth(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    buf_set_io_depth(b, (int) luaL_checkinteger(L, 2));
+    return 0;
+}
+
+/* whex.set_search_threads(n) sets how many threads searches, checksums
+   and histograms of large ranges use, 0 meaning one per processor */
+int
+api_set_search_threads(lua_State *L)
+{
+    set_thread_count((int) luaL_checkinteger(L, 1));
+    return 0;
+}
+
+/* buffer:set_block_size(bytes) sets the size of cached blocks and of
+   reads by whole-buffer scans; returns false if the size is not
+   supported */
+int
+api_buffer_set_block_size(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    lua_Integer size = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, size > 0, 2, "size must be positive");
+    lua_pushboolean(L, !buf_set_block_size(b, (size_t) size));
+    return 1;
+}
+
+/* buffer:invalidate([addr[, len]]) re-reads data that may have changed
+   underneath, such as the memory of a live process */
+int
+api_buffer_invalidate(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    uint64 addr = 0;
+    uint64 len;
+
+    if (!lua_isnoneornil(L, 2) && checkaddr(L, 2, &addr)) return 0;
+    if (addr > buf_size(b)) return 0;
+    len = buf_size(b) - addr;
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &len)) return 0;
+    buf_invalidate(b, addr, len);
+    return 0;
+}
+
 int
 api_buffer_replace(lua_State *L)
 {
@@ -229,3 +289,763 @@ api_buffer_insert(lua_State *L)
     buf_insert(b, addr, data, len);
     return 0;
 }
+
+/* buffer:clone() returns a copy of the buffer that can be edited
+   without affecting this one */
+int
+api_buffer_clone(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    Buffer *c = lua_newuserdata(L, sizeof_Buffer);
+
+    if (buf_init(c) < 0) return 0;
+    if (buf_clone(c, b)) {
+        buf_finalize(c);
+        return 0;
+    }
+    luaL_setmetatable(L, "buffer");
+    /* same tree */
+    lua_getuservalue(L, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+/* Only clones are ever collected: the buffer of the open file stays
+   reachable from the whex table. */
+int
+api_buffer_gc(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    buf_finalize(b);
+    return 0;
+}
+
+/* buffer:undo() returns the address of the undone edit, or nil if there
+   is nothing to undo */
+int
+api_buffer_undo(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    uint64 addr;
+
+    if (buf_undo(b, &addr)) return 0;
+    lua_pushinteger(L, (lua_Integer) addr);
+    return 1;
+}
+
+int
+api_buffer_redo(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    uint64 addr;
+
+    if (buf_redo(b, &addr)) return 0;
+    lua_pushinteger(L, (lua_Integer) addr);
+    return 1;
+}
+
+/* buffer:set_undo_limit(bytes) caps the memory held by undo history */
+int
+api_buffer_set_undo_limit(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    lua_Integer limit = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, limit >= 0, 2, "negative limit");
+    buf_set_undo_limit(b, (uint64) limit);
+    return 0;
+}
+
+/* buffer:memory() returns a table of the bytes of memory the buffer
+   uses, by kind */
+int
+api_buffer_memory(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    BufMemory m;
+
+    buf_memory(b, &m);
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, (lua_Integer) m.rope);
+    lua_setfield(L, -2, "rope");
+    lua_pushinteger(L, (lua_Integer) m.segments);
+    lua_setfield(L, -2, "segments");
+    lua_pushinteger(L, (lua_Integer) m.data);
+    lua_setfield(L, -2, "data");
+    lua_pushinteger(L, (lua_Integer) m.cache);
+    lua_setfield(L, -2, "cache");
+    lua_pushinteger(L, (lua_Integer) m.undo);
+    lua_setfield(L, -2, "undo");
+    lua_pushinteger(L, (lua_Integer) m.other);
+    lua_setfield(L, -2, "other");
+    lua_pushinteger(L, (lua_Integer) m.total);
+    lua_setfield(L, -2, "total");
+    return 1;
+}
+
+/* buffer:set_memory_limit(soft[, hard]): going over soft compacts the
+   buffer, edits that would go over hard fail; 0 for no limit */
+int
+api_buffer_set_memory_limit(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    lua_Integer soft = luaL_checkinteger(L, 2);
+    lua_Integer hard = luaL_optinteger(L, 3, 0);
+
+    luaL_argcheck(L, soft >= 0, 2, "negative limit");
+    luaL_argcheck(L, hard >= 0, 3, "negative limit");
+    buf_set_memory_limit(b, (uint64) soft, (uint64) hard);
+    return 0;
+}
+
+int
+api_buffer_dirty_ranges(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    BufRange ranges[64];
+    uint64 start = 0;
+    uint64 end = buf_size(b);
+    int i, n, k;
+
+    if (!lua_isnoneornil(L, 2) && checkaddr(L, 2, &start)) return 0;
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &end)) return 0;
+    lua_newtable(L);
+    k = 0;
+    do {
+        n = buf_dirty_ranges(b, start, end, ranges, NELEM(ranges));
+        for (i=0; i<n; i++) {
+            lua_createtable(L, 0, 2);
+            lua_pushinteger(L, ranges[i].start);
+            lua_setfield(L, -2, "start");
+            lua_pushinteger(L, ranges[i].end - ranges[i].start);
+            lua_setfield(L, -2, "size");
+            lua_rawseti(L, -2, ++k);
+        }
+        if (n) start = ranges[n-1].end;
+    } while (n == NELEM(ranges));
+    return 1;
+}
+
+/* buffer:summary([start[, len]]) -> {min, max, zero, uniform, entropy,
+   hist, complete, unreadable}, or nil for an empty range */
+int
+api_buffer_summary(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    uint64 start = 0;
+    uint64 len;
+    BufSummary sm;
+    int i;
+
+    if (!lua_isnoneornil(L, 2) && checkaddr(L, 2, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &len)) return 0;
+    buf_summary(b, start, len, &sm);
+    if (!sm.len) return 0;
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, sm.min);
+    lua_setfield(L, -2, "min");
+    lua_pushinteger(L, sm.max);
+    lua_setfield(L, -2, "max");
+    lua_pushboolean(L, sm.flags & SUM_ZERO);
+    lua_setfield(L, -2, "zero");
+    lua_pushboolean(L, sm.flags & SUM_UNIFORM);
+    lua_setfield(L, -2, "uniform");
+    lua_pushnumber(L, sm.entropy);
+    lua_setfield(L, -2, "entropy");
+    lua_createtable(L, 16, 0);
+    for (i=0; i<16; i++) {
+        lua_pushinteger(L, sm.hist[i]);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_setfield(L, -2, "hist");
+    lua_pushboolean(L, !(sm.flags & SUM_PARTIAL));
+    lua_setfield(L, -2, "complete");
+    lua_pushboolean(L, sm.flags & SUM_UNREADABLE);
+    lua_setfield(L, -2, "unreadable");
+    return 1;
+}
+
+/* buffer:tree_hash([start[, len]]) -> integer; equal ranges hash equal */
+int
+api_buffer_tree_hash(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    uint64 start = 0;
+    uint64 len;
+
+    if (!lua_isnoneornil(L, 2) && checkaddr(L, 2, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &len)) return 0;
+    lua_pushinteger(L, buf_tree_hash(b, start, len));
+    return 1;
+}
+
+/* buffer:hash(algo[, start[, len]]) -> hex digest */
+int
+api_buffer_hash(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    const char *name = luaL_checkstring(L, 2);
+    int algo = ck_lookup(name);
+    uint64 start = 0;
+    uint64 len;
+    uchar digest[CK_MAX_DIGEST];
+    char hex[2*CK_MAX_DIGEST];
+    int n;
+
+    if (algo < 0) return luaL_error(L, "unknown hash algorithm: %s", name);
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 4) && checkaddr(L, 4, &len)) return 0;
+    if (buf_checksum(b, algo, start, len, digest)) {
+        return luaL_error(L, "read error");
+    }
+    n = ck_digest_size(algo);
+    for (int i=0; i<n; i++) {
+        hex[2*i] = "0123456789abcdef"[digest[i] >> 4];
+        hex[2*i+1] = "0123456789abcdef"[digest[i] & 15];
+    }
+    lua_pushlstring(L, hex, 2*n);
+    return 1;
+}
+
+/* buffer:histogram([start[, len]]) -> counts indexed by byte value,
+   entropy in bits per byte */
+int
+api_buffer_histogram(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    uint64 start = 0;
+    uint64 len;
+    uint64 counts[256];
+    uint32 c32[256];
+    uint64 total = 0;
+    int c;
+
+    if (!lua_isnoneornil(L, 2) && checkaddr(L, 2, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &len)) return 0;
+    if (buf_histogram(b, start, len, counts)) {
+        return luaL_error(L, "read error");
+    }
+    lua_createtable(L, 256, 0);
+    for (c=0; c<256; c++) {
+        lua_pushinteger(L, counts[c]);
+        lua_rawseti(L, -2, c);
+        total += counts[c];
+    }
+    /* scale down to 32 bits for byte_entropy; only ratios matter */
+    while (total >> 32) {
+        total = 0;
+        for (c=0; c<256; c++) total += counts[c] >>= 1;
+    }
+    for (c=0; c<256; c++) c32[c] = (uint32) counts[c];
+    lua_pushnumber(L, byte_entropy(c32, total));
+    return 2;
+}
+
+/* buffer:entropy_profile(window[, step]) -> profile of the entropy of
+   each window, kept up to date as the buffer changes. A profile belongs
+   to the file that was open when it was made. */
+int
+api_buffer_entropy_profile(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    lua_Integer window = luaL_checkinteger(L, 2);
+    lua_Integer step = luaL_optinteger(L, 3, window);
+    EntropyProfile **p;
+
+    if (window <= 0 || window > MAX_ENTROPY_WINDOW || step <= 0) {
+        return luaL_error(L, "bad window size");
+    }
+    p = lua_newuserdata(L, sizeof *p);
+    *p = 0;
+    luaL_setmetatable(L, "entropy_profile");
+    /* keeps a clone alive while the profile refers to it; its __gc was
+       set first, so it is also finalized after the profile */
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    *p = ep_new(b, (uint32) window, (uint32) step);
+    if (!*p) {
+        return luaL_error(L, "window must be a small multiple of step");
+    }
+    return 1;
+}
+
+/* the profile at argument 1, brought up to date */
+static EntropyProfile *
+checkprofile(lua_State *L)
+{
+    EntropyProfile **p = luaL_checkudata(L, 1, "entropy_profile");
+    if (!*p) luaL_error(L, "entropy profile freed");
+    if (ep_update(*p)) luaL_error(L, "read error");
+    return *p;
+}
+
+int
+api_profile_count(lua_State *L)
+{
+    lua_pushinteger(L, ep_count(checkprofile(L)));
+    return 1;
+}
+
+/* profile:get(i) -> entropy of window i, counting from 0 */
+int
+api_profile_get(lua_State *L)
+{
+    EntropyProfile *p = checkprofile(L);
+    uint64 i;
+
+    if (checkaddr(L, 2, &i) || i >= ep_count(p)) return 0;
+    lua_pushnumber(L, ep_values(p)[i]);
+    return 1;
+}
+
+/* profile:values([first[, n]]) -> list of entropies */
+int
+api_profile_values(lua_State *L)
+{
+    EntropyProfile *p = checkprofile(L);
+    uint64 count = ep_count(p);
+    uint64 first = 0;
+    uint64 n;
+    const float *v = ep_values(p);
+
+    if (!lua_isnoneornil(L, 2) && checkaddr(L, 2, &first)) return 0;
+    if (first > count) return 0;
+    n = count - first;
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &n)) return 0;
+    if (n > count - first) n = count - first;
+    lua_createtable(L, (int) min(n, 0x7fffffff), 0);
+    for (uint64 i=0; i<n; i++) {
+        lua_pushnumber(L, v[first+i]);
+        lua_rawseti(L, -2, i+1);
+    }
+    return 1;
+}
+
+int
+api_profile_gc(lua_State *L)
+{
+    EntropyProfile **p = luaL_checkudata(L, 1, "entropy_profile");
+    ep_free(*p);
+    *p = 0;
+    return 0;
+}
+
+struct lua_match {
+    lua_State *L;
+    int fn; // stack index
+    int error; // message left on the stack
+};
+
+static int
+call_match_fn(void *arg, int pattern, uint64 addr)
+{
+    struct lua_match *m = arg;
+    lua_State *L = m->L;
+    int stop;
+
+    lua_pushvalue(L, m->fn);
+    lua_pushinteger(L, pattern + 1);
+    lua_pushinteger(L, addr);
+    if (lua_pcall(L, 2, 1, 0)) {
+        m->error = 1;
+        return 1;
+    }
+    stop = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return stop;
+}
+
+/* buffer:find_patterns(patterns, fn[, start[, len]])
+   Calls fn(i, addr) for every occurrence of patterns[i], in order of
+   where they end, reading the buffer once. Stops if fn returns true.
+   fn must not change the buffer. */
+int
+api_buffer_find_patterns(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    uint64 start = 0;
+    uint64 len;
+    lua_Integer n;
+    PatternSet *ps;
+    struct lua_match m;
+    int ret;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    if (!lua_isnoneornil(L, 4) && checkaddr(L, 4, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 5) && checkaddr(L, 5, &len)) return 0;
+    n = lua_rawlen(L, 2);
+    ps = ps_new();
+    for (lua_Integer i=1; i<=n; i++) {
+        size_t plen;
+        const char *pat;
+        lua_rawgeti(L, 2, i);
+        pat = lua_tolstring(L, -1, &plen);
+        if (!pat || !plen) {
+            ps_free(ps);
+            return luaL_error(L, "pattern %d is not a nonempty string",
+                              (int) i);
+        }
+        ps_add(ps, (const uchar *) pat, plen);
+        lua_pop(L, 1);
+    }
+    m.L = L;
+    m.fn = 3;
+    m.error = 0;
+    ret = buf_search_set(b, ps, start, len, call_match_fn, &m);
+    ps_free(ps);
+    if (m.error) return lua_error(L);
+    if (ret < 0) return luaL_error(L, "read error");
+    return 0;
+}
+
+static int
+find_regex(lua_State *L, int backward)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    size_t len;
+    const char *pat = luaL_checklstring(L, 2, &len);
+    const char *err;
+    uint64 addr = backward ? buf_size(b) : 0;
+    uint64 mstart, mend;
+    Regex *re;
+    int ret;
+
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &addr)) return 0;
+    if (addr > buf_size(b)) {
+        if (!backward) return 0;
+        addr = buf_size(b);
+    }
+    re = re_compile((const uchar *) pat, len, &err);
+    if (!re) return luaL_error(L, "%s", err);
+    if (backward) {
+        ret = buf_re_search_backward(b, re, addr, &mstart, &mend);
+    } else {
+        ret = buf_re_search(b, re, addr, &mstart, &mend);
+    }
+    re_free(re);
+    if (ret < 0) return luaL_error(L, "read error");
+    if (ret) return 0;
+    lua_pushinteger(L, (lua_Integer) mstart);
+    lua_pushinteger(L, (lua_Integer) (mend - mstart));
+    return 2;
+}
+
+/* buffer:find_regex(pattern[, start]) -> addr, len
+   First match at or after start, or nil. */
+int
+api_buffer_find_regex(lua_State *L)
+{
+    return find_regex(L, 0);
+}
+
+/* buffer:find_regex_backward(pattern[, end]) -> addr, len
+   Last match ending at or before end, or nil. */
+int
+api_buffer_find_regex_backward(lua_State *L)
+{
+    return find_regex(L, 1);
+}
+
+static int
+append_match(void *arg, int pattern, uint64 addr)
+{
+    lua_State *L = arg;
+    lua_pushinteger(L, (lua_Integer) addr);
+    lua_rawseti(L, -2, (lua_Integer) lua_rawlen(L, -2) + 1);
+    return 0;
+}
+
+/* buffer:find_all(pattern[, start[, len[, mask]]]) -> {addr, ...}
+   Addresses of all occurrences of pattern, overlapping ones included.
+   A byte matches pattern[i] if the bits set in mask[i] are the same. */
+int
+api_buffer_find_all(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    size_t patlen, masklen;
+    const char *pat = luaL_checklstring(L, 2, &patlen);
+    const char *mask = luaL_optlstring(L, 5, 0, &masklen);
+    uint64 start = 0;
+    uint64 len;
+
+    if (!patlen) return luaL_error(L, "empty pattern");
+    if (mask && masklen != patlen) {
+        return luaL_error(L, "mask and pattern differ in length");
+    }
+    if (!lua_isnoneornil(L, 3) && checkaddr(L, 3, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 4) && checkaddr(L, 4, &len)) return 0;
+    if (len > buf_size(b) - start) len = buf_size(b) - start;
+    lua_newtable(L);
+    if (buf_search_all(b, (const uchar *) pat, (const uchar *) mask, patlen,
+                       start, start + len, append_match, L) < 0)
+    {
+        return luaL_error(L, "read error");
+    }
+    return 1;
+}
+
+/* buffer:replace_all(pattern, replacement[, start[, len]]) -> count
+   Replaces the occurrences of pattern left to right as one edit. */
+int
+api_buffer_replace_all(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    size_t patlen, replen;
+    const char *pat = luaL_checklstring(L, 2, &patlen);
+    const char *rep = luaL_checklstring(L, 3, &replen);
+    uint64 start = 0;
+    uint64 len, count;
+
+    if (!patlen) return luaL_error(L, "empty pattern");
+    if (!lua_isnoneornil(L, 4) && checkaddr(L, 4, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 5) && checkaddr(L, 5, &len)) return 0;
+    if (len > buf_size(b) - start) len = buf_size(b) - start;
+    if (buf_replace_all(b, (const uchar *) pat, 0, patlen,
+                        (const uchar *) rep, replen, start, start + len,
+                        &count))
+    {
+        return luaL_error(L, "replace failed");
+    }
+    lua_pushinteger(L, (lua_Integer) count);
+    return 1;
+}
+
+static int
+append_approx(void *arg, uint64 addr, uint64 len, int dist)
+{
+    lua_State *L = arg;
+    lua_createtable(L, 3, 0);
+    lua_pushinteger(L, (lua_Integer) addr);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, (lua_Integer) len);
+    lua_rawseti(L, -2, 2);
+    lua_pushinteger(L, dist);
+    lua_rawseti(L, -2, 3);
+    lua_rawseti(L, -2, (lua_Integer) lua_rawlen(L, -2) + 1);
+    return 0;
+}
+
+/* buffer:find_approx(pattern, k[, edit[, start[, len]]])
+       -> {{addr, len, distance}, ...}
+   Matches of pattern at most k bytes away, by Hamming distance, or by
+   edit distance if edit is true. */
+int
+api_buffer_find_approx(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    size_t patlen;
+    const char *pat = luaL_checklstring(L, 2, &patlen);
+    lua_Integer k = luaL_checkinteger(L, 3);
+    int edit = lua_toboolean(L, 4);
+    uint64 start = 0;
+    uint64 len;
+
+    if (!patlen) return luaL_error(L, "empty pattern");
+    if (patlen > APPROX_MAX) return luaL_error(L, "pattern too long");
+    if (k < 0 || (size_t) k >= patlen) {
+        return luaL_error(L, "distance out of range");
+    }
+    if (!lua_isnoneornil(L, 5) && checkaddr(L, 5, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 6) && checkaddr(L, 6, &len)) return 0;
+    if (len > buf_size(b) - start) len = buf_size(b) - start;
+    lua_newtable(L);
+    if (buf_search_approx(b, (const uchar *) pat, patlen, (int) k, edit,
+                          start, start + len, append_approx, L) < 0)
+    {
+        return luaL_error(L, "read error");
+    }
+    return 1;
+}
+
+static void
+checkvalue(lua_State *L, int index, const ValueQuery *q, Value *v)
+{
+    if (q->type == VALUE_FLOAT) {
+        v->f = luaL_checknumber(L, index);
+    } else {
+        /* wraps around for u64 values past 2^63 */
+        v->i = luaL_checkinteger(L, index);
+    }
+}
+
+/* buffer:find_values(type, low[, high[, align[, start[, len]]]])
+       -> {addr, ...}
+   Addresses of all values of type, such as "u32" or "f64be", between low
+   and high inclusive. Values are aligned to their width by default. */
+int
+api_buffer_find_values(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    ValueQuery q;
+    uint64 start = 0;
+    uint64 len;
+
+    if (value_parse_type(&q, luaL_checkstring(L, 2))) {
+        return luaL_error(L, "bad value type");
+    }
+    checkvalue(L, 3, &q, &q.lo);
+    if (lua_isnoneornil(L, 4)) q.hi = q.lo;
+    else checkvalue(L, 4, &q, &q.hi);
+    if (!lua_isnoneornil(L, 5)) {
+        lua_Integer align = luaL_checkinteger(L, 5);
+        if (align < 1) return luaL_error(L, "bad alignment");
+        q.align = (int) min(align, 1 << 30);
+    }
+    if (!lua_isnoneornil(L, 6) && checkaddr(L, 6, &start)) return 0;
+    if (start > buf_size(b)) return 0;
+    len = buf_size(b) - start;
+    if (!lua_isnoneornil(L, 7) && checkaddr(L, 7, &len)) return 0;
+    if (len > buf_size(b) - start) len = buf_size(b) - start;
+    lua_newtable(L);
+    if (buf_search_values(b, &q, start, start + len, append_match, L) < 0) {
+        return luaL_error(L, "read error");
+    }
+    return 1;
+}
+
+static Buffer *
+checkbatch(lua_State *L)
+{
+    Buffer **tx = luaL_checkudata(L, 1, "batch");
+    if (!*tx) luaL_error(L, "batch already committed");
+    return *tx;
+}
+
+int
+api_batch_replace(lua_State *L)
+{
+    Buffer *b = checkbatch(L);
+    uint64 addr;
+    size_t len;
+    const uchar *data;
+
+    if (checkaddr(L, 2, &addr)) return 0;
+    data = (const uchar *) luaL_checklstring(L, 3, &len);
+    buf_batch_replace(b, addr, data, len);
+    return 0;
+}
+
+int
+api_batch_insert(lua_State *L)
+{
+    Buffer *b = checkbatch(L);
+    uint64 addr;
+    size_t len;
+    const uchar *data;
+
+    if (checkaddr(L, 2, &addr)) return 0;
+    data = (const uchar *) luaL_checklstring(L, 3, &len);
+    buf_batch_insert(b, addr, data, len);
+    return 0;
+}
+
+int
+api_batch_delete(lua_State *L)
+{
+    Buffer *b = checkbatch(L);
+    uint64 addr, len;
+
+    if (checkaddr(L, 2, &addr)) return 0;
+    if (checkaddr(L, 3, &len)) return 0;
+    buf_batch_delete(b, addr, len);
+    return 0;
+}
+
+/* buffer:batch(function(tx) ... end)
+   The edits made through tx are applied together when the function
+   returns, with addresses relative to the buffer before the batch.
+   Returns false if edits overlap, in which case nothing is changed. */
+int
+api_buffer_batch(lua_State *L)
+{
+    Buffer *b = luaL_checkudata(L, 1, "buffer");
+    Buffer **tx;
+    int ok;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    tx = lua_newuserdata(L, sizeof *tx);
+    *tx = 0;
+    luaL_setmetatable(L, "batch");
+    if (buf_begin_batch(b)) return luaL_error(L, "batch already open");
+    *tx = b;
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    if (lua_pcall(L, 1, 0, 0)) {
+        *tx = 0;
+        buf_abort_batch(b);
+        return lua_error(L);
+    }
+    *tx = 0;
+    ok = buf_commit(b) == 0;
+    lua_pushboolean(L, ok);
+    return 1;
+}
+
+#define LISTENERS "buffer.listeners"
+
+/* buffer:on_change(function(addr, removed, inserted) ... end) */
+int
+api_buffer_on_change(lua_State *L)
+{
+    luaL_checkudata(L, 1, "buffer");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LISTENERS) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LISTENERS);
+    }
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+    lua_pop(L, 1);
+    return 0;
+}
+
+/* BufChangeProc calling the functions registered with buffer:on_change */
+void
+notify_lua_listeners(void *arg, uint64 addr, uint64 removed, uint64 inserted)
+{
+    lua_State *L = arg;
+    lua_Integer i, n;
+
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LISTENERS) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+    n = lua_rawlen(L, -1);
+    for (i=1; i<=n; i++) {
+        lua_rawgeti(L, -1, i);
+        lua_pushinteger(L, addr);
+        lua_pushinteger(L, removed);
+        lua_pushinteger(L, inserted);
+        if (lua_pcall(L, 3, 0, 0)) {
+            eprintf("%s\n", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+void
+clear_lua_listeners(lua_State *L)
+{
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LISTENERS);
+}